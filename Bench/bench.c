@@ -0,0 +1,229 @@
+// bench.c - PTY loopback benchmark for the send/receive hot paths
+//
+// An openpty() pair stands in for the serial link. A peer thread on the
+// master side collects each [UART_COM] frame and echoes it back, written in
+// a chosen chunk pattern; the tool side drives send_data_to_device() and
+// read_until_marker() / read_until_marker_ring() against the slave. Reports
+// throughput and round-trip latency percentiles per payload size, chunking
+// pattern and reader.
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#include "../UART/log.h"
+#include "../UART/uart.h"
+
+#define PEER_BUF_MAX (2u * 1024u * 1024u)
+
+struct peer {
+    int fd;                 /* pty master */
+    size_t chunk;           /* echo write size; 0 = whole frame in one write */
+    volatile int stop;
+};
+
+/* echo peer: answer every complete frame with the same frame */
+static void *peer_main(void *arg) {
+    struct peer *p = arg;
+    char *buf = malloc(PEER_BUF_MAX);
+    size_t len = 0;
+    struct marker_scanner sc;
+    marker_scanner_init(&sc, UART_COM_END);
+
+    while (buf && !p->stop) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(p->fd, &rfds);
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        int sel = select(p->fd + 1, &rfds, NULL, NULL, &tv);
+        if (sel <= 0) continue;
+
+        ssize_t r = read(p->fd, buf + len, PEER_BUF_MAX - len);
+        if (r <= 0) {
+            if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            break;
+        }
+        size_t scan_from = len;
+        len += (size_t)r;
+
+        ssize_t hit;
+        while ((hit = marker_scanner_feed(&sc, buf + scan_from, len - scan_from)) >= 0) {
+            size_t end = scan_from + (size_t)hit;
+            size_t step = p->chunk ? p->chunk : end;
+            for (size_t off = 0; off < end; off += step) {
+                size_t n = end - off < step ? end - off : step;
+                if (write_all(p->fd, buf + off, n, 0) != (ssize_t)n) goto out;
+            }
+            memmove(buf, buf + end, len - end);
+            len -= end;
+            scan_from = 0;
+        }
+        if (len == PEER_BUF_MAX) break; /* frame bigger than the peer can hold */
+    }
+out:
+    free(buf);
+    return NULL;
+}
+
+static int discard_piece(void *ctx, const struct iovec *seg, int nseg, int last) {
+    (void)ctx; (void)seg; (void)nseg; (void)last;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double q) {
+    size_t i = (size_t)(q * (double)(n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+enum reader { READER_ALLOC, READER_RING };
+
+/* one benchmark cell; returns 0, or -1 if any round trip failed */
+static int bench_case(int fd, struct rx_ring *ring, size_t payload_len, size_t chunk,
+                      enum reader reader, size_t iters) {
+    char *payload = malloc(payload_len);
+    uint64_t *rtt = malloc(iters * sizeof(*rtt));
+    if (!payload || !rtt) {
+        free(payload);
+        free(rtt);
+        return -1;
+    }
+    for (size_t i = 0; i < payload_len; i++) payload[i] = (char)('a' + i % 26);
+
+    const struct read_timeouts to = { .total_ms = 5000 };
+    size_t frame_len = UART_COM_START_LEN + payload_len + UART_COM_END_LEN;
+    int failed = 0;
+    uint64_t t_start = now_us();
+
+    for (size_t i = 0; i < iters && !failed; i++) {
+        uint64_t t0 = now_us();
+        send_data_to_device(fd, payload, (int)payload_len);
+
+        size_t got = 0;
+        int r;
+        if (reader == READER_RING) {
+            r = read_until_marker_ring(fd, UART_COM_END, &to, ring, NULL, 0, discard_piece, NULL, &got);
+        } else {
+            char *resp = NULL;
+            r = read_until_marker(fd, UART_COM_END, &to, NULL, NULL, &resp, &got);
+            free(resp);
+        }
+        rtt[i] = now_us() - t0;
+        if (r != 0 || got != frame_len) {
+            fprintf(stderr, "bench: round trip %zu failed (status %d, %zu of %zu bytes)\n", i, r, got, frame_len);
+            failed = 1;
+        }
+    }
+
+    uint64_t elapsed = now_us() - t_start;
+    if (!failed) {
+        qsort(rtt, iters, sizeof(*rtt), cmp_u64);
+        double mbps = (double)(frame_len * iters) / (double)elapsed;   /* bytes/us == MB/s */
+        char chunk_s[24];
+        if (chunk) snprintf(chunk_s, sizeof(chunk_s), "%zu", chunk);
+        else snprintf(chunk_s, sizeof(chunk_s), "whole");
+        printf("%8zu  %6s  %-5s  %6zu  %9.2f  %8llu  %8llu  %8llu\n",
+               payload_len, chunk_s, reader == READER_RING ? "ring" : "alloc", iters, mbps,
+               (unsigned long long)percentile(rtt, iters, 0.50),
+               (unsigned long long)percentile(rtt, iters, 0.99),
+               (unsigned long long)percentile(rtt, iters, 0.999));
+        fflush(stdout);
+    }
+    free(payload);
+    free(rtt);
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-h]\n", prog);
+    fprintf(stderr, "  -n <iterations> : Round trips per small-payload case (default 2000);\n");
+    fprintf(stderr, "                    larger payloads scale down to keep each case short\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t base_iters = 2000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n': {
+            char *end = NULL;
+            long v = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || v <= 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            base_iters = (size_t)v;
+            break;
+        }
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* the hot paths must not be measured through the logger */
+    log_level = ERROR;
+
+    int master, slave;
+    if (openpty(&master, &slave, NULL, NULL, NULL) != 0) {
+        perror("openpty");
+        return EXIT_FAILURE;
+    }
+    struct termios raw;
+    tcgetattr(master, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(master, TCSANOW, &raw);
+
+    int fd = serial_port_open(ttyname(slave), 115200);
+    if (fd < 0) return EXIT_FAILURE;
+
+    struct rx_ring ring;
+    if (rx_ring_init(&ring, RX_RING_DEFAULT_CAP) != 0) return EXIT_FAILURE;
+
+    static const size_t sizes[] = { 16, 256, 4096, 65536, 1048576 };
+    static const size_t chunks[] = { 0, 1, 13, 512 };
+    int status = EXIT_SUCCESS;
+
+    printf("%8s  %6s  %-5s  %6s  %9s  %8s  %8s  %8s\n",
+           "payload", "chunk", "read", "iters", "MB/s", "p50_us", "p99_us", "p999_us");
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        struct peer peer = { .fd = master, .chunk = chunks[c] };
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, peer_main, &peer) != 0) return EXIT_FAILURE;
+
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            /* byte-at-a-time echo of large frames measures the pty, not us */
+            if (chunks[c] == 1 && sizes[s] > 4096) continue;
+            size_t iters = base_iters * 256 / (sizes[s] > 256 ? sizes[s] : 256);
+            if (iters < 20) iters = 20;
+            if (bench_case(fd, &ring, sizes[s], chunks[c], READER_ALLOC, iters) != 0 ||
+                bench_case(fd, &ring, sizes[s], chunks[c], READER_RING, iters) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+
+        peer.stop = 1;
+        pthread_join(tid, NULL);
+    }
+
+    rx_ring_free(&ring);
+    close(fd);
+    close(slave);
+    close(master);
+    return status;
+}
@@ -0,0 +1,406 @@
+// check.c - round-trip and malformed-input tests for the codecs (make check)
+//
+// Covers the pieces whose bugs only show on odd inputs: the LZ4 block
+// decoder, the COBS zero scan and its SIMD tails, the varint and CRC-32C
+// wire primitives, and the latency histogram's bucket edges. Exits 1 if
+// any check fails; each failure is printed with its line.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../UART/cobs.h"
+#include "../UART/compress.h"
+#include "../UART/hist.h"
+#include "../UART/libuart.h"
+
+static unsigned failures, checks;
+
+#define CHECK(cond, ...) do {                                       \
+        checks++;                                                   \
+        if (!(cond)) {                                              \
+            failures++;                                             \
+            fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fputc('\n', stderr);                                    \
+        }                                                           \
+    } while (0)
+
+/* xorshift, so every run sees the same "random" data */
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* kinds of test payload: each stresses a different path */
+enum fill { FILL_RANDOM, FILL_TEXT, FILL_RUN, FILL_ZEROS, FILL_SPARSE };
+
+static void fill(unsigned char *p, size_t n, enum fill kind) {
+    for (size_t i = 0; i < n; i++) {
+        switch (kind) {
+        case FILL_RANDOM: p[i] = (unsigned char)rng(); break;
+        case FILL_TEXT: p[i] = (unsigned char)("PING 0123456789 "[(i * 7 + i / 64) % 16]); break;
+        case FILL_RUN: p[i] = 'A'; break;
+        case FILL_ZEROS: p[i] = 0; break;
+        case FILL_SPARSE: p[i] = rng() % 32 ? (unsigned char)(rng() | 1) : 0; break;
+        }
+    }
+}
+
+/* ---- LZ4 ---- */
+
+static void lz4_roundtrip(size_t n, enum fill kind) {
+    unsigned char *src = malloc(n + 1), *dst = malloc(LZ4_BOUND(n)), *out = malloc(n + 1);
+    fill(src, n, kind);
+    size_t c = lz4_compress(src, n, dst, LZ4_BOUND(n));
+    CHECK(c > 0 && c <= LZ4_BOUND(n), "n=%zu kind=%d c=%zu", n, kind, c);
+    CHECK(lz4_decompress(dst, c, out, n) == 0 && memcmp(src, out, n) == 0, "n=%zu kind=%d", n, kind);
+
+    /* the block must expand to exactly out_len */
+    CHECK(lz4_decompress(dst, c, out, n + 1) == -1, "n=%zu kind=%d: accepted a longer out_len", n, kind);
+    if (n > 0)
+        CHECK(lz4_decompress(dst, c, out, n - 1) == -1, "n=%zu kind=%d: accepted a shorter out_len", n, kind);
+
+    /* every truncation is caught: either a field runs off the end, or the
+       output falls short */
+    for (size_t t = 0; n > 0 && t < c; t++)
+        CHECK(lz4_decompress(dst, t, out, n) == -1, "n=%zu kind=%d: accepted %zu of %zu bytes", n, kind, t, c);
+
+    /* a destination too small for the block is refused, not overrun */
+    if (c > 1) {
+        memset(dst, 0xEE, LZ4_BOUND(n));
+        size_t small = lz4_compress(src, n, dst, c - 1);
+        CHECK(small == 0, "n=%zu kind=%d: fit %zu bytes in %zu", n, kind, small, c - 1);
+        for (size_t i = c - 1; i < LZ4_BOUND(n); i++)
+            if (dst[i] != 0xEE) {
+                CHECK(dst[i] == 0xEE, "n=%zu kind=%d: wrote byte %zu past dst_cap %zu", n, kind, i, c - 1);
+                break;
+            }
+    }
+    free(src);
+    free(dst);
+    free(out);
+}
+
+static int lz4_blob(const unsigned char *blob, size_t n, size_t out_len) {
+    unsigned char out[1024];
+    return lz4_decompress(blob, n, out, out_len);
+}
+
+static void lz4_malformed(void) {
+    unsigned char out[64];
+
+    /* control: "abcd", a match of it 4 back, then the 5 closing literals */
+    static const unsigned char ok[] = { 0x40, 'a', 'b', 'c', 'd', 0x04, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z' };
+    CHECK(lz4_decompress(ok, sizeof(ok), out, 13) == 0 && memcmp(out, "abcdabcdvwxyz", 13) == 0, "control block");
+
+    /* an overlapping match (offset 1) repeats the last byte */
+    static const unsigned char rle[] = { 0x1F, 'x', 0x01, 0x00, 0x0A, 0x50, '1', '2', '3', '4', '5' };
+    CHECK(lz4_decompress(rle, sizeof(rle), out, 1 + 29 + 5) == 0 && out[0] == 'x' && out[29] == 'x' && out[30] == '1',
+          "overlapping match");
+
+    static const unsigned char off0[] = { 0x40, 'a', 'b', 'c', 'd', 0x00, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z' };
+    CHECK(lz4_blob(off0, sizeof(off0), 13) == -1, "offset 0");
+
+    static const unsigned char off_past[] = { 0x40, 'a', 'b', 'c', 'd', 0x05, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z' };
+    CHECK(lz4_blob(off_past, sizeof(off_past), 13) == -1, "offset past the start of the output");
+
+    static const unsigned char off_first[] = { 0x00, 0x01, 0x00, 0x50, 'v', 'w', 'x', 'y', 'z' };
+    CHECK(lz4_blob(off_first, sizeof(off_first), 9) == -1, "match before any output");
+
+    static const unsigned char off_max[] = { 0x40, 'a', 'b', 'c', 'd', 0xFF, 0xFF, 0x50, 'v', 'w', 'x', 'y', 'z' };
+    CHECK(lz4_blob(off_max, sizeof(off_max), 13) == -1, "offset 65535 with 4 bytes out");
+
+    /* a token cut off before its offset */
+    static const unsigned char half_off[] = { 0x40, 'a', 'b', 'c', 'd', 0x04 };
+    CHECK(lz4_blob(half_off, sizeof(half_off), 8) == -1, "half an offset");
+
+    /* literal length runs: continuation bytes that end the input, and a
+       length longer than the input or the output */
+    static const unsigned char lit_cut[] = { 0xF0, 0xFF, 0xFF };
+    CHECK(lz4_blob(lit_cut, sizeof(lit_cut), 600) == -1, "literal length run ends the input");
+    unsigned char lit_long[2 + 300];
+    lit_long[0] = 0xF0;
+    lit_long[1] = 0xFF;                 /* 15 + 255 + ... */
+    memset(lit_long + 2, 'q', sizeof(lit_long) - 2);
+    CHECK(lz4_blob(lit_long, sizeof(lit_long), 1024) == -1, "literal run past the input");
+    unsigned char lit_fit[3 + 300];
+    lit_fit[0] = 0xF0;
+    lit_fit[1] = 0xFF;
+    lit_fit[2] = 300 - 15 - 255;
+    memset(lit_fit + 3, 'q', sizeof(lit_fit) - 3);
+    CHECK(lz4_blob(lit_fit, sizeof(lit_fit), 300) == 0, "literal run of exactly 300");
+    CHECK(lz4_blob(lit_fit, sizeof(lit_fit), 299) == -1, "literal run past the output");
+
+    /* match length runs */
+    static const unsigned char m_cut[] = { 0x1F, 'x', 0x01, 0x00, 0xFF, 0xFF };
+    CHECK(lz4_blob(m_cut, sizeof(m_cut), 600) == -1, "match length run ends the input");
+    static const unsigned char m_long[] = { 0x1F, 'x', 0x01, 0x00, 0xFF, 0xFF, 0xFF, 0x10, 0x50, '1', '2', '3', '4', '5' };
+    CHECK(lz4_blob(m_long, sizeof(m_long), 600) == -1, "match run past the output");
+
+    /* a length run of 255s long enough to wrap a 32-bit size */
+    size_t big = 20u * 1000u * 1000u;
+    unsigned char *wrap = malloc(big);
+    wrap[0] = 0xF0;
+    memset(wrap + 1, 0xFF, big - 1);
+    CHECK(lz4_decompress(wrap, big, out, sizeof(out)) == -1, "endless literal length run");
+    free(wrap);
+
+    CHECK(lz4_blob(ok, 0, 0) == 0, "empty block, empty output");
+    CHECK(lz4_blob(ok, 0, 1) == -1, "empty block, one byte expected");
+}
+
+static void check_lz4(void) {
+    /* either side of the 12-byte match limit and the 15/255 length codes */
+    static const size_t sizes[] = { 0, 1, 4, 12, 13, 14, 15, 16, 63, 64, 65, 255, 256, 270, 271, 1000, 4096 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        for (enum fill k = FILL_RANDOM; k <= FILL_SPARSE; k++) lz4_roundtrip(sizes[i], k);
+
+    /* matches more than 64 kB back must not be emitted */
+    size_t n = 200000;
+    unsigned char *src = malloc(n), *dst = malloc(LZ4_BOUND(n)), *out = malloc(n);
+    fill(src, 70000, FILL_RANDOM);
+    for (size_t i = 70000; i < n; i++) src[i] = src[i - 70000];
+    size_t c = lz4_compress(src, n, dst, LZ4_BOUND(n));
+    CHECK(c > 0 && lz4_decompress(dst, c, out, n) == 0 && memcmp(src, out, n) == 0, "far repeat, c=%zu", c);
+    fill(src, n, FILL_RUN);
+    c = lz4_compress(src, n, dst, LZ4_BOUND(n));
+    CHECK(c > 0 && c < n / 100 && lz4_decompress(dst, c, out, n) == 0 && memcmp(src, out, n) == 0, "long run, c=%zu", c);
+    free(src);
+    free(dst);
+    free(out);
+
+    lz4_malformed();
+}
+
+/* ---- COBS ---- */
+
+static void check_cobs_zero(void) {
+    /* lengths across the 16-byte step, the 64-byte fold and the
+       overlapping tail load; a few misalignments of the start */
+    static unsigned char buf[16 + 300];
+    static const size_t shifts[] = { 0, 1, 7, 15 };
+    for (size_t s = 0; s < sizeof(shifts) / sizeof(shifts[0]); s++) {
+        unsigned char *p = buf + shifts[s];
+        for (size_t n = 0; n <= 300; n++) {
+            memset(buf, 0x01, sizeof(buf));
+            /* zeros just outside [0, n) must not be seen */
+            if (shifts[s]) p[-1] = 0;
+            p[n] = 0;
+            CHECK(cobs_zero(p, n) == n, "n=%zu shift=%zu: found a zero in clean data", n, shifts[s]);
+            for (size_t z = 0; z < n; z++) {
+                p[z] = 0;
+                size_t got = cobs_zero(p, n);
+                if (got != z) CHECK(got == z, "n=%zu shift=%zu zero at %zu: got %zu", n, shifts[s], z, got);
+                /* a later zero does not hide the first */
+                if (z + 1 < n) {
+                    p[n - 1] = 0;
+                    got = cobs_zero(p, n);
+                    if (got != z) CHECK(got == z, "n=%zu shift=%zu zeros at %zu and %zu: got %zu", n, shifts[s], z, n - 1, got);
+                    p[n - 1] = 0x01;
+                }
+                p[z] = 0x01;
+            }
+        }
+    }
+}
+
+static void cobs_roundtrip(size_t n, enum fill kind) {
+    unsigned char *src = malloc(n + 1), *enc = malloc(COBS_BOUND(n)), *out = malloc(n + 1);
+    fill(src, n, kind);
+
+    /* fed whole, then in two pieces split across the input */
+    size_t splits[] = { n, n / 2, n > 0 ? 1 : 0, n > 254 ? 254 : n };
+    for (size_t s = 0; s < sizeof(splits) / sizeof(splits[0]); s++) {
+        struct cobs_enc e;
+        cobs_enc_init(&e, enc);
+        cobs_enc_update(&e, src, splits[s]);
+        cobs_enc_update(&e, src + splits[s], n - splits[s]);
+        size_t len = cobs_enc_finish(&e);
+        CHECK(len <= COBS_BOUND(n), "n=%zu kind=%d: %zu encoded bytes", n, kind, len);
+        CHECK(memchr(enc, 0, len) == NULL, "n=%zu kind=%d split=%zu: zero in the output", n, kind, splits[s]);
+        size_t olen = 0;
+        CHECK(cobs_decode(enc, len, out, &olen) == 0 && olen == n && memcmp(src, out, n) == 0,
+              "n=%zu kind=%d split=%zu: decoded %zu", n, kind, splits[s], olen);
+        /* in place */
+        CHECK(cobs_decode(enc, len, enc, &olen) == 0 && olen == n && memcmp(src, enc, n) == 0,
+              "n=%zu kind=%d split=%zu: in-place decode", n, kind, splits[s]);
+    }
+    free(src);
+    free(enc);
+    free(out);
+}
+
+static void check_cobs(void) {
+    check_cobs_zero();
+
+    /* around every multiple of 254 (the longest block) up to a few blocks,
+       which also crosses the multiples of 16 and 64 */
+    for (size_t n = 0; n <= 1100; n++)
+        for (enum fill k = FILL_RANDOM; k <= FILL_SPARSE; k++) cobs_roundtrip(n, k);
+
+    unsigned char out[16];
+    size_t olen;
+    static const unsigned char zero_code[] = { 0x02, 'a', 0x00, 'b' };
+    CHECK(cobs_decode(zero_code, sizeof(zero_code), out, &olen) == -1, "zero code byte");
+    static const unsigned char overrun[] = { 0x05, 'a', 'b', 'c' };
+    CHECK(cobs_decode(overrun, sizeof(overrun), out, &olen) == -1, "block past the end");
+    static const unsigned char exact[] = { 0x04, 'a', 'b', 'c' };
+    CHECK(cobs_decode(exact, sizeof(exact), out, &olen) == 0 && olen == 3, "block to the end");
+
+    /* whole frames with their CRC */
+    unsigned char frame[2 + COBS_BOUND(300 + UART_CRC_LEN)], payload[300];
+    fill(payload, sizeof(payload), FILL_SPARSE);
+    size_t flen = uart_cobs_frame(payload, sizeof(payload), frame);
+    CHECK(frame[0] == 0 && frame[flen - 1] == 0 && memchr(frame + 1, 0, flen - 2) == NULL, "frame delimiters");
+    size_t plen = 0;
+    CHECK(uart_cobs_check(frame + 1, flen - 2, &plen) == 1 && plen == sizeof(payload) && memcmp(frame + 1, payload, plen) == 0,
+          "frame round trip");
+    flen = uart_cobs_frame(payload, sizeof(payload), frame);
+    frame[flen / 2] = frame[flen / 2] == 0x41 ? 0x42 : 0x41;
+    CHECK(uart_cobs_check(frame + 1, flen - 2, &plen) != 1, "corrupt frame accepted");
+    static unsigned char too_short[] = { 0x04, 'a', 'b', 'c' };
+    CHECK(uart_cobs_check(too_short, sizeof(too_short), &plen) == 0, "frame shorter than its CRC");
+}
+
+/* ---- varint and CRC-32C ---- */
+
+static void check_varint(void) {
+    static const uint64_t values[] = {
+        0, 1, 127, 128, 255, 16383, 16384, (1u << 21) - 1, 1u << 21, (1u << 28) - 1, 1u << 28,
+        UART_FRAME_MAX_LEN, UINT32_MAX, (UINT64_C(1) << 35) - 1,
+    };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        unsigned char b[UART_VARINT_MAX + 1];
+        size_t n = uart_varint_put(values[i], b), used = 0;
+        uint64_t v = 0;
+        CHECK(n >= 1 && n <= UART_VARINT_MAX, "%llu: %zu bytes", (unsigned long long)values[i], n);
+        CHECK(uart_varint_get(b, n, &v, &used) == 1 && v == values[i] && used == n, "%llu: read back %llu",
+              (unsigned long long)values[i], (unsigned long long)v);
+        /* trailing bytes are not consumed */
+        b[n] = 0x55;
+        CHECK(uart_varint_get(b, n + 1, &v, &used) == 1 && used == n, "%llu with a trailing byte", (unsigned long long)values[i]);
+        for (size_t t = 0; t < n; t++)
+            CHECK(uart_varint_get(b, t, &v, &used) == 0, "%llu cut to %zu bytes", (unsigned long long)values[i], t);
+    }
+
+    unsigned char endless[UART_VARINT_MAX + 3];
+    memset(endless, 0x80, sizeof(endless));
+    uint64_t v;
+    size_t used;
+    CHECK(uart_varint_get(endless, UART_VARINT_MAX - 1, &v, &used) == 0, "short continuation run");
+    CHECK(uart_varint_get(endless, UART_VARINT_MAX, &v, &used) == -1, "continuation run of UART_VARINT_MAX");
+    CHECK(uart_varint_get(endless, sizeof(endless), &v, &used) == -1, "continuation run past UART_VARINT_MAX");
+
+    unsigned char hdr[1 + UART_VARINT_MAX];
+    uint32_t crc;
+    size_t h = uart_bin_header(UART_BIN_SYNC, 300, hdr, &crc);
+    CHECK(h == 3 && hdr[0] == UART_BIN_SYNC && crc == uart_crc32c(0, hdr + 1, 2), "binary header");
+}
+
+/* bit at a time, straight from the polynomial */
+static uint32_t crc32c_ref(uint32_t crc, const unsigned char *p, size_t n) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static void check_crc(void) {
+    CHECK(uart_crc32c(0, "123456789", 9) == 0xE3069283u, "check value: %08x", uart_crc32c(0, "123456789", 9));
+    CHECK(uart_crc32c(0, "", 0) == 0, "empty input");
+
+    /* every length through a few 8-byte steps, at every alignment */
+    unsigned char buf[8 + 200];
+    fill(buf, sizeof(buf), FILL_RANDOM);
+    for (size_t off = 0; off < 8; off++)
+        for (size_t n = 0; n <= 200; n++) {
+            uint32_t got = uart_crc32c(0, buf + off, n), want = crc32c_ref(0, buf + off, n);
+            if (got != want) CHECK(got == want, "off=%zu n=%zu: %08x, want %08x", off, n, got, want);
+        }
+
+    /* continuing a CRC across pieces equals one pass */
+    for (size_t cut = 0; cut <= 200; cut += 13) {
+        uint32_t whole = uart_crc32c(0, buf, 200);
+        uint32_t parts = uart_crc32c(uart_crc32c(0, buf, cut), buf + cut, 200 - cut);
+        CHECK(whole == parts, "cut at %zu", cut);
+    }
+
+    unsigned char le[UART_CRC_LEN];
+    uart_crc_put(le, 0x12345678u);
+    CHECK(le[0] == 0x78 && le[3] == 0x12 && uart_crc_get(le) == 0x12345678u, "little-endian trailer");
+}
+
+/* ---- histogram ---- */
+
+/* top of v's bucket, read back through the percentile: with v and a far
+   larger value recorded, the 50th percentile is v's bucket */
+static uint64_t bucket_top_of(uint64_t v) {
+    static struct lat_hist h;
+    lat_hist_init(&h);
+    lat_hist_record(&h, v);
+    lat_hist_record(&h, UINT64_MAX);
+    return lat_hist_percentile(&h, 50);
+}
+
+static void check_hist(void) {
+    uint64_t sub = 1u << HIST_SUB_BITS;
+
+    /* below 2^HIST_SUB_BITS every value is its own bucket */
+    for (uint64_t v = 0; v < sub; v++) CHECK(bucket_top_of(v) == v, "exact bucket %llu", (unsigned long long)v);
+
+    /* either side of each power of two: 2^k - 1 always tops a bucket, and
+       no value is ever reported low or more than 1/64 high */
+    uint64_t prev = 0;
+    for (unsigned k = HIST_SUB_BITS; k <= HIST_MAX_BITS; k++) {
+        uint64_t p = UINT64_C(1) << k;
+        CHECK(bucket_top_of(p - 1) == p - 1, "2^%u - 1 is a bucket top", k);
+        uint64_t edges[] = { p - 2, p - 1, p, p + 1, p + (p >> 6) - 1, p + (p >> 6), p + p / 2, 2 * p - 2 };
+        for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+            uint64_t v = edges[i], top = bucket_top_of(v);
+            CHECK(top >= v && top - v <= v >> (HIST_SUB_BITS - 1), "2^%u edge %llu: top %llu", k,
+                  (unsigned long long)v, (unsigned long long)top);
+            if (v > prev) CHECK(top >= bucket_top_of(prev), "tops not monotonic at %llu", (unsigned long long)v);
+            prev = v;
+        }
+        /* the first bucket of 2^k is one value wide at 2^HIST_SUB_BITS and
+           doubles with each power */
+        CHECK(bucket_top_of(p) == p + (p >> (HIST_SUB_BITS - 1)) - 1, "first bucket above 2^%u", k);
+    }
+
+    /* every value in a stretch past the exact range */
+    for (uint64_t v = sub; v < 8 * sub; v++) {
+        uint64_t top = bucket_top_of(v);
+        if (top < v || top - v > v >> (HIST_SUB_BITS - 1))
+            CHECK(0, "%llu: top %llu", (unsigned long long)v, (unsigned long long)top);
+    }
+
+    /* past the range everything shares the last bucket, and the reported
+       value never exceeds the largest recorded */
+    uint64_t last = bucket_top_of(UINT64_C(1) << (HIST_MAX_BITS + 1));
+    CHECK(bucket_top_of(UINT64_MAX - 1) == last, "clamped to the last bucket");
+    static struct lat_hist h;
+    lat_hist_init(&h);
+    CHECK(lat_hist_percentile(&h, 50) == 0, "empty histogram");
+    lat_hist_record(&h, 1000);
+    CHECK(lat_hist_percentile(&h, 0) == 1000 && lat_hist_percentile(&h, 100) == 1000, "single value clamped to max");
+    for (uint64_t v = 1; v <= 100; v++) lat_hist_record(&h, v);
+    CHECK(lat_hist_percentile(&h, 50) == 51, "p50 of 1..100 and 1000: %llu", (unsigned long long)lat_hist_percentile(&h, 50));
+    CHECK(lat_hist_percentile(&h, 100) == 1000, "p100");
+}
+
+int main(void) {
+    check_lz4();
+    check_cobs();
+    check_varint();
+    check_crc();
+    check_hist();
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+// capture.c - TX/RX traffic capture into a preallocated, memory-mapped file
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+_Static_assert(sizeof(struct capture_extent) <= CAPTURE_HDR_SIZE, "extent header must fit its page");
+
+#define PAD8(n) (((n) + 7u) & ~(uint64_t)7u)
+#define INDEX_STEP ((CAPTURE_EXTENT - CAPTURE_HDR_SIZE) / CAPTURE_INDEX_SLOTS)
+
+static uint64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/* reserve and map the next extent. The blocks are allocated up front where
+   the platform can (so a full disk fails here, not as SIGBUS in memcpy). */
+static int capture_extend(struct capture *c) {
+    if (c->cur) {
+        munmap(c->cur, CAPTURE_EXTENT);
+        c->cur = NULL;
+    }
+    off_t at = (off_t)(c->nextents * CAPTURE_EXTENT);
+#ifdef __linux__
+    int e = posix_fallocate(c->fd, at, CAPTURE_EXTENT);
+    if (e != 0) {
+        errno = e;
+        return -1;
+    }
+#else
+    if (ftruncate(c->fd, at + CAPTURE_EXTENT) != 0) return -1;
+#endif
+    void *m = mmap(NULL, CAPTURE_EXTENT, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, at);
+    if (m == MAP_FAILED) return -1;
+
+    struct capture_extent *x = m;
+    memcpy(x->magic, CAPTURE_MAGIC, sizeof(x->magic));
+    x->version = CAPTURE_VERSION;
+    x->hdr_size = CAPTURE_HDR_SIZE;
+    x->extent_size = CAPTURE_EXTENT;
+    c->cur = x;
+    c->nextents++;
+    return 0;
+}
+
+int capture_open(struct capture *c, const char *path) {
+    memset(c, 0, sizeof(*c));
+    c->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (c->fd < 0) {
+        log_error("Cannot create capture file %s", path);
+        return -1;
+    }
+    if (capture_extend(c) != 0) {
+        log_error("Cannot preallocate capture file %s", path);
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* first n bytes of iov as one record (several if it outgrows the extent).
+   The clock is clamped so times never go backwards within a file, which
+   keeps the index sorted across wall-clock steps. */
+void capture_record_iov(struct capture *c, int dir, int chan, const struct iovec *iov, int iovcnt, size_t n) {
+    if (c->failed || n == 0) return;
+    uint64_t t = wall_us();
+    if (t < c->last_us) t = c->last_us;
+    c->last_us = t;
+
+    int i = 0;
+    size_t in = 0;   /* offset within iov[i] */
+    while (n > 0) {
+        struct capture_extent *x = c->cur;
+        uint64_t room = CAPTURE_EXTENT - CAPTURE_HDR_SIZE - x->used;
+        if (room < CAPTURE_REC_HDR + 8) {
+            if (capture_extend(c) != 0) {
+                log_warning("Capture stopped: cannot grow the file");
+                c->failed = 1;
+                return;
+            }
+            continue;
+        }
+        size_t len = n;
+        if (CAPTURE_REC_HDR + PAD8(len) > room) len = (size_t)(room - CAPTURE_REC_HDR);
+
+        uint64_t off = CAPTURE_HDR_SIZE + x->used;
+        unsigned char *rec = (unsigned char *)x + off;
+        uint32_t len32 = (uint32_t)len;
+        memcpy(rec, &t, 8);
+        memcpy(rec + 8, &len32, 4);
+        rec[12] = (unsigned char)dir;
+        rec[13] = (unsigned char)chan;
+        for (size_t done = 0; done < len && i < iovcnt; i++, in = 0) {
+            size_t k = iov[i].iov_len - in;
+            if (k > len - done) k = len - done;
+            memcpy(rec + CAPTURE_REC_HDR + done, (const char *)iov[i].iov_base + in, k);
+            done += k;
+            in += k;
+            if (in < iov[i].iov_len) break;
+        }
+
+        if (x->nindex < CAPTURE_INDEX_SLOTS && x->used >= (uint64_t)x->nindex * INDEX_STEP) {
+            x->index[x->nindex].t_us = t;
+            x->index[x->nindex].offset = off;
+            x->nindex++;
+        }
+        if (x->used == 0) x->first_us = t;
+        x->last_us = t;
+        x->used += CAPTURE_REC_HDR + PAD8(len);   /* publishes the record */
+        c->records++;
+        c->bytes += len;
+        n -= len;
+    }
+}
+
+void capture_record(struct capture *c, int dir, int chan, const void *data, size_t n) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = n };
+    capture_record_iov(c, dir, chan, &iov, 1, n);
+}
+
+/* cut the preallocated tail of the last extent off */
+void capture_close(struct capture *c) {
+    if (c->fd < 0) return;
+    if (c->cur) {
+        off_t end = (off_t)((c->nextents - 1) * CAPTURE_EXTENT + CAPTURE_HDR_SIZE + c->cur->used);
+        munmap(c->cur, CAPTURE_EXTENT);
+        c->cur = NULL;
+        if (ftruncate(c->fd, end) != 0) log_warning("Cannot trim capture file");
+    }
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* ---- reader ---- */
+
+static int read_extent_hdr(const struct capture_reader *r, uint64_t k, struct capture_extent *x) {
+    off_t at = (off_t)(k * r->extent_size);
+    return pread(r->fd, x, sizeof(*x), at) == (ssize_t)sizeof(*x) ? 0 : -1;
+}
+
+/* file size may still be growing under a live writer */
+static void reader_refresh(struct capture_reader *r) {
+    struct stat st;
+    if (fstat(r->fd, &st) != 0) return;
+    r->file_size = (uint64_t)st.st_size;
+    r->nextents = (r->file_size + r->extent_size - 1) / r->extent_size;
+}
+
+static int reader_map(struct capture_reader *r, uint64_t k) {
+    if (r->map) munmap(r->map, r->map_len);
+    r->map = NULL;
+    uint64_t at = k * r->extent_size;
+    uint64_t len = r->file_size - at < r->extent_size ? r->file_size - at : r->extent_size;
+    if (len < CAPTURE_HDR_SIZE) return -1;
+    void *m = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, r->fd, (off_t)at);
+    if (m == MAP_FAILED) return -1;
+    r->map = m;
+    r->map_len = (size_t)len;
+    r->ext = k;
+    r->pos = CAPTURE_HDR_SIZE;
+    return 0;
+}
+
+int capture_reader_open(struct capture_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        log_error("Cannot open capture %s", path);
+        return -1;
+    }
+    struct capture_extent x;
+    r->extent_size = CAPTURE_HDR_SIZE;
+    if (read_extent_hdr(r, 0, &x) != 0 || memcmp(x.magic, CAPTURE_MAGIC, sizeof(x.magic)) != 0 ||
+        x.version != CAPTURE_VERSION || x.hdr_size != CAPTURE_HDR_SIZE ||
+        x.extent_size < 2 * CAPTURE_HDR_SIZE || x.extent_size % (uint64_t)sysconf(_SC_PAGESIZE) != 0) {
+        errno = 0;
+        log_error("%s is not a capture file", path);
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    r->extent_size = x.extent_size;
+    reader_refresh(r);
+    if (reader_map(r, 0) != 0) {
+        log_error("Cannot map capture %s", path);
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t capture_reader_start(const struct capture_reader *r) {
+    return ((const struct capture_extent *)r->map)->first_us;
+}
+
+static int reader_peek(struct capture_reader *r, struct capture_rec *rec) {
+    const struct capture_extent *x = (const struct capture_extent *)r->map;
+    uint64_t end = CAPTURE_HDR_SIZE + x->used;
+    if (end > r->map_len) return -1;
+    if (r->pos >= end) return 0;
+    if (end - r->pos < CAPTURE_REC_HDR) return -1;
+
+    const unsigned char *p = r->map + r->pos;
+    uint32_t len32;
+    memcpy(&rec->t_us, p, 8);
+    memcpy(&len32, p + 8, 4);
+    if (PAD8((uint64_t)len32) > end - r->pos - CAPTURE_REC_HDR) return -1;
+    rec->len = len32;
+    rec->dir = p[12];
+    rec->chan = p[13];
+    rec->data = p + CAPTURE_REC_HDR;
+    return 1;
+}
+
+int capture_reader_next(struct capture_reader *r, struct capture_rec *rec) {
+    for (;;) {
+        int v = reader_peek(r, rec);
+        if (v != 0) {
+            if (v == 1) r->pos += CAPTURE_REC_HDR + PAD8((uint64_t)rec->len);
+            return v;
+        }
+        if (r->ext + 1 >= r->nextents) reader_refresh(r);
+        if (r->ext + 1 >= r->nextents) return 0;
+        if (reader_map(r, r->ext + 1) != 0) return -1;
+    }
+}
+
+int capture_reader_seek(struct capture_reader *r, uint64_t t_us) {
+    reader_refresh(r);
+
+    /* last extent that starts at or before t_us: one header read per step */
+    uint64_t lo = 0, hi = r->nextents ? r->nextents - 1 : 0;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo + 1) / 2;
+        struct capture_extent x;
+        if (read_extent_hdr(r, mid, &x) != 0) return -1;
+        if (x.used > 0 && x.first_us <= t_us) lo = mid;
+        else hi = mid - 1;
+    }
+    if (reader_map(r, lo) != 0) return -1;
+
+    /* last index entry strictly before t_us, so equal times are not skipped */
+    const struct capture_extent *x = (const struct capture_extent *)r->map;
+    uint32_t a = 0, b = x->nindex;
+    while (a < b) {
+        uint32_t mid = a + (b - a) / 2;
+        if (x->index[mid].t_us < t_us) a = mid + 1;
+        else b = mid;
+    }
+    if (a > 0) r->pos = x->index[a - 1].offset;
+
+    /* at most one index step of records to walk */
+    struct capture_rec rec;
+    for (;;) {
+        int v = reader_peek(r, &rec);
+        if (v < 0) return -1;
+        if (v == 0 || rec.t_us >= t_us) return 0;
+        r->pos += CAPTURE_REC_HDR + PAD8((uint64_t)rec.len);
+    }
+}
+
+void capture_reader_close(struct capture_reader *r) {
+    if (r->map) munmap(r->map, r->map_len);
+    r->map = NULL;
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
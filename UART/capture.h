@@ -0,0 +1,91 @@
+// capture.h - TX/RX traffic capture into a preallocated, memory-mapped file
+#ifndef UART_CAPTURE_H
+#define UART_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define CAPTURE_MAGIC "UARTCAP1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_EXTENT (64u * 1024u * 1024u)
+#define CAPTURE_HDR_SIZE 4096u
+#define CAPTURE_INDEX_SLOTS 252
+#define CAPTURE_REC_HDR 16u
+
+enum capture_dir {
+    CAPTURE_TX = 'T',
+    CAPTURE_RX = 'R',
+};
+
+/* File layout: back-to-back extents of extent_size bytes (the last one cut
+   to what it holds), each a header page followed by records:
+     u64 time (us since the epoch), u32 length, u8 direction, u8 channel,
+     u16 zero, data padded to 8 bytes.
+   Integers are in host order (little endian on every supported host).
+   The header's index holds the time and offset of the first record at or
+   past every 1/CAPTURE_INDEX_SLOTS of the extent, so a reader finds a time
+   with a binary search over extent headers, one over the index, and a scan
+   of at most one index step. `used` is stored after the record bytes, so
+   what it covers is complete even if the process dies. */
+struct capture_index_entry {
+    uint64_t t_us;
+    uint64_t offset;    /* from the start of the extent */
+};
+
+struct capture_extent {
+    char magic[8];
+    uint32_t version;
+    uint32_t hdr_size;
+    uint64_t extent_size;
+    uint64_t first_us, last_us;
+    uint64_t used;      /* record bytes after the header */
+    uint32_t nindex;
+    uint32_t reserved;
+    struct capture_index_entry index[CAPTURE_INDEX_SLOTS];
+};
+
+/* writer: records go into the mapped tail extent with a memcpy; the only
+   syscalls are the ftruncate/fallocate and mmap when an extent fills */
+struct capture {
+    int fd;
+    uint64_t nextents;
+    struct capture_extent *cur;     /* mapping of the last extent */
+    uint64_t last_us;
+    uint64_t records, bytes;
+    int failed;
+};
+
+/* one record as seen by a reader; data points into the mapping */
+struct capture_rec {
+    uint64_t t_us;
+    int dir;
+    int chan;
+    const unsigned char *data;
+    size_t len;
+};
+
+struct capture_reader {
+    int fd;
+    uint64_t file_size, extent_size, nextents;
+    uint64_t ext;                   /* extent mapped in map */
+    unsigned char *map;
+    size_t map_len;
+    uint64_t pos;                   /* next record, from the start of the extent */
+};
+
+int capture_open(struct capture *c, const char *path);
+void capture_record(struct capture *c, int dir, int chan, const void *data, size_t n);
+void capture_record_iov(struct capture *c, int dir, int chan, const struct iovec *iov, int iovcnt, size_t n);
+void capture_close(struct capture *c);
+
+/* readers also work on a capture that is still being written */
+int capture_reader_open(struct capture_reader *r, const char *path);
+uint64_t capture_reader_start(const struct capture_reader *r);
+/* position before the first record at or after t_us. Returns 0, -1 on error. */
+int capture_reader_seek(struct capture_reader *r, uint64_t t_us);
+/* Returns 1 with the next record, 0 at the end, -1 on a damaged file. */
+int capture_reader_next(struct capture_reader *r, struct capture_rec *rec);
+void capture_reader_close(struct capture_reader *r);
+
+#endif
@@ -0,0 +1,130 @@
+// cobs.c - COBS byte stuffing for zero-delimited frames (-m cobs)
+#include "cobs.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define COBS_MAX_RUN 254   /* data bytes a block can hold (code 0xFF) */
+
+#if defined(__SSE2__)
+static unsigned zero_mask16(const unsigned char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+
+size_t cobs_zero(const void *p, size_t n) {
+    const unsigned char *s = p;
+    size_t i = 0;
+    /* long scans (the receive side) fold four compares into one test */
+    for (; i + 64 <= n; i += 64) {
+        __m128i z = _mm_setzero_si128();
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), z);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + 16)), z);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + 32)), z);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i + 48)), z);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) break;
+    }
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = zero_mask16(s + i);
+        if (m) return i + (size_t)__builtin_ctz(m);
+    }
+    if (i < n && n >= 16) {
+        /* tail: one load overlapping bytes already known to be non-zero */
+        unsigned m = zero_mask16(s + n - 16);
+        return m ? n - 16 + (size_t)__builtin_ctz(m) : n;
+    }
+    for (; i < n; i++)
+        if (s[i] == 0) return i;
+    return n;
+}
+#elif defined(__ARM_NEON)
+/* 4 bits per byte: narrowing the compare result keeps one nibble each */
+static uint64_t zero_mask16(const unsigned char *p) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8(p), vdupq_n_u8(0));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+size_t cobs_zero(const void *p, size_t n) {
+    const unsigned char *s = p;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t m = zero_mask16(s + i);
+        if (m) return i + (size_t)(__builtin_ctzll(m) >> 2);
+    }
+    if (i < n && n >= 16) {
+        uint64_t m = zero_mask16(s + n - 16);
+        return m ? n - 16 + (size_t)(__builtin_ctzll(m) >> 2) : n;
+    }
+    for (; i < n; i++)
+        if (s[i] == 0) return i;
+    return n;
+}
+#else
+size_t cobs_zero(const void *p, size_t n) {
+    const unsigned char *z = memchr(p, 0, n);
+    return z ? (size_t)(z - (const unsigned char *)p) : n;
+}
+#endif
+
+void cobs_enc_init(struct cobs_enc *e, void *dst) {
+    e->start = dst;
+    e->code = e->start;
+    e->out = e->start + 1;
+    e->run = 0;
+}
+
+static void close_block(struct cobs_enc *e, unsigned char code) {
+    *e->code = code;
+    e->code = e->out++;
+    e->run = 0;
+}
+
+/* each block is located with one zero search and moved with one memcpy */
+void cobs_enc_update(struct cobs_enc *e, const void *src, size_t n) {
+    const unsigned char *s = src;
+    while (n > 0) {
+        size_t room = COBS_MAX_RUN - e->run;
+        size_t span = n < room ? n : room;
+        size_t k = cobs_zero(s, span);
+        memcpy(e->out, s, k);
+        e->out += k;
+        e->run += k;
+        s += k;
+        n -= k;
+        if (k < span) {
+            close_block(e, (unsigned char)(e->run + 1));
+            s++;            /* the zero itself is implied by the code */
+            n--;
+        } else if (e->run == COBS_MAX_RUN) {
+            close_block(e, 0xFF);
+        }
+    }
+}
+
+size_t cobs_enc_finish(struct cobs_enc *e) {
+    *e->code = (unsigned char)(e->run + 1);
+    return (size_t)(e->out - e->start);
+}
+
+int cobs_decode(const void *src, size_t n, void *dst, size_t *out_len) {
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+    size_t i = 0, o = 0;
+    while (i < n) {
+        unsigned code = s[i++];
+        size_t k = code - 1u;
+        if (code == 0 || k > n - i) return -1;
+        memmove(d + o, s + i, k);
+        i += k;
+        o += k;
+        if (code != 0xFF && i < n) d[o++] = 0;
+    }
+    *out_len = o;
+    return 0;
+}
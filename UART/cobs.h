@@ -0,0 +1,33 @@
+// cobs.h - COBS byte stuffing for zero-delimited frames (-m cobs)
+#ifndef UART_COBS_H
+#define UART_COBS_H
+
+#include <stddef.h>
+
+/* worst-case encoded size of n bytes: one code byte per 254, plus the first */
+#define COBS_BOUND(n) ((n) + (n) / 254 + 1)
+
+/* index of the first 0x00 in p[0, n), or n if there is none. Examines
+   16 bytes a step with SSE2 or NEON where the compiler targets them. */
+size_t cobs_zero(const void *p, size_t n);
+
+/* Incremental encoder, so a payload and its CRC can be stuffed without
+   first being joined. dst must hold COBS_BOUND() of everything fed; the
+   output contains no zero byte and does not include the delimiter. */
+struct cobs_enc {
+    unsigned char *start, *out;
+    unsigned char *code;       /* where the open block's code byte goes */
+    size_t run;                /* data bytes in the open block */
+};
+
+void cobs_enc_init(struct cobs_enc *e, void *dst);
+void cobs_enc_update(struct cobs_enc *e, const void *src, size_t n);
+/* close the last block; returns the encoded length */
+size_t cobs_enc_finish(struct cobs_enc *e);
+
+/* decode one frame (delimiter already removed). dst may be src: the
+   output never overtakes the input. Returns 0 with the length in *out_len,
+   -1 if a code byte is zero or runs past the end. */
+int cobs_decode(const void *src, size_t n, void *dst, size_t *out_len);
+
+#endif
@@ -0,0 +1,126 @@
+// compress.c - LZ4 block codec for compressed binary frames
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5    /* the block must end with this many literals */
+#define MF_LIMIT 12        /* and no match may start closer to the end than this */
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* 255-run length continuation used for both literal and match lengths */
+static unsigned char *put_len(unsigned char *op, const unsigned char *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* one sequence: literals [lit, lit + nlit), then a match (mlen 0 = none) */
+static unsigned char *put_seq(unsigned char *op, const unsigned char *oend,
+                              const unsigned char *lit, size_t nlit, size_t offset, size_t mlen) {
+    if (op >= oend) return NULL;
+    unsigned char *token = op++;
+    size_t mcode = mlen ? mlen - MIN_MATCH : 0;
+    *token = (unsigned char)((nlit >= 15 ? 15 : nlit) << 4 | (mcode >= 15 ? 15 : mcode));
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    if (mcode >= 15 && !(op = put_len(op, oend, mcode - 15))) return NULL;
+    return op;
+}
+
+/* greedy single-probe matcher: fast and small, which is all a link at a
+   few kB/s needs */
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t dst_cap) {
+    const unsigned char *base = src, *ip = base, *anchor = base;
+    const unsigned char *iend = base + n;
+    unsigned char *op = dst, *oend = op + dst_cap;
+    uint32_t table[1u << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (n >= MF_LIMIT + 1) {
+        const unsigned char *mflimit = iend - MF_LIMIT;
+        const unsigned char *mlimit = iend - LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            size_t mlen = MIN_MATCH;
+            while (ip + mlen < mlimit && ref[mlen] == ip[mlen]) mlen++;
+            op = put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    op = put_seq(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+static int get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const void *src, size_t n, void *dst, size_t out_len) {
+    const unsigned char *ip = src, *iend = ip + n;
+    unsigned char *op = dst, *ostart = op, *oend = op + out_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(&ip, iend, &nlit) != 0) return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) break;   /* last sequence: literals only */
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) != 0) return -1;
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - ostart) || (size_t)(oend - op) < mlen) return -1;
+
+        /* byte by byte: the match may overlap its own output */
+        const unsigned char *ref = op - offset;
+        for (size_t i = 0; i < mlen; i++) op[i] = ref[i];
+        op += mlen;
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,24 @@
+// compress.h - LZ4 block codec for compressed binary frames
+#ifndef UART_COMPRESS_H
+#define UART_COMPRESS_H
+
+#include <stddef.h>
+
+/* payloads shorter than this go out uncompressed; the token/offset
+   overhead eats whatever a few dozen bytes could save */
+#define COMPRESS_MIN_LEN 64
+
+/* worst-case compressed size of n bytes */
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* standard LZ4 block format (no frame header), so any LZ4 decoder,
+   including the few-hundred-byte ones written for microcontrollers,
+   can read it. Returns the compressed size, or 0 if it would not fit in
+   dst_cap. */
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t dst_cap);
+
+/* decode a block that must expand to exactly out_len bytes. Every
+   offset and length is bounds-checked. Returns 0, or -1 if malformed. */
+int lz4_decompress(const void *src, size_t n, void *dst, size_t out_len);
+
+#endif
@@ -0,0 +1,664 @@
+// daemon.c - port-sharing daemon: owns one serial port, serves clients over a Unix socket
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log.h"
+
+#define RX_CHUNK 4096
+#define REQ_HDR_LEN 4
+#define REPLY_HDR_LEN 5
+
+static volatile sig_atomic_t daemon_stop;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* growable byte queue: append at the back, consume from the front */
+struct buf {
+    char *data;
+    size_t len, cap;
+};
+
+static int buf_append(struct buf *b, const void *p, size_t n) {
+    if (n == 0) return 0;
+    if (b->len + n > b->cap) {
+        size_t ncap = b->cap ? b->cap : RX_CHUNK;
+        while (ncap < b->len + n) ncap *= 2;
+        char *nd = realloc(b->data, ncap);
+        if (!nd) return -1;
+        b->data = nd;
+        b->cap = ncap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+static void buf_consume(struct buf *b, size_t n) {
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+/* write what the fd takes now; tap copies it to the -C capture (port
+   writes only). Returns 0, or -1 on error. */
+static int buf_flush(int fd, struct buf *b, int tap) {
+    while (b->len > 0) {
+        ssize_t n = write(fd, b->data, b->len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { errno = 0; return 0; }
+            return -1;
+        }
+        if (tap && conf.capture) capture_record(conf.capture, CAPTURE_TX, 0, b->data, (size_t)n);
+        buf_consume(b, (size_t)n);
+    }
+    return 0;
+}
+
+/* ---- daemon state ---- */
+struct request {
+    int client;           /* client slot, -1 once that client has gone */
+    uint32_t seq;
+    char *cmd;
+    size_t len;
+    uint64_t wire_end;    /* port output offset just past this frame */
+    uint64_t sent_us;     /* 0 until the frame has been written out */
+    struct request *next;
+};
+
+struct client {
+    int fd;               /* -1 = free slot */
+    struct buf in, out;
+    int eof;              /* sent everything; close once its replies are out */
+    int pending;          /* requests not answered yet */
+};
+
+struct daemon {
+    int port_fd, listen_fd;
+    const struct read_timeouts *to;
+    int window;
+
+    struct client clients[DAEMON_MAX_CLIENTS];
+    struct request *queued, **queued_tail;   /* not yet on the wire */
+    struct request *inflight;                /* oldest first */
+    int ninflight;
+    uint32_t next_seq;
+
+    struct buf tx;
+    uint64_t tx_queued, tx_written;          /* running byte offsets */
+    struct tx_coalesce txc;                  /* frames in tx not yet released */
+    int tx_released;                         /* tx is being written; cleared once empty */
+    uint64_t tx_deadline;                    /* tx must drain by then; 0 while empty */
+    struct buf rx;
+    struct marker_scanner sc;
+    size_t scanned;
+    uint64_t last_rx;
+
+    unsigned long served, timeouts;
+};
+
+static void request_free(struct request *rq) {
+    free(rq->cmd);
+    free(rq);
+}
+
+static void reply(struct daemon *d, struct request *rq, enum daemon_status status,
+                  const char *data, size_t len) {
+    if (rq->client < 0) return;   /* asker disconnected; drop the answer */
+    struct client *c = &d->clients[rq->client];
+    c->pending--;
+    unsigned char hdr[REPLY_HDR_LEN];
+    hdr[0] = (unsigned char)status;
+    put_be32(hdr + 1, (uint32_t)len);
+    if (buf_append(&c->out, hdr, sizeof(hdr)) != 0 || buf_append(&c->out, data, len) != 0)
+        log_error("daemon: out of memory queueing a reply");
+}
+
+/* unlink rq from the in-flight list */
+static void inflight_remove(struct daemon *d, struct request *rq) {
+    for (struct request **pp = &d->inflight; *pp; pp = &(*pp)->next) {
+        if (*pp == rq) {
+            *pp = rq->next;
+            d->ninflight--;
+            return;
+        }
+    }
+}
+
+/* move queued requests onto the wire while the window has room; everything
+   eligible goes out in the same write */
+static void fill_window(struct daemon *d) {
+    while (d->queued && d->ninflight < d->window) {
+        struct request *rq = d->queued;
+        d->queued = rq->next;
+        if (!d->queued) d->queued_tail = &d->queued;
+
+        char tag[24];
+        int tag_len = 0;
+        if (d->window > 1) {
+            rq->seq = d->next_seq++;
+            tag_len = snprintf(tag, sizeof(tag), UART_COM_SEQ_PREFIX "%x]", rq->seq);
+        }
+        size_t before = d->tx.len;
+        if (buf_append(&d->tx, UART_COM_START, UART_COM_START_LEN) != 0 ||
+            buf_append(&d->tx, tag, (size_t)tag_len) != 0 ||
+            buf_append(&d->tx, rq->cmd, rq->len) != 0 ||
+            buf_append(&d->tx, UART_COM_END, UART_COM_END_LEN) != 0) {
+            d->tx.len = before;
+            reply(d, rq, DAEMON_ERROR, NULL, 0);
+            request_free(rq);
+            continue;
+        }
+        uint64_t now = now_us();
+        d->tx_queued += d->tx.len - before;
+        rq->wire_end = d->tx_queued;
+        d->tx_deadline = tx_deadline(now, d->tx.len);
+        tx_coalesce_add(&d->txc, d->tx.len - before, now);
+
+        /* append to the in-flight tail, keeping oldest first */
+        struct request **pp = &d->inflight;
+        while (*pp) pp = &(*pp)->next;
+        rq->next = NULL;
+        *pp = rq;
+        d->ninflight++;
+    }
+}
+
+/* --coalesce: frames written back to back go in one write. Pending frames
+   are held while more requests could still join them: until the batch is
+   full, the window is, or the oldest has waited its delay. Returns the
+   timer deadline while holding, 0 otherwise. */
+static uint64_t tx_gate(struct daemon *d, uint64_t now) {
+    if (d->tx_released || d->txc.frames == 0) return 0;
+    enum tx_flush_reason why;
+    uint64_t deadline = tx_coalesce_deadline(&d->txc);
+    if (d->txc.bytes >= d->txc.limit) why = TX_FLUSH_SIZE;
+    else if (d->ninflight >= d->window) why = TX_FLUSH_IDLE;
+    else if (now >= deadline) why = TX_FLUSH_TIMER;
+    else return deadline;
+    tx_coalesce_release(&d->txc, why);
+    d->tx_released = 1;
+    return 0;
+}
+
+/* a complete frame [0, end) sits at the front of rx */
+static void route_frame(struct daemon *d, size_t end) {
+    struct request *rq = NULL;
+    uint32_t seq;
+    if (d->window > 1) {
+        if (frame_seq(d->rx.data, end, &seq) == 0) {
+            for (rq = d->inflight; rq && rq->seq != seq; rq = rq->next) {}
+        }
+    } else {
+        rq = d->inflight;
+    }
+
+    if (rq) {
+        reply(d, rq, DAEMON_OK, d->rx.data, end);
+        inflight_remove(d, rq);
+        request_free(rq);
+        d->served++;
+    } else {
+        log_warning("daemon: discarding unsolicited or untagged frame (%zu bytes)", end);
+    }
+    buf_consume(&d->rx, end);
+    d->scanned = 0;
+}
+
+static int port_read(struct daemon *d) {
+    char chunk[RX_CHUNK];
+    for (;;) {
+        ssize_t r = read(d->port_fd, chunk, sizeof(chunk));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { errno = 0; break; }
+            return -1;
+        }
+        if (r == 0) return -1;
+        if (conf.capture) capture_record(conf.capture, CAPTURE_RX, 0, chunk, (size_t)r);
+        if (buf_append(&d->rx, chunk, (size_t)r) != 0) return -1;
+        d->last_rx = now_us();
+    }
+
+    ssize_t hit;
+    while (d->scanned < d->rx.len &&
+           (hit = marker_scanner_feed(&d->sc, d->rx.data + d->scanned, d->rx.len - d->scanned)) >= 0)
+        route_frame(d, d->scanned + (size_t)hit);
+    d->scanned = d->rx.len;
+    return 0;
+}
+
+/* --reconnect: reopen the port and put everything in flight back at the
+   head of the queue; the device lost those requests with the connection.
+   Clients are not served while the port is away. */
+static int port_reconnect(struct daemon *d, const char *dev_path, long baud_rate) {
+    if (conf.reconnect_ms <= 0 || !serial_port_lost(d->port_fd)) return -1;
+    close(d->port_fd);
+    d->port_fd = serial_port_reconnect(dev_path, baud_rate, conf.reconnect_ms);
+    if (d->port_fd < 0) return -1;
+    if (conf.tuning != RX_TUNING_DEFAULT) serial_port_tune(d->port_fd, dev_path, conf.tuning, NULL);
+    if (set_blocking(d->port_fd, 0) != 0) return -1;
+
+    if (d->inflight) {
+        struct request **pp = &d->inflight;
+        for (; *pp; pp = &(*pp)->next) (*pp)->sent_us = 0;
+        *pp = d->queued;
+        if (!d->queued) d->queued_tail = pp;
+        d->queued = d->inflight;
+        log_info("daemon: resending %d request(s)", d->ninflight);
+    }
+    d->inflight = NULL;
+    d->ninflight = 0;
+    d->tx.len = 0;
+    d->tx_queued = d->tx_written = 0;
+    d->tx_deadline = 0;
+    d->txc.bytes = 0;
+    d->txc.frames = 0;
+    d->tx_released = 0;
+    d->rx.len = 0;
+    d->scanned = 0;
+    d->sc.matched = 0;
+    return 0;
+}
+
+/* the oldest written request whose deadline has passed gets a timeout and
+   whatever partial frame there is */
+static void expire(struct daemon *d, uint64_t now) {
+    struct request *rq = d->inflight;
+    if (!rq || !rq->sent_us) return;
+    uint64_t last = d->last_rx > rq->sent_us ? d->last_rx : rq->sent_us;
+    if (now < rx_deadline(d->to, rq->sent_us, last, d->rx.len > 0)) return;
+
+    log_warning("daemon: request timed out (%zu bytes of partial data)", d->rx.len);
+    if (d->window > 1) {
+        /* the partial bytes may belong to another tagged request */
+        reply(d, rq, DAEMON_TIMEOUT, NULL, 0);
+    } else {
+        reply(d, rq, DAEMON_TIMEOUT, d->rx.data, d->rx.len);
+        d->rx.len = 0;
+        d->scanned = 0;
+        d->sc.matched = 0;
+    }
+    inflight_remove(d, rq);
+    request_free(rq);
+    d->timeouts++;
+}
+
+/* the port stopped taking bytes: every request not fully written times
+   out, and what is left of the output is thrown away */
+static void expire_tx(struct daemon *d, uint64_t now) {
+    if (!d->tx.len || now < d->tx_deadline) return;
+
+    errno = 0;
+    log_error("daemon: timed out sending to the port, %zu bytes discarded", d->tx.len);
+    tcflush(d->port_fd, TCOFLUSH);
+    struct request **pp = &d->inflight;
+    while (*pp) {
+        struct request *rq = *pp;
+        if (rq->sent_us) {
+            pp = &rq->next;
+            continue;
+        }
+        reply(d, rq, DAEMON_TIMEOUT, NULL, 0);
+        *pp = rq->next;
+        d->ninflight--;
+        request_free(rq);
+        d->timeouts++;
+    }
+    d->tx.len = 0;
+    d->tx_queued = d->tx_written;
+    d->tx_deadline = 0;
+    d->txc.bytes = 0;
+    d->txc.frames = 0;
+    d->tx_released = 0;
+}
+
+/* when the oldest written request times out or the output must have
+   drained, 0 if neither is pending */
+static uint64_t next_deadline(struct daemon *d) {
+    uint64_t deadline = d->tx.len ? d->tx_deadline : 0;
+    struct request *rq = d->inflight;
+    if (!rq || !rq->sent_us) return deadline;
+    uint64_t last = d->last_rx > rq->sent_us ? d->last_rx : rq->sent_us;
+    uint64_t rx = rx_deadline(d->to, rq->sent_us, last, d->rx.len > 0);
+    return deadline && deadline < rx ? deadline : rx;
+}
+
+static void client_drop(struct daemon *d, int slot) {
+    struct client *c = &d->clients[slot];
+    for (struct request *rq = d->queued; rq; rq = rq->next)
+        if (rq->client == slot) rq->client = -1;
+    for (struct request *rq = d->inflight; rq; rq = rq->next)
+        if (rq->client == slot) rq->client = -1;
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    log_trace("daemon: client %d disconnected", slot);
+}
+
+/* read from a client and queue every complete request. Returns -1 to drop it. */
+static int client_read(struct daemon *d, int slot) {
+    struct client *c = &d->clients[slot];
+    char chunk[RX_CHUNK];
+    for (;;) {
+        ssize_t r = read(c->fd, chunk, sizeof(chunk));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { errno = 0; break; }
+            return -1;
+        }
+        if (r == 0) {
+            c->eof = 1;
+            break;
+        }
+        if (buf_append(&c->in, chunk, (size_t)r) != 0) return -1;
+    }
+
+    while (c->in.len >= REQ_HDR_LEN) {
+        uint32_t n = get_be32((const unsigned char *)c->in.data);
+        if (n > DAEMON_MAX_REQUEST) {
+            log_error("daemon: client %d sent an oversized request (%u bytes)", slot, n);
+            return -1;
+        }
+        if (c->in.len < REQ_HDR_LEN + (size_t)n) break;
+
+        struct request *rq = calloc(1, sizeof(*rq));
+        char *cmd = malloc(n ? n : 1);
+        if (!rq || !cmd) {
+            free(rq);
+            free(cmd);
+            return -1;
+        }
+        memcpy(cmd, c->in.data + REQ_HDR_LEN, n);
+        rq->client = slot;
+        rq->cmd = cmd;
+        rq->len = n;
+        c->pending++;
+        *d->queued_tail = rq;
+        d->queued_tail = &rq->next;
+        buf_consume(&c->in, REQ_HDR_LEN + (size_t)n);
+    }
+    return 0;
+}
+
+static void client_accept(struct daemon *d) {
+    for (;;) {
+        int fd = accept(d->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) log_warning("daemon: accept failed");
+            errno = 0;
+            return;
+        }
+        int slot = 0;
+        while (slot < DAEMON_MAX_CLIENTS && d->clients[slot].fd >= 0) slot++;
+        if (slot == DAEMON_MAX_CLIENTS || set_blocking(fd, 0) != 0) {
+            log_warning("daemon: refusing client (max %d)", DAEMON_MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+        d->clients[slot].fd = fd;
+        log_trace("daemon: client %d connected", slot);
+    }
+}
+
+static int listen_unix(const char *sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        log_error("daemon: socket path too long: %s", sock_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    /* a socket file nobody answers on is left over from a dead daemon */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        log_error("daemon: another daemon is already serving %s", sock_path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(sock_path);
+    errno = 0;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0 || set_blocking(fd, 0) != 0) {
+        log_error("daemon: cannot listen on %s", sock_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_daemon(const char *sock_path, const char *dev_path, long baud_rate,
+               const struct read_timeouts *to, int window) {
+    static struct daemon dm;
+    struct daemon *d = &dm;
+    memset(d, 0, sizeof(*d));
+    d->to = to;
+    d->window = window > 0 ? window : 1;
+    d->queued_tail = &d->queued;
+    tx_coalesce_init(&d->txc, conf.coalesce_bytes, (uint64_t)conf.coalesce_us);
+    for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) d->clients[i].fd = -1;
+    marker_scanner_init(&d->sc, UART_COM_END);
+
+    d->port_fd = serial_port_open(dev_path, baud_rate);
+    if (d->port_fd < 0) return -1;
+    if (conf.tuning != RX_TUNING_DEFAULT) serial_port_tune(d->port_fd, dev_path, conf.tuning, NULL);
+    if (set_blocking(d->port_fd, 0) != 0 || (d->listen_fd = listen_unix(sock_path)) < 0) {
+        close(d->port_fd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);   /* a client vanishing mid-reply is just EPIPE */
+    log_info("daemon: serving %s on %s (window %d)", dev_path, sock_path, d->window);
+
+    struct pollfd pfds[2 + DAEMON_MAX_CLIENTS];
+    int slot_of[2 + DAEMON_MAX_CLIENTS];
+    int status = 0;
+
+    while (!daemon_stop) {
+        fill_window(d);
+        uint64_t hold = tx_gate(d, now_us());
+        uint64_t deadline = next_deadline(d);
+        if (hold && (!deadline || hold < deadline)) deadline = hold;
+
+        int n = 0;
+        pfds[n++] = (struct pollfd){ .fd = d->listen_fd, .events = POLLIN };
+        pfds[n++] = (struct pollfd){ .fd = d->port_fd, .events = POLLIN | (d->tx_released ? POLLOUT : 0) };
+        for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+            struct client *c = &d->clients[i];
+            if (c->fd < 0) continue;
+            slot_of[n] = i;
+            pfds[n++] = (struct pollfd){ .fd = c->fd, .events = (c->eof ? 0 : POLLIN) | (c->out.len ? POLLOUT : 0) };
+        }
+
+        if (poll_deadline(pfds, (nfds_t)n, deadline) < 0) {
+            if (errno == EINTR) continue;
+            log_error("daemon: poll failed");
+            status = -1;
+            break;
+        }
+
+        /* port first: its output frees window slots, its input completes requests */
+        if (pfds[1].revents & POLLOUT) {
+            size_t before = d->tx.len;
+            if (buf_flush(d->port_fd, &d->tx, 1) != 0) {
+                if (port_reconnect(d, dev_path, baud_rate) == 0) continue;
+                log_error("daemon: write to %s failed", dev_path);
+                status = -1;
+                break;
+            }
+            d->tx_written += before - d->tx.len;
+            /* progress restarts the clock on what is left */
+            if (d->tx.len < before) d->tx_deadline = tx_deadline(now_us(), d->tx.len);
+            if (d->tx.len == 0) {
+                /* frames queued during the write went out with it */
+                tx_coalesce_release(&d->txc, TX_FLUSH_IDLE);
+                d->tx_released = 0;
+            }
+            uint64_t now = now_us();
+            for (struct request *rq = d->inflight; rq; rq = rq->next)
+                if (!rq->sent_us && rq->wire_end <= d->tx_written) rq->sent_us = now;
+        }
+        if ((pfds[1].revents & (POLLIN | POLLERR | POLLHUP)) && port_read(d) != 0) {
+            if (port_reconnect(d, dev_path, baud_rate) == 0) continue;
+            log_error("daemon: read from %s failed or device closed", dev_path);
+            status = -1;
+            break;
+        }
+        expire(d, now_us());
+        expire_tx(d, now_us());
+
+        for (int i = 2; i < n; i++) {
+            int slot = slot_of[i];
+            struct client *c = &d->clients[slot];
+            short re = pfds[i].revents;
+            /* HUP means both directions are gone: its replies have nowhere to go.
+               A half-close (shutdown(SHUT_WR)) only reads EOF and waits for them. */
+            if (re & (POLLERR | POLLHUP)) {
+                client_drop(d, slot);
+                continue;
+            }
+            if ((re & POLLIN) && client_read(d, slot) != 0) {
+                client_drop(d, slot);
+                continue;
+            }
+            if (c->out.len && buf_flush(c->fd, &c->out, 0) != 0) {
+                client_drop(d, slot);
+                continue;
+            }
+            if (c->eof && !c->pending && !c->out.len) client_drop(d, slot);
+        }
+        if (pfds[0].revents & POLLIN) client_accept(d);
+    }
+
+    errno = 0;
+    char desc[192];
+    tx_coalesce_describe(&d->txc, desc, sizeof(desc));
+    log_info("daemon: shutting down, %lu served, %lu timed out", d->served, d->timeouts);
+    log_info("daemon: TX coalescing: %s", desc);
+    for (int i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        if (d->clients[i].fd >= 0) client_drop(d, i);
+    while (d->queued) {
+        struct request *rq = d->queued;
+        d->queued = rq->next;
+        request_free(rq);
+    }
+    while (d->inflight) {
+        struct request *rq = d->inflight;
+        d->inflight = rq->next;
+        request_free(rq);
+    }
+    free(d->tx.data);
+    free(d->rx.data);
+    close(d->listen_fd);
+    unlink(sock_path);
+    if (d->port_fd >= 0) close(d->port_fd);
+    return status;
+}
+
+/* ---- client side ---- */
+int daemon_connect(const char *sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, sock_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return fd;
+}
+
+/* read exactly n bytes by deadline (now_us() clock); -1 with errno
+   ETIMEDOUT once it passes */
+static int read_full(int fd, void *dst, size_t n, uint64_t deadline) {
+    size_t have = 0;
+    while (have < n) {
+        int ready = wait_ready(fd, POLLIN, deadline);
+        if (ready <= 0) {
+            if (ready == 0) errno = ETIMEDOUT;
+            return -1;
+        }
+        ssize_t r = read(fd, (char *)dst + have, n - have);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return -1;
+        have += (size_t)r;
+    }
+    return 0;
+}
+
+int daemon_call(int fd, const char *cmd, size_t len, const struct read_timeouts *to, char **resp, size_t *resp_len) {
+    unsigned char hdr[REPLY_HDR_LEN];
+    *resp = NULL;
+    *resp_len = 0;
+    if (len > DAEMON_MAX_REQUEST) return -1;
+
+    put_be32(hdr, (uint32_t)len);
+    struct iovec iov[2] = {
+        { .iov_base = hdr,         .iov_len = REQ_HDR_LEN },
+        { .iov_base = (void *)cmd, .iov_len = len },
+    };
+    uint64_t sent = tx_deadline(now_us(), REQ_HDR_LEN + len);
+    if (writev_all(fd, iov, 2, sent) != (ssize_t)(REQ_HDR_LEN + len)) return -2;
+
+    /* the daemon answers within -T of the frame going out */
+    uint64_t deadline = sent + (uint64_t)to->total_ms * 1000u;
+    if (read_full(fd, hdr, REPLY_HDR_LEN, deadline) != 0) return -2;
+    size_t n = get_be32(hdr + 1);
+    char *body = malloc(n ? n : 1);
+    if (!body) return -2;
+    if (read_full(fd, body, n, deadline) != 0) {
+        free(body);
+        return -2;
+    }
+    *resp = body;
+    *resp_len = n;
+    return hdr[0] == DAEMON_OK ? 0 : hdr[0] == DAEMON_TIMEOUT ? 1 : -1;
+}
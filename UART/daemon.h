@@ -0,0 +1,42 @@
+// daemon.h - port-sharing daemon: owns one serial port, serves clients over a Unix socket
+#ifndef UART_DAEMON_H
+#define UART_DAEMON_H
+
+#include <stddef.h>
+
+#include "uart.h"
+
+#define DAEMON_MAX_CLIENTS 128
+#define DAEMON_MAX_REQUEST (16u * 1024u * 1024u)
+
+/* socket protocol, all lengths 32-bit big endian:
+     request:  length | command bytes
+     reply:    status | length | response frame (as read from the wire)
+   status is 0 (end marker seen), 1 (timeout, partial frame) or 2 (error).
+   Replies go out as their frames complete; a client that queues several
+   requests gets them in order only with window 1. daemon_call() keeps one
+   request outstanding. */
+enum daemon_status {
+    DAEMON_OK = 0,
+    DAEMON_TIMEOUT = 1,
+    DAEMON_ERROR = 2,
+};
+
+/* open the port and serve sock_path until SIGINT/SIGTERM. Requests from all
+   clients are queued and written back to back, coalesced into shared
+   writes as conf.coalesce_bytes/coalesce_us allow; with window > 1 up to
+   window of them are in flight, sequence-tagged as in pipelined mode, else
+   the device is driven stop-and-wait. Returns 0 on a clean shutdown. */
+int run_daemon(const char *sock_path, const char *dev_path, long baud_rate,
+               const struct read_timeouts *to, int window);
+
+/* client side: connect, then one daemon_call() per command. daemon_call()
+   returns the reader-style status (0 found, 1 timeout, -1 device error) with
+   the frame in *resp (malloc'd), or -2 if the connection failed (errno
+   ETIMEDOUT: the request was not taken within tx_deadline(), or no reply
+   came to->total_ms after that). */
+int daemon_connect(const char *sock_path);
+int daemon_call(int fd, const char *cmd, size_t len, const struct read_timeouts *to,
+                char **resp, size_t *resp_len);
+
+#endif
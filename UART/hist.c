@@ -0,0 +1,52 @@
+// hist.c - HDR-style latency histogram for the repeat mode (-n / --duration)
+#include "hist.h"
+
+#include <string.h>
+
+#define SUB (1u << HIST_SUB_BITS)
+#define HALF (SUB / 2)
+
+static unsigned bucket_of(uint64_t v) {
+    if (v < SUB) return (unsigned)v;
+    unsigned shift = 63u - (unsigned)__builtin_clzll(v) - (HIST_SUB_BITS - 1);   /* v >> shift in [HALF, SUB) */
+    unsigned idx = SUB + (shift - 1) * HALF + (unsigned)(v >> shift) - HALF;
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/* largest value that lands in bucket idx */
+static uint64_t bucket_top(unsigned idx) {
+    if (idx < SUB) return idx;
+    unsigned k = idx - SUB;
+    unsigned shift = k / HALF + 1;
+    uint64_t base = (uint64_t)(k % HALF + HALF) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+void lat_hist_init(struct lat_hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void lat_hist_record(struct lat_hist *h, uint64_t v) {
+    h->bucket[bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+uint64_t lat_hist_percentile(const struct lat_hist *h, double pct) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
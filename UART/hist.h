@@ -0,0 +1,30 @@
+// hist.h - HDR-style latency histogram for the repeat mode (-n / --duration)
+#ifndef UART_HIST_H
+#define UART_HIST_H
+
+#include <stdint.h>
+
+/* Log-linear buckets as in HdrHistogram: values below 2^HIST_SUB_BITS are
+   exact, above that every power of two is split into 2^(HIST_SUB_BITS-1)
+   equal buckets, so any recorded value is off by less than 1 part in 64
+   (about two significant digits). Recording is a shift and an increment,
+   and the size is fixed whatever the range: microsecond values up to
+   2^HIST_MAX_BITS (about 12 days) fit. */
+#define HIST_SUB_BITS 7
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((1u << HIST_SUB_BITS) + (HIST_MAX_BITS - HIST_SUB_BITS + 1) * (1u << (HIST_SUB_BITS - 1)))
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t min, max;
+    uint64_t sum;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+void lat_hist_init(struct lat_hist *h);
+void lat_hist_record(struct lat_hist *h, uint64_t v);
+/* smallest value that pct percent (0..100) of the recordings do not
+   exceed, as the top of its bucket and never above the largest recorded */
+uint64_t lat_hist_percentile(const struct lat_hist *h, double pct);
+
+#endif
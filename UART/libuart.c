@@ -0,0 +1,612 @@
+// libuart.c - embeddable UART framing and port API: opaque handle, no globals
+#include "libuart.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/termios.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "cobs.h"
+
+#define UART_RX_DEFAULT_CAP (64u * 1024u)
+#define COM_START_LEN (sizeof(UART_COM_START) - 1)
+#define COM_END_LEN (sizeof(UART_COM_END) - 1)
+
+/* CRC-32C (Castagnoli), hardware instructions where the target has them */
+uint32_t uart_crc32c(uint32_t crc, const void *data, size_t n) {
+    const unsigned char *p = data;
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+    }
+    for (; n > 0; n--, p++) crc = _mm_crc32_u8(crc, *p);
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; n > 0; n--, p++) crc = __crc32cb(crc, *p);
+#else
+    /* a nibble at a time: a constant table, nothing to initialise or share */
+    static const uint32_t table[16] = {
+        0x00000000u, 0x105EC76Fu, 0x20BD8EDEu, 0x30E349B1u,
+        0x417B1DBCu, 0x5125DAD3u, 0x61C69362u, 0x7198540Du,
+        0x82F63B78u, 0x92A8FC17u, 0xA24BB5A6u, 0xB21572C9u,
+        0xC38D26C4u, 0xD3D3E1ABu, 0xE330A81Au, 0xF36E6F75u,
+    };
+    for (; n > 0; n--, p++) {
+        crc ^= *p;
+        crc = table[crc & 0xF] ^ (crc >> 4);
+        crc = table[crc & 0xF] ^ (crc >> 4);
+    }
+#endif
+    return ~crc;
+}
+
+/* numeric rate -> Bxxx constant, for every constant the platform defines */
+static const struct { long rate; speed_t speed; } baud_table[] = {
+    {50, B50}, {75, B75}, {110, B110}, {134, B134}, {150, B150}, {200, B200},
+    {300, B300}, {600, B600}, {1200, B1200}, {1800, B1800}, {2400, B2400},
+    {4800, B4800},
+#ifdef B7200
+    {7200, B7200},
+#endif
+    {9600, B9600},
+#ifdef B14400
+    {14400, B14400},
+#endif
+    {19200, B19200},
+#ifdef B28800
+    {28800, B28800},
+#endif
+    {38400, B38400}, {57600, B57600},
+#ifdef B76800
+    {76800, B76800},
+#endif
+    {115200, B115200},
+#ifdef B230400
+    {230400, B230400},
+#endif
+#ifdef B460800
+    {460800, B460800},
+#endif
+#ifdef B500000
+    {500000, B500000},
+#endif
+#ifdef B576000
+    {576000, B576000},
+#endif
+#ifdef B921600
+    {921600, B921600},
+#endif
+#ifdef B1000000
+    {1000000, B1000000},
+#endif
+#ifdef B1152000
+    {1152000, B1152000},
+#endif
+#ifdef B1500000
+    {1500000, B1500000},
+#endif
+#ifdef B2000000
+    {2000000, B2000000},
+#endif
+#ifdef B2500000
+    {2500000, B2500000},
+#endif
+#ifdef B3000000
+    {3000000, B3000000},
+#endif
+#ifdef B3500000
+    {3500000, B3500000},
+#endif
+#ifdef B4000000
+    {4000000, B4000000},
+#endif
+};
+
+static int baud_to_speed(long baud_rate, speed_t *speed) {
+    for (size_t i = 0; i < sizeof(baud_table) / sizeof(baud_table[0]); i++) {
+        if (baud_table[i].rate == baud_rate) {
+            *speed = baud_table[i].speed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* arbitrary (non-Bxxx) rates: termios2/BOTHER on Linux, IOSSIOSPEED on macOS.
+   Must run after tcsetattr(), which would otherwise reset the speed. */
+#if defined(__linux__) && defined(TCGETS2)
+#define UART_HAVE_CUSTOM_BAUD 1
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+/* kernel layout; glibc's <termios.h> has no termios2 and <asm/termbits.h> clashes with it */
+struct termios2 {
+    tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed, c_ospeed;
+};
+
+static int set_custom_baud(int fd, long baud_rate) {
+    struct termios2 t2;
+    if (ioctl(fd, TCGETS2, &t2) != 0) return -1;
+    t2.c_cflag &= ~(tcflag_t)CBAUD;
+    t2.c_cflag |= BOTHER;
+    t2.c_ispeed = (speed_t)baud_rate;
+    t2.c_ospeed = (speed_t)baud_rate;
+    return ioctl(fd, TCSETS2, &t2);
+}
+#elif defined(__APPLE__)
+#define UART_HAVE_CUSTOM_BAUD 1
+static int set_custom_baud(int fd, long baud_rate) {
+    speed_t speed = (speed_t)baud_rate;
+    return ioctl(fd, IOSSIOSPEED, &speed);
+}
+#else
+#define UART_HAVE_CUSTOM_BAUD 0
+#endif
+
+#if UART_HAVE_CUSTOM_BAUD
+/* is the non-standard rate already in effect (a previous run set it)? */
+static int custom_baud_in_place(int fd, const struct termios *cur, long baud_rate) {
+#ifdef __linux__
+    (void)cur;
+    struct termios2 t2;
+    if (ioctl(fd, TCGETS2, &t2) != 0) return 0;
+    return (t2.c_cflag & CBAUD) == BOTHER && t2.c_ispeed == (speed_t)baud_rate && t2.c_ospeed == (speed_t)baud_rate;
+#else
+    (void)fd;
+    return cfgetospeed(cur) == (speed_t)baud_rate && cfgetispeed(cur) == (speed_t)baud_rate;
+#endif
+}
+#endif
+
+/* everything uart_configure() sets; the other c_cc slots are copied over */
+static int termios_same(const struct termios *a, const struct termios *b) {
+    return a->c_iflag == b->c_iflag && a->c_oflag == b->c_oflag && a->c_cflag == b->c_cflag &&
+           a->c_lflag == b->c_lflag && a->c_cc[VMIN] == b->c_cc[VMIN] && a->c_cc[VTIME] == b->c_cc[VTIME] &&
+           cfgetispeed(a) == cfgetispeed(b) && cfgetospeed(a) == cfgetospeed(b);
+}
+
+
+int uart_configure(int fd, long baud_rate, int keep_input) {
+    if (!isatty(fd)) {
+        errno = ENOTTY;
+        return -1;
+    }
+    struct termios cur, tty;
+    if (tcgetattr(fd, &cur) != 0) return -1;
+
+    tty = cur;
+    cfmakeraw(&tty); /* raw mode */
+
+    /* set baud */
+    speed_t speed;
+    int custom_baud = 0;
+    if (baud_to_speed(baud_rate, &speed) != 0) {
+#if UART_HAVE_CUSTOM_BAUD
+        /* placeholder for tcsetattr; the real rate is applied afterwards */
+        speed = B38400;
+        custom_baud = 1;
+        if (custom_baud_in_place(fd, &cur, baud_rate)) {
+            speed = cfgetospeed(&cur);   /* keep it rather than reset and reapply */
+            custom_baud = 0;
+        }
+#else
+        errno = EINVAL;
+        return -1;
+#endif
+    }
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+
+    /* 8N1 */
+    tty.c_cflag &= ~PARENB;
+    tty.c_cflag &= ~CSTOPB;
+    tty.c_cflag &= ~CSIZE;
+    tty.c_cflag |= CS8;
+    tty.c_cflag |= (CLOCAL | CREAD);
+
+#ifdef CRTSCTS
+    tty.c_cflag &= ~CRTSCTS;
+#endif
+#ifdef IXON
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+#endif
+    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+
+    /* read behaviour */
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 10; /* 1.0s */
+
+    /* bytes the device sent before we opened are dropped unless asked not to */
+    if (!keep_input) tcflush(fd, TCIFLUSH);
+    /* tcsetattr can take tens of ms on USB adapters: skip it when the port
+       is already configured (reopened, or left so by the last run) */
+    int same = termios_same(&cur, &tty);
+    if (!same && tcsetattr(fd, TCSANOW, &tty) != 0) return -1;
+
+#if UART_HAVE_CUSTOM_BAUD
+    if (custom_baud) {
+        if (set_custom_baud(fd, baud_rate) != 0) return -1;
+        same = 0;
+    }
+#endif
+    return same;
+}
+
+/* ---- framing ---- */
+
+size_t uart_varint_put(uint64_t v, unsigned char *out) {
+    size_t n = 0;
+    do {
+        unsigned char b = v & 0x7F;
+        v >>= 7;
+        out[n++] = b | (v ? 0x80 : 0);
+    } while (v);
+    return n;
+}
+
+int uart_varint_get(const unsigned char *p, size_t n, uint64_t *v, size_t *used) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i >= UART_VARINT_MAX) return -1;
+        r |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = r;
+            *used = i + 1;
+            return 1;
+        }
+    }
+    return n >= UART_VARINT_MAX ? -1 : 0;
+}
+
+/* the CRC covers the length bytes too */
+size_t uart_bin_header(unsigned char sync, size_t n, unsigned char *hdr, uint32_t *crc) {
+    hdr[0] = sync;
+    size_t len = 1 + uart_varint_put(n, hdr + 1);
+    *crc = uart_crc32c(0, hdr + 1, len - 1);
+    return len;
+}
+
+void uart_crc_put(unsigned char *out, uint32_t crc) {
+    for (int i = 0; i < UART_CRC_LEN; i++) out[i] = (unsigned char)(crc >> (8 * i));
+}
+
+uint32_t uart_crc_get(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < UART_CRC_LEN; i++) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+size_t uart_cobs_frame(const void *payload, size_t n, unsigned char *out) {
+    unsigned char crc[UART_CRC_LEN];
+    uart_crc_put(crc, uart_crc32c(0, payload, n));
+    struct cobs_enc e;
+    out[0] = 0;
+    cobs_enc_init(&e, out + 1);
+    cobs_enc_update(&e, payload, n);
+    cobs_enc_update(&e, crc, sizeof(crc));
+    size_t len = 2 + cobs_enc_finish(&e);
+    out[len - 1] = 0;
+    return len;
+}
+
+int uart_cobs_check(unsigned char *p, size_t n, size_t *len) {
+    size_t plen;
+    if (cobs_decode(p, n, p, &plen) != 0 || plen < UART_CRC_LEN) return 0;
+    if (uart_crc32c(0, p, plen - UART_CRC_LEN) != uart_crc_get(p + plen - UART_CRC_LEN)) return -1;
+    *len = plen - UART_CRC_LEN;
+    return 1;
+}
+
+size_t uart_frame_bound(enum uart_framing f, size_t n) {
+    switch (f) {
+    case UART_FRAMING_BINARY: return 1 + UART_VARINT_MAX + n + UART_CRC_LEN;
+    case UART_FRAMING_COBS: return 2 + COBS_BOUND(n + UART_CRC_LEN);
+    default: return COM_START_LEN + n + COM_END_LEN;
+    }
+}
+
+size_t uart_frame_encode(enum uart_framing f, const void *payload, size_t n, void *out, size_t cap) {
+    if (n > UART_FRAME_MAX_LEN || cap < uart_frame_bound(f, n)) return 0;
+    unsigned char *o = out;
+    if (f == UART_FRAMING_COBS) return uart_cobs_frame(payload, n, o);
+    if (f == UART_FRAMING_BINARY) {
+        uint32_t crc;
+        size_t h = uart_bin_header(UART_BIN_SYNC, n, o, &crc);
+        memcpy(o + h, payload, n);
+        uart_crc_put(o + h + n, uart_crc32c(crc, payload, n));
+        return h + n + UART_CRC_LEN;
+    }
+    memcpy(o, UART_COM_START, COM_START_LEN);
+    memcpy(o + COM_START_LEN, payload, n);
+    memcpy(o + COM_START_LEN + n, UART_COM_END, COM_END_LEN);
+    return COM_START_LEN + n + COM_END_LEN;
+}
+
+static const unsigned char *find(const unsigned char *p, size_t n, const char *pat, size_t m) {
+    for (const unsigned char *end = p + n; (size_t)(end - p) >= m; p++) {
+        p = memchr(p, pat[0], (size_t)(end - p) - m + 1);
+        if (!p) return NULL;
+        if (memcmp(p, pat, m) == 0) return p;
+    }
+    return NULL;
+}
+
+/* uart_frame_decode() resuming at *scan: buf[0, *scan) is known to hold
+   no frame end. On 0 *scan says where to resume once more bytes are in. */
+static int decode_from(enum uart_framing f, unsigned char *buf, size_t n, size_t *scan,
+                       const void **payload, size_t *len, size_t *consumed) {
+    *consumed = 0;
+    if (f == UART_FRAMING_TEXT) {
+        const unsigned char *end = find(buf + *scan, n - *scan, UART_COM_END, COM_END_LEN);
+        if (!end) {
+            *scan = n >= COM_END_LEN ? n - (COM_END_LEN - 1) : 0;
+            return 0;
+        }
+        size_t e = (size_t)(end - buf);
+        const unsigned char *start = find(buf, e, UART_COM_START, COM_START_LEN);
+        size_t s = start ? (size_t)(start - buf) + COM_START_LEN : 0;
+        *payload = buf + s;
+        *len = e - s;
+        *consumed = e + COM_END_LEN;
+        return 1;
+    }
+
+    if (f == UART_FRAMING_COBS) {
+        size_t begin = 0;
+        for (;;) {
+            size_t z = *scan + cobs_zero(buf + *scan, n - *scan);
+            if (z == n) {
+                *consumed = begin;   /* back-to-back delimiters */
+                *scan = n;
+                return 0;
+            }
+            if (z > begin) {
+                *consumed = z + 1;
+                if (uart_cobs_check(buf + begin, z - begin, len) != 1) return -1;
+                *payload = buf + begin;
+                return 1;
+            }
+            begin = *scan = z + 1;
+        }
+    }
+
+    /* binary: skip to a sync byte, then the length fixes where the frame ends */
+    const unsigned char *sync = memchr(buf, UART_BIN_SYNC, n);
+    size_t off = sync ? (size_t)(sync - buf) : n;
+    *consumed = off;
+    if (off == n) return 0;
+    uint64_t length = 0;
+    size_t used = 0;
+    int v = uart_varint_get(buf + off + 1, n - off - 1, &length, &used);
+    if (v == 0) return 0;
+    if (v < 0 || length > UART_FRAME_MAX_LEN) {
+        *consumed = off + 1;   /* not a real sync byte */
+        return -1;
+    }
+    size_t i = off + 1 + used;
+    if (n - i < length + UART_CRC_LEN) return 0;
+    uint32_t crc = uart_crc32c(uart_crc32c(0, buf + off + 1, used), buf + i, (size_t)length);
+    if (crc != uart_crc_get(buf + i + length)) {
+        *consumed = off + 1;
+        return -1;
+    }
+    *payload = buf + i;
+    *len = (size_t)length;
+    *consumed = i + (size_t)length + UART_CRC_LEN;
+    return 1;
+}
+
+int uart_frame_decode(enum uart_framing f, void *buf, size_t n,
+                      const void **payload, size_t *len, size_t *consumed) {
+    size_t scan = 0;
+    return decode_from(f, buf, n, &scan, payload, len, consumed);
+}
+
+/* ---- port handle ---- */
+
+struct uart_handle {
+    int fd;
+    enum uart_framing framing;
+
+    unsigned char *rx;
+    size_t rx_cap;
+    size_t rx_off, rx_len;      /* unconsumed bytes: rx[rx_off, rx_len) */
+    size_t rx_scan;             /* relative to rx_off, see decode_from() */
+    size_t rx_handed;           /* frame returned by the last uart_recv() */
+    int rx_owned;
+
+    unsigned char *tx;          /* COBS encoding buffer */
+    size_t tx_cap;
+    int tx_owned;
+    struct iovec iov[3];
+    int iov_first, iov_count;
+    size_t tx_left;
+    unsigned char hdr[1 + UART_VARINT_MAX];
+    unsigned char crc[UART_CRC_LEN];
+
+    struct uart_stats st;
+};
+
+uart_t *uart_open(const char *path, const struct uart_config *cfg) {
+    uart_t *u = calloc(1, sizeof(*u));
+    if (!u) return NULL;
+    u->framing = cfg->framing;
+    u->rx = cfg->rx_buf;
+    u->rx_cap = cfg->rx_cap ? cfg->rx_cap : UART_RX_DEFAULT_CAP;
+    u->tx = cfg->tx_buf;
+    u->tx_cap = cfg->tx_buf ? cfg->tx_cap : 0;
+    if (!u->rx) {
+        u->rx = malloc(u->rx_cap);
+        u->rx_owned = 1;
+    }
+    u->tx_owned = !cfg->tx_buf;
+
+    u->fd = u->rx ? open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC) : -1;
+    if (u->fd < 0 || uart_configure(u->fd, cfg->baud_rate, cfg->keep_input) < 0) {
+        int e = u->rx ? errno : ENOMEM;
+        uart_close(u);
+        errno = e;
+        return NULL;
+    }
+    return u;
+}
+
+void uart_close(uart_t *u) {
+    if (!u) return;
+    if (u->fd >= 0) close(u->fd);
+    if (u->rx_owned) free(u->rx);
+    if (u->tx_owned) free(u->tx);
+    free(u);
+}
+
+int uart_fd(const uart_t *u) {
+    return u->fd;
+}
+
+short uart_events(const uart_t *u) {
+    return (short)(POLLIN | (u->tx_left ? POLLOUT : 0));
+}
+
+int uart_flush(uart_t *u) {
+    while (u->tx_left > 0) {
+        ssize_t n = writev(u->fd, u->iov + u->iov_first, u->iov_count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        u->tx_left -= (size_t)n;
+        u->st.bytes_out += (uint64_t)n;
+        size_t k = (size_t)n;
+        while (u->iov_count > 0 && k >= u->iov[u->iov_first].iov_len) {
+            k -= u->iov[u->iov_first].iov_len;
+            u->iov_first++;
+            u->iov_count--;
+        }
+        if (k > 0) {
+            u->iov[u->iov_first].iov_base = (char *)u->iov[u->iov_first].iov_base + k;
+            u->iov[u->iov_first].iov_len -= k;
+        }
+    }
+    return 0;
+}
+
+int uart_send(uart_t *u, const void *payload, size_t len) {
+    if (u->tx_left) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (len > UART_FRAME_MAX_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    int n = 0;
+    if (u->framing == UART_FRAMING_COBS) {
+        /* stuffing rewrites the payload: the one framing that needs a copy */
+        size_t need = uart_frame_bound(u->framing, len);
+        if (need > u->tx_cap) {
+            unsigned char *nb = u->tx_owned ? realloc(u->tx, need) : NULL;
+            if (!nb) {
+                errno = u->tx_owned ? ENOMEM : EMSGSIZE;
+                return -1;
+            }
+            u->tx = nb;
+            u->tx_cap = need;
+        }
+        u->iov[n++] = (struct iovec){ .iov_base = u->tx, .iov_len = uart_cobs_frame(payload, len, u->tx) };
+    } else if (u->framing == UART_FRAMING_BINARY) {
+        uint32_t crc;
+        size_t h = uart_bin_header(UART_BIN_SYNC, len, u->hdr, &crc);
+        uart_crc_put(u->crc, uart_crc32c(crc, payload, len));
+        u->iov[n++] = (struct iovec){ .iov_base = u->hdr, .iov_len = h };
+        u->iov[n++] = (struct iovec){ .iov_base = (void *)payload, .iov_len = len };
+        u->iov[n++] = (struct iovec){ .iov_base = u->crc, .iov_len = UART_CRC_LEN };
+    } else {
+        u->iov[n++] = (struct iovec){ .iov_base = (void *)UART_COM_START, .iov_len = COM_START_LEN };
+        u->iov[n++] = (struct iovec){ .iov_base = (void *)payload, .iov_len = len };
+        u->iov[n++] = (struct iovec){ .iov_base = (void *)UART_COM_END, .iov_len = COM_END_LEN };
+    }
+    u->iov_first = 0;
+    u->iov_count = n;
+    u->tx_left = 0;
+    for (int i = 0; i < n; i++) u->tx_left += u->iov[i].iov_len;
+    u->st.frames_out++;
+    return uart_flush(u);
+}
+
+static void rx_consume(uart_t *u, size_t n) {
+    u->rx_off += n;
+    u->rx_scan = u->rx_scan > n ? u->rx_scan - n : 0;
+}
+
+int uart_recv(uart_t *u, const void **payload, size_t *len) {
+    rx_consume(u, u->rx_handed);
+    u->rx_handed = 0;
+    for (;;) {
+        size_t used;
+        int r = decode_from(u->framing, u->rx + u->rx_off, u->rx_len - u->rx_off, &u->rx_scan, payload, len, &used);
+        if (r == 1) {
+            u->rx_handed = used;
+            u->st.frames_in++;
+            return 1;
+        }
+        if (r < 0) u->st.dropped++;
+        if (used > 0) {
+            rx_consume(u, used);
+            continue;
+        }
+
+        /* need more: make room at the end, then read what the fd has */
+        if (u->rx_off > 0) {
+            memmove(u->rx, u->rx + u->rx_off, u->rx_len - u->rx_off);
+            u->rx_len -= u->rx_off;
+            u->rx_off = 0;
+        }
+        if (u->rx_len == u->rx_cap) {
+            u->rx_len = u->rx_scan = 0;
+            u->st.dropped++;
+            errno = EMSGSIZE;
+            return -1;
+        }
+        ssize_t k = read(u->fd, u->rx + u->rx_len, u->rx_cap - u->rx_len);
+        if (k > 0) {
+            u->rx_len += (size_t)k;
+            u->st.bytes_in += (uint64_t)k;
+            continue;
+        }
+        if (k == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+void uart_get_stats(const uart_t *u, struct uart_stats *st) {
+    *st = u->st;
+}
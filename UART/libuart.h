@@ -0,0 +1,124 @@
+// libuart.h - embeddable UART framing and port API: opaque handle, no globals
+#ifndef UART_LIBUART_H
+#define UART_LIBUART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* wire formats, shared with the CLI (-m text|bin|cobs) */
+#define UART_COM_START "[UART_COM][START]"
+#define UART_COM_END "[UART_COM][END]"
+#define UART_BIN_SYNC 0xA5            /* then varint length, payload, CRC-32C LE */
+#define UART_CRC_LEN 4
+#define UART_FRAME_MAX_LEN (64u * 1024u * 1024u)
+
+enum uart_framing {
+    UART_FRAMING_TEXT = 0,      /* START marker, payload, END marker */
+    UART_FRAMING_BINARY,        /* sync byte, varint length, payload, CRC-32C */
+    UART_FRAMING_COBS,          /* 0x00, COBS(payload, CRC-32C), 0x00 */
+};
+
+uint32_t uart_crc32c(uint32_t crc, const void *data, size_t n);
+
+/* Put fd in raw 8N1 at baud_rate (any rate the driver takes, on Linux and
+   macOS). Attributes already in effect are not written again, which
+   saves a tcsetattr() on every reopen. Unless keep_input, input queued
+   before the call is flushed. Returns 1 if nothing had to change, 0 once
+   applied, -1 with errno set (ENOTTY, EINVAL for an unsupported rate). */
+int uart_configure(int fd, long baud_rate, int keep_input);
+
+/* ---- framing, on caller buffers ---- */
+
+/* bytes uart_frame_encode() may need for an n-byte payload */
+size_t uart_frame_bound(enum uart_framing f, size_t n);
+/* frame payload into out. Returns the frame length, 0 if cap is too small
+   or n exceeds UART_FRAME_MAX_LEN. */
+size_t uart_frame_encode(enum uart_framing f, const void *payload, size_t n, void *out, size_t cap);
+/* Look for the first frame in buf[0, n). Returns 1 with *payload, *len a
+   view into buf (COBS is decoded in place, so buf is written to); 0 if
+   no frame is complete yet; -1 for a candidate that fails its check.
+   *consumed is always set: the bytes to discard before the next call
+   (the frame, or noise and the bad frame). */
+int uart_frame_decode(enum uart_framing f, void *buf, size_t n,
+                      const void **payload, size_t *len, size_t *consumed);
+
+/* ---- wire primitives, for callers doing their own I/O (the CLI) ---- */
+
+#define UART_VARINT_MAX 5               /* longest length varint (LEB128) */
+
+size_t uart_varint_put(uint64_t v, unsigned char *out);
+/* 1 with *v and its byte count *used, 0 if p[0, n) ends mid-varint, -1 if
+   it runs past UART_VARINT_MAX bytes */
+int uart_varint_get(const unsigned char *p, size_t n, uint64_t *v, size_t *used);
+/* binary frame header: sync byte (UART_BIN_SYNC, or a caller's own) and
+   varint n into hdr (1 + UART_VARINT_MAX bytes). Returns its length; *crc
+   covers the length bytes, for uart_crc32c() to continue over the payload. */
+size_t uart_bin_header(unsigned char sync, size_t n, unsigned char *hdr, uint32_t *crc);
+/* the CRC trailer, little endian */
+void uart_crc_put(unsigned char *out, uint32_t crc);
+uint32_t uart_crc_get(const unsigned char *p);
+/* a whole COBS frame, delimiters and CRC included, into out
+   (uart_frame_bound(UART_FRAMING_COBS, n) bytes); returns its length */
+size_t uart_cobs_frame(const void *payload, size_t n, unsigned char *out);
+/* decode one COBS candidate p[0, n) (between delimiters) in place and check
+   its CRC: 1 with the *len payload bytes at p, 0 if it does not decode,
+   -1 on a CRC mismatch */
+int uart_cobs_check(unsigned char *p, size_t n, size_t *len);
+
+/* ---- port handle ---- */
+
+typedef struct uart_handle uart_t;
+
+struct uart_config {
+    long baud_rate;
+    enum uart_framing framing;
+    int keep_input;             /* do not flush input queued before the open */
+    /* receive workspace: the largest frame that can be received, on the
+       wire. NULL lets uart_open() allocate rx_cap bytes (64 KiB if 0). */
+    void *rx_buf;
+    size_t rx_cap;
+    /* COBS only: where uart_send() encodes; NULL allocates as needed */
+    void *tx_buf;
+    size_t tx_cap;
+};
+
+struct uart_stats {
+    uint64_t bytes_out, bytes_in;
+    uint64_t frames_out, frames_in;
+    uint64_t dropped;           /* frames that failed their check, or did not fit */
+};
+
+/* the fd is non-blocking and stays owned by the handle. NULL with errno on failure. */
+uart_t *uart_open(const char *path, const struct uart_config *cfg);
+void uart_close(uart_t *u);
+int uart_fd(const uart_t *u);
+/* poll() events to wait for: POLLIN, plus POLLOUT while a send is pending */
+short uart_events(const uart_t *u);
+
+/* Start sending one framed payload. Text and binary frames go out straight
+   from payload, which must stay valid until the send completes. Returns 0
+   when fully written, 1 if the rest waits for POLLOUT and uart_flush(),
+   -1 with errno (EBUSY while another send is pending). */
+int uart_send(uart_t *u, const void *payload, size_t len);
+/* write more of the pending send: 0 done, 1 still pending, -1 error */
+int uart_flush(uart_t *u);
+
+/* Read what the fd has and return the next frame: 1 with a view into the
+   receive workspace, valid until the next uart_recv(); 0 if none is
+   complete (wait for POLLIN); -1 with errno on a read error, EPIPE at
+   end of file, or EMSGSIZE when a frame outgrew the workspace (it is
+   dropped). Frames failing their check are dropped and counted. */
+int uart_recv(uart_t *u, const void **payload, size_t *len);
+
+void uart_get_stats(const uart_t *u, struct uart_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
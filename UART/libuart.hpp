@@ -0,0 +1,126 @@
+// libuart.hpp - C++20 wrapper over libuart.h: RAII port, spans, exceptions
+#ifndef UART_LIBUART_HPP
+#define UART_LIBUART_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include "libuart.h"
+
+namespace uart {
+
+enum class Framing {
+    text = UART_FRAMING_TEXT,
+    binary = UART_FRAMING_BINARY,
+    cobs = UART_FRAMING_COBS,
+};
+
+using Stats = uart_stats;
+
+[[noreturn]] inline void throw_errno(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+inline std::size_t frame_bound(Framing f, std::size_t n) {
+    return uart_frame_bound(static_cast<uart_framing>(f), n);
+}
+
+/* frame payload into out; returns the part of out written, empty if it does not fit */
+inline std::span<std::byte> encode(Framing f, std::span<const std::byte> payload, std::span<std::byte> out) {
+    return out.first(uart_frame_encode(static_cast<uart_framing>(f), payload.data(), payload.size(),
+                                       out.data(), out.size()));
+}
+
+struct Decoded {
+    int status;                          /* as uart_frame_decode(): 1, 0 or -1 */
+    std::span<const std::byte> payload;  /* a view into the decoded buffer */
+    std::size_t consumed;
+};
+
+inline Decoded decode(Framing f, std::span<std::byte> buf) {
+    const void *p = nullptr;
+    std::size_t len = 0, used = 0;
+    int r = uart_frame_decode(static_cast<uart_framing>(f), buf.data(), buf.size(), &p, &len, &used);
+    if (r != 1) return {r, {}, used};
+    return {r, {static_cast<const std::byte *>(p), len}, used};
+}
+
+/* Owns one open port; move-only. Failures throw std::system_error,
+   "would block" is a return value. */
+class Port {
+public:
+    struct Config {
+        long baud_rate = 115200;
+        Framing framing = Framing::text;
+        bool keep_input = false;
+        std::span<std::byte> rx_buf{};   /* empty: the library allocates 64 KiB */
+    };
+
+    Port(const std::string &path, const Config &cfg) {
+        uart_config c{};
+        c.baud_rate = cfg.baud_rate;
+        c.framing = static_cast<uart_framing>(cfg.framing);
+        c.keep_input = cfg.keep_input;
+        c.rx_buf = cfg.rx_buf.data();
+        c.rx_cap = cfg.rx_buf.size();
+        u_ = uart_open(path.c_str(), &c);
+        if (!u_) throw_errno("uart_open");
+    }
+
+    Port(Port &&o) noexcept : u_(std::exchange(o.u_, nullptr)) {}
+    Port &operator=(Port &&o) noexcept {
+        if (this != &o) {
+            uart_close(u_);
+            u_ = std::exchange(o.u_, nullptr);
+        }
+        return *this;
+    }
+    Port(const Port &) = delete;
+    Port &operator=(const Port &) = delete;
+    ~Port() { uart_close(u_); }
+
+    int fd() const { return uart_fd(u_); }
+    short events() const { return uart_events(u_); }
+
+    /* true once written, false while the rest waits for POLLOUT and flush();
+       text and binary payloads must stay valid until then */
+    bool send(std::span<const std::byte> payload) {
+        int r = uart_send(u_, payload.data(), payload.size());
+        if (r < 0) throw_errno("uart_send");
+        return r == 0;
+    }
+
+    bool flush() {
+        int r = uart_flush(u_);
+        if (r < 0) throw_errno("uart_flush");
+        return r == 0;
+    }
+
+    /* the next frame, valid until the next recv(); nullopt until POLLIN brings one */
+    std::optional<std::span<const std::byte>> recv() {
+        const void *p = nullptr;
+        std::size_t len = 0;
+        int r = uart_recv(u_, &p, &len);
+        if (r < 0) throw_errno("uart_recv");
+        if (r == 0) return std::nullopt;
+        return std::span<const std::byte>(static_cast<const std::byte *>(p), len);
+    }
+
+    Stats stats() const {
+        Stats s;
+        uart_get_stats(u_, &s);
+        return s;
+    }
+
+private:
+    uart_t *u_ = nullptr;
+};
+
+} // namespace uart
+
+#endif
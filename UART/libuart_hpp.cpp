@@ -0,0 +1,13 @@
+// libuart_hpp.cpp - builds libuart.hpp as C++20 with the library, so the wrapper cannot rot
+#include "libuart.hpp"
+
+#include <type_traits>
+
+/* nothing here is emitted: the header's inline bodies are checked as the
+   classes are defined, and these pin down the ownership rules */
+static_assert(std::is_nothrow_move_constructible_v<uart::Port>);
+static_assert(std::is_nothrow_move_assignable_v<uart::Port>);
+static_assert(!std::is_copy_constructible_v<uart::Port>);
+static_assert(!std::is_copy_assignable_v<uart::Port>);
+static_assert(std::is_same_v<decltype(uart::Decoded::payload), std::span<const std::byte>>);
+static_assert(static_cast<int>(uart::Framing::cobs) == UART_FRAMING_COBS);
@@ -0,0 +1,268 @@
+// log.c - synchronous and asynchronous (ring buffer + writer thread) logging
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int log_debug = 0;
+static FILE *console;   /* NULL: stdout */
+int log_level = TRACE;
+
+static const char *level_name(int log_lvl) {
+    const char *lvlStr[] = {"ERROR", "WARNING", "INFO", "TRACE"};
+    if (log_lvl >= 1 && log_lvl <= 4) return lvlStr[log_lvl - 1];
+    return "UNKNOWN";
+}
+
+void log_set_debug(int on) {
+    log_debug = on;
+}
+
+void log_set_console(FILE *f) {
+    console = f;
+}
+
+static FILE *console_out(void) {
+    return console ? console : stdout;
+}
+
+/* ---- asynchronous backend ----
+   Bounded MPSC ring (Vyukov): each slot carries a sequence number telling
+   producers when it is free and the writer when it is full. Producers claim a
+   slot with one CAS and never block; if the ring is full the record is
+   dropped and counted. An idle writer sleeps on a pipe: it raises
+   writer_waiting before its last look at the ring, and a producer that
+   finds the flag raised after publishing clears it and writes one byte.
+   Producers are counted while they push, so stop can wait them out before
+   its final drain and closing the pipe. */
+#define LOG_RING_SLOTS 1024   /* power of two */
+#define LOG_RECORD_MAX 512
+
+struct log_slot {
+    atomic_size_t seq;
+    uint64_t ts_us;   /* CLOCK_MONOTONIC */
+    int lvl;
+    int err;          /* errno at the call site */
+    char msg[LOG_RECORD_MAX];
+};
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;              /* writer thread only */
+static atomic_ulong dropped;
+static atomic_int async_on;
+static atomic_int async_stop;
+static atomic_int producers;            /* logit() calls inside async_push() */
+static pthread_t writer;
+static FILE *async_file;
+static atomic_int writer_waiting;
+static int wake_pipe[2] = { -1, -1 };   /* producers -> writer; write end non-blocking */
+
+static uint64_t log_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void async_push(const char *fmt, va_list args, int log_lvl, int err) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    struct log_slot *slot;
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return; /* full */
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->ts_us = log_now_us();
+    slot->lvl = log_lvl;
+    slot->err = err;
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    /* the ring went non-empty under a sleeping writer: wake it */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&writer_waiting, 0)) {
+        int saved = errno;
+        int fd = wake_pipe[1];
+        char c = 1;
+        if (write(fd, &c, 1) < 0) {}   /* full pipe: a wakeup is already pending */
+        errno = saved;
+    }
+}
+
+/* a published record waits at the front of the ring */
+static int async_pending(void) {
+    struct log_slot *slot = &ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == dequeue_pos + 1;
+}
+
+/* write out every published record; returns how many there were */
+static size_t async_drain(void) {
+    FILE *out = console_out();
+    size_t n = 0;
+    for (;;) {
+        struct log_slot *slot = &ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != dequeue_pos + 1) break;
+
+        char line[LOG_RECORD_MAX + 128];
+        int len = snprintf(line, sizeof(line), "[%llu.%06llu] [%s] %s",
+                           (unsigned long long)(slot->ts_us / 1000000u),
+                           (unsigned long long)(slot->ts_us % 1000000u),
+                           level_name(slot->lvl), slot->msg);
+        if (slot->err != 0 && len >= 0 && (size_t)len < sizeof(line))
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " (errno=%d: %s)", slot->err, strerror(slot->err));
+
+        atomic_store_explicit(&slot->seq, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        dequeue_pos++;
+        n++;
+
+        fputs(line, out);
+        fputc('\n', out);
+        if (async_file) {
+            fputs(line, async_file);
+            fputc('\n', async_file);
+        }
+    }
+    if (n > 0) {
+        fflush(out);
+        if (async_file) fflush(async_file);
+    }
+    return n;
+}
+
+static void *async_writer(void *arg) {
+    (void)arg;
+    for (;;) {
+        async_drain();
+        if (atomic_load_explicit(&async_stop, memory_order_acquire)) break;
+
+        atomic_store(&writer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (async_pending() || atomic_load(&async_stop)) {
+            atomic_store(&writer_waiting, 0);
+            continue;
+        }
+        char drain[64];
+        while (read(wake_pipe[0], drain, sizeof(drain)) < 0 && errno == EINTR) {}
+    }
+    async_drain();
+    return NULL;
+}
+
+static void close_wake_pipe(void) {
+    for (int i = 0; i < 2; i++) {
+        if (wake_pipe[i] >= 0) close(wake_pipe[i]);
+        wake_pipe[i] = -1;
+    }
+}
+
+int log_async_start(void) {
+    if (atomic_load(&async_on)) return 0;
+
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) atomic_init(&ring[i].seq, i);
+    atomic_store(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    atomic_store(&dropped, 0);
+    atomic_store(&async_stop, 0);
+    atomic_store(&writer_waiting, 0);
+
+    if (pipe(wake_pipe) != 0 || fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        close_wake_pipe();
+        log_error("Failed to start async log writer");
+        return -1;
+    }
+    async_file = NULL;
+    if (log_debug) {
+        async_file = fopen(LOG_FILE_PATH, "a");
+        if (!async_file) log_warning("Cannot open %s; async log goes to the console only", LOG_FILE_PATH);
+    }
+    if (pthread_create(&writer, NULL, async_writer, NULL) != 0) {
+        if (async_file) fclose(async_file);
+        async_file = NULL;
+        close_wake_pipe();
+        log_error("Failed to start async log writer");
+        return -1;
+    }
+    atomic_store_explicit(&async_on, 1, memory_order_release);
+    return 0;
+}
+
+void log_async_stop(void) {
+    if (!atomic_load(&async_on)) return;
+
+    int saved = errno;
+    atomic_store_explicit(&async_stop, 1, memory_order_release);
+    char c = 1;
+    if (write(wake_pipe[1], &c, 1) < 0) {}
+    pthread_join(writer, NULL);
+    atomic_store(&async_on, 0);
+    /* a producer that saw async_on set is still pushing: its record belongs
+       in the final drain, and it may yet write to the pipe */
+    while (atomic_load(&producers) > 0) sched_yield();
+    /* records pushed after the writer's last drain */
+    async_drain();
+    close_wake_pipe();
+    errno = saved;
+    if (async_file) fclose(async_file);
+    async_file = NULL;
+
+    unsigned long drops = atomic_load(&dropped);
+    if (drops > 0) log_warning("Async log ring overflowed; %lu records dropped", drops);
+}
+
+void logit(const char *fmt, va_list args, int log_lvl) {
+    if (atomic_load_explicit(&async_on, memory_order_acquire)) {
+        /* counted before async_on is looked at again, so stop either sees
+           this push or this call sees the backend off */
+        atomic_fetch_add(&producers, 1);
+        int on = atomic_load(&async_on);
+        if (on) async_push(fmt, args, log_lvl, errno);
+        atomic_fetch_sub(&producers, 1);
+        if (on) return;
+    }
+
+    char message[1024];
+    vsnprintf(message, sizeof(message), fmt, args);
+
+    time_t now = time(NULL);
+    const char *lvl = level_name(log_lvl);
+
+    FILE *out = console_out();
+    fprintf(out, "[%ld] [%s] %s", (long)now, lvl, message);
+    if (errno != 0) {
+        fprintf(out, " (errno=%d: %s)", errno, strerror(errno));
+    }
+    fprintf(out, "\n");
+
+    if (log_debug) {
+        FILE *log_file = fopen(LOG_FILE_PATH, "a");
+        if (log_file) {
+            fprintf(log_file, "[%ld] [%s] %s", (long)now, lvl, message);
+            if (errno != 0) {
+                fprintf(log_file, " (errno=%d: %s)", errno, strerror(errno));
+            }
+            fprintf(log_file, "\n");
+            fclose(log_file);
+        }
+    }
+}
+void log_emit(int log_lvl, const char *fmt, ...) { va_list args; va_start(args, fmt); logit(fmt, args, log_lvl); va_end(args); }
@@ -0,0 +1,62 @@
+// log.h - logging helpers shared by the UART tool
+#ifndef UART_LOG_H
+#define UART_LOG_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#define ERROR 1
+#define WARNING 2
+#define INFO 3
+#define TRACE 4
+
+/* debug-mode copy of every record */
+#define LOG_FILE_PATH "/tmp/error.log"
+
+/* also append records to LOG_FILE_PATH */
+void log_set_debug(int on);
+
+/* where records are printed (stdout by default); call before logging starts */
+void log_set_console(FILE *f);
+
+/* asynchronous backend: records are preformatted into a lock-free ring and a
+   background thread writes them out, keeping the log file open. Returns 0 on
+   success; on failure logging stays synchronous. */
+int log_async_start(void);
+/* drain whatever is queued, stop the writer thread and report drops */
+void log_async_stop(void);
+
+/* most verbose level compiled in; calls above it (and their arguments)
+   compile away entirely. Release builds set this to WARNING. */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL TRACE
+#endif
+
+/* most verbose level emitted at run time (-v); defaults to TRACE */
+extern int log_level;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF(f, a) __attribute__((format(printf, f, a)))
+#define LOG_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define LOG_PRINTF(f, a)
+#define LOG_UNLIKELY(x) (x)
+#endif
+
+void logit(const char *fmt, va_list args, int log_lvl);
+void log_emit(int log_lvl, const char *fmt, ...) LOG_PRINTF(2, 3);
+
+/* one constant-folded test against the build level, one predictable branch
+   against the run-time level; arguments are only evaluated when emitted */
+#define LOG_AT(lvl, ...)                                                      \
+    do {                                                                      \
+        if ((lvl) <= LOG_COMPILE_LEVEL && !LOG_UNLIKELY((lvl) > log_level))   \
+            log_emit((lvl), __VA_ARGS__);                                     \
+    } while (0)
+
+#define log_trace(...)   LOG_AT(TRACE, __VA_ARGS__)
+#define log_info(...)    LOG_AT(INFO, __VA_ARGS__)
+#define log_warning(...) LOG_AT(WARNING, __VA_ARGS__)
+#define log_error(...)   LOG_AT(ERROR, __VA_ARGS__)
+
+#endif
@@ -1,300 +1,1011 @@
 // main.c - UART CLI sender + read-until-end-marker
 #include <errno.h>
 #include <fcntl.h>
-#include <stdarg.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
-#include <sys/termios.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
-struct Config {
-    int debug_mode;
-    const char *device_path;
-    long baud_rate;
-} conf;
+#include "capture.h"
+#include "daemon.h"
+#include "hist.h"
+#include "log.h"
+#include "multiport.h"
+#include "rxthread.h"
+#include "transfer.h"
+#include "uart.h"
+#include "vdev.h"
 
-#define ERROR 1
-#define WARNING 2
-#define INFO 3
-#define TRACE 4
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s -p <device_path> -b <baud_rate> (-c <command> [-n count] [--duration t] [--rate hz] | -f <file>) [-0] [-S | -o file] [-w window [--coalesce bytes[,us]|off]] [-m text|bin|cobs] [-z] [-E pattern] [-T timeout] [-F ms] [-G ms] [-L latency|wakeups] [-C file] [-x] [-A] [-v level] [--stats=json] [--rx-thread cpu[,fifo[:prio]]] [-h]\n", prog);
+  fprintf(stderr, "       %s -p <device_path> -b <baud_rate> -D <socket> [-w window] [--coalesce bytes[,us]|off] [-T timeout] [-F ms] [-G ms] [-L mode]\n", prog);
+  fprintf(stderr, "       %s -U <socket> (-c <command> | -f <file>) [-0]\n", prog);
+  fprintf(stderr, "       %s -p <device_path> -b <baud_rate> (--send-file <file> [-w window] | --recv-file <file>) [-m bin|cobs] [-z] [-T timeout]\n", prog);
+  fprintf(stderr, "       %s --dump-capture <file> [--from <time>]\n", prog);
+  fprintf(stderr, "       %s --virtual <count> [-b baud] [--respond file] [--turnaround ms] [--faults list]\n", prog);
+  fprintf(stderr, "Example: %s -p /dev/ttyUSB0 -b 115200 -c \"STATUS\\r\\n\" -T 5 -x\n", prog);
+  fprintf(stderr, "  -p <device_path> : Path to Serial Device (e.g., /dev/ttyUSB0); repeat for multi-port mode,\n");
+  fprintf(stderr, "                     optionally as path@baud, and every command goes to every port\n");
+  fprintf(stderr, "  -b <baud_rate>   : Baud Rate (e.g., 9600, 115200, 921600, 3000000; non-standard rates where supported)\n");
+  fprintf(stderr, "  -c <command>     : Command to send\n");
+  fprintf(stderr, "  -f <file>        : Batch mode: read commands from file ('-' for stdin), one per line\n");
+  fprintf(stderr, "  -n <count>       : Send the -c command count times on the open port and report latency percentiles\n");
+  fprintf(stderr, "  --duration <t>   : Keep repeating the -c command for t (seconds, or with ms suffix)\n");
+  fprintf(stderr, "  --rate <hz>      : Repeat at this many requests per second; latency counts from each scheduled send\n");
+  fprintf(stderr, "  -0               : Batch commands are NUL-separated instead of newline-separated\n");
+  fprintf(stderr, "  -S               : Stream each response payload to stdout as it arrives, markers stripped;\n");
+  fprintf(stderr, "                     the banner and log go to stderr instead\n");
+  fprintf(stderr, "  -o <file>        : Like -S but stream into file\n");
+  fprintf(stderr, "  -w <window>      : Pipeline batch commands: up to window sequence-tagged requests in flight\n");
+  fprintf(stderr, "  --coalesce <b,us>: With -w or -D, gather queued requests into one write of up to b bytes\n");
+  fprintf(stderr, "                     (default %d), holding one at most us microseconds (default %d); off\n",
+          TX_COALESCE_DEFAULT_BYTES, TX_COALESCE_DEFAULT_US);
+  fprintf(stderr, "                     never holds, and -w then writes each request on its own\n");
+  fprintf(stderr, "  -m <framing>     : text (default, [UART_COM] markers), bin (sync + varint length + CRC-32C)\n");
+  fprintf(stderr, "                     or cobs (COBS-stuffed payload + CRC-32C between 0x00 delimiters)\n");
+  fprintf(stderr, "  -z               : Offer LZ4-compressed binary frames (-m bin); used if the device accepts them\n");
+  fprintf(stderr, "  -E <pattern>     : Also end a response at pattern (e.g. \"ERROR:\", a bootloader prompt);\n");
+  fprintf(stderr, "                     repeatable, and the terminator that matched is reported\n");
+  fprintf(stderr, "  -T <timeout>     : Total time to wait for response, seconds or with ms suffix (default 5)\n");
+  fprintf(stderr, "  -F <ms>          : Give up if no first byte arrives within ms (default off)\n");
+  fprintf(stderr, "  -G <ms>          : Give up after an inter-byte gap of ms (default off)\n");
+  fprintf(stderr, "  -L <mode>        : Tune the port for latency (low-latency flag, 1 ms FTDI timer, VMIN=1 VTIME=0)\n");
+  fprintf(stderr, "                     or wakeups (reads batch 64 bytes or a 0.1 s gap); applied knobs are reported\n");
+  fprintf(stderr, "  --io <backend>   : Multi-port I/O: poll (epoll/kqueue, default) or uring (io_uring on Linux,\n");
+  fprintf(stderr, "                     batched submissions; falls back to poll where unavailable)\n");
+  fprintf(stderr, "  --no-flush       : Keep bytes the device sent before the port was opened (no tcflush)\n");
+  fprintf(stderr, "  --reconnect[=t]  : If the adapter disappears, reopen it within t (default %ds) and resume\n",
+          RECONNECT_DEFAULT_MS / 1000);
+  fprintf(stderr, "  -D <socket>      : Daemon mode: own the port and serve requests from -U clients on a Unix socket\n");
+  fprintf(stderr, "  -U <socket>      : Send the commands through the daemon listening on socket instead of opening a port\n");
+  fprintf(stderr, "  -C <file>        : Capture every byte sent and received, timestamped, into file (mmap'd, indexed)\n");
+  fprintf(stderr, "  --dump-capture <f>: Print the records of capture f; --from seeks to a time first\n");
+  fprintf(stderr, "  --from <time>    : Epoch seconds (e.g. 1791999732.25) or +seconds from the start of the capture\n");
+  fprintf(stderr, "  --virtual <n>    : Create n PTYs (paths printed one per line) that answer frames like a device;\n");
+  fprintf(stderr, "                     -b paces replies at that line rate\n");
+  fprintf(stderr, "  --respond <f>    : Reply from f: \"request<TAB>reply\" lines (\"*\" matches any) or a -C capture\n");
+  fprintf(stderr, "  --turnaround <ms>: Device delay before each reply (default 0)\n");
+  fprintf(stderr, "  --faults <list>  : Comma list of split|garbage|stall[:percent] (default 10%%) injected into replies\n");
+  fprintf(stderr, "  -x               : Enable Debug Mode (optional)\n");
+  fprintf(stderr, "  -A               : Asynchronous logging via a background writer thread\n");
+  fprintf(stderr, "  -v <level>       : Log level: off|error|warning|info|trace or 0-4 (default trace)\n");
+  fprintf(stderr, "  --stats=json     : Per-command phase timings and I/O counters to stderr, one JSON object per line\n");
+  fprintf(stderr, "  --rx-thread <spec>: Read the port on a dedicated thread, pinned to CPU spec (or \"any\"),\n");
+  fprintf(stderr, "                     with \",fifo[:prio]\" at SCHED_FIFO priority (default %d); overruns are counted\n",
+          RXT_FIFO_DEFAULT_PRIO);
+  fprintf(stderr, "  --send-file <f>  : Stream file f to the device in acknowledged binary chunks, -w unacknowledged\n");
+  fprintf(stderr, "                     at a time (default %d); resumes where the receiver left off\n", XFER_DEFAULT_WINDOW);
+  fprintf(stderr, "  --recv-file <f>  : Receive a file from the device into f (via f.part, kept for resume on failure)\n");
+  fprintf(stderr, "  -h               : Show this help message\n");
+}
+
+/* print one response between the START/END banners; label (may be NULL)
+   is appended to the banners, e.g. "seq 12" in pipelined mode */
+static void print_response(const char *resp, size_t resp_len, const char *label) {
+  const char *sep = label ? " " : "";
+  if (!label) label = "";
+
+  if (resp_len > 0) {
+      printf("---- DEVICE RESPONSE START%s%s ----\n", sep, label);
+      fwrite(resp, 1, resp_len, stdout);
+      printf("\n---- DEVICE RESPONSE END%s%s ----\n", sep, label);
+  } else {
+      printf("No response received%s%s.\n", sep, label);
+  }
+  fflush(stdout);
+}
+
+/* --stats=json: one record per command on stderr */
+static int stats_json = 0;
+static unsigned long stats_seq = 0;
+
+static void print_us(const char *key, int64_t us) {
+  if (us < 0) fprintf(stderr, ",\"%s\":null", key);
+  else fprintf(stderr, ",\"%s\":%lld", key, (long long)us);
+}
 
-#define _newline fprintf(stdout, "\n")
+static void print_ratio(const char *key, size_t raw, size_t coded) {
+  if (coded == 0) fprintf(stderr, ",\"%s\":null", key);
+  else fprintf(stderr, ",\"%s\":%.3f", key, (double)raw / (double)coded);
+}
 
-void logit(const char *fmt, va_list args, int log_lvl) {
-    char message[1024];
-    vsnprintf(message, sizeof(message), fmt, args);
+static void print_stats_json(int status) {
+  static const char *names[] = {"error", "ok", "timeout"};
+  fprintf(stderr, "{\"cmd\":%lu,\"status\":\"%s\"", ++stats_seq, names[status + 1]);
+  print_us("open_us", io_stats.open_us);
+  print_us("write_us", io_stats.write_us);
+  print_us("drain_us", io_stats.drain_us);
+  print_us("first_byte_us", io_stats.first_byte_us);
+  print_us("marker_us", io_stats.marker_us);
+  fprintf(stderr, ",\"bytes_out\":%zu,\"bytes_in\":%zu,\"read_calls\":%lu,\"eagain_retries\":%lu",
+          io_stats.bytes_out, io_stats.bytes_in, io_stats.read_calls, io_stats.eagain_retries);
+  /* payload compression ratio, raw / on the wire (binary framing only) */
+  print_ratio("tx_ratio", io_stats.tx_raw, io_stats.tx_coded);
+  print_ratio("rx_ratio", io_stats.rx_raw, io_stats.rx_coded);
+  if (conf.rx_thread) {
+    struct rx_thread_stats rs;
+    rx_thread_get_stats(conf.rx_thread, &rs);
+    fprintf(stderr, ",\"rx_overruns\":%llu", (unsigned long long)rs.overruns);
+  }
+  fprintf(stderr, "}\n");
+  io_stats.open_us = 0; /* the open is charged to the first command only */
+}
 
-    time_t now = time(NULL);
+/* -n / --duration: responses are counted, not printed */
+static int quiet_responses = 0;
 
-    const char *lvlStr[] = {"ERROR", "WARNING", "INFO", "TRACE"};
-    const char *lvl = "UNKNOWN";
-    if (log_lvl >= 1 && log_lvl <= 4) lvl = lvlStr[log_lvl - 1];
+/* -E: extra terminators, matched together with the END marker */
+static const char *term_patterns[TERM_MAX_PATTERNS] = { UART_COM_END };
+static int nterm_patterns = 1;
+static struct term_set terms;
+
+/* per-session receive state: the ring for text frames, the carry for binary.
+   stream_fd >= 0 selects streaming output of bare payloads to that fd. */
+struct session_rx {
+  struct rx_ring ring;
+  struct rx_carry carry;
+  int stream_fd;
+};
+
+static int session_rx_init(struct session_rx *rx, int stream_fd) {
+  memset(rx, 0, sizeof(*rx));
+  rx->stream_fd = stream_fd;
+  if (conf.framing != FRAMING_TEXT) return 0;
+  return rx_ring_init(&rx->ring, RX_RING_DEFAULT_CAP);
+}
 
-    fprintf(stdout, "[%ld] [%s] %s", (long)now, lvl, message);
-    if (errno != 0) {
-        fprintf(stdout, " (errno=%d: %s)", errno, strerror(errno));
+static void session_rx_free(struct session_rx *rx) {
+  rx_ring_free(&rx->ring);
+  free(rx->carry.data);
+}
+
+/* rx_frame_fn printing a frame straight from the ring */
+struct print_state {
+  int started;
+};
+
+static int print_frame_piece(void *ctx, const struct iovec *seg, int nseg, int last) {
+  struct print_state *ps = ctx;
+  if (!ps->started && nseg > 0) {
+    printf("---- DEVICE RESPONSE START ----\n");
+    ps->started = 1;
+  }
+  for (int i = 0; i < nseg; i++) fwrite(seg[i].iov_base, 1, seg[i].iov_len, stdout);
+  if (last) {
+    if (ps->started) printf("\n---- DEVICE RESPONSE END ----\n");
+    else printf("No response received.\n");
+    fflush(stdout);
+  }
+  return 0;
+}
+
+static int discard_frame_piece(void *ctx, const struct iovec *seg, int nseg, int last) {
+  (void)ctx; (void)seg; (void)nseg; (void)last;
+  return 0;
+}
+
+/* rx_frame_fn for streaming mode: forwards each piece the moment it is read,
+   minus the framing. A leading START marker is held (at most its length)
+   until it is confirmed or ruled out; the END marker always arrives whole
+   at the tail of the last piece, so it can simply be cut off there. */
+struct strip_state {
+  int out_fd;
+  size_t start_matched;   /* leading bytes matching UART_COM_START so far */
+  int start_done;
+  size_t payload;         /* payload bytes forwarded */
+  int failed;
+};
+
+static int strip_emit(struct strip_state *st, const struct iovec *seg, int nseg, size_t from, size_t to) {
+  struct iovec out[2];
+  int n = 0;
+  size_t pos = 0;
+  for (int i = 0; i < nseg && pos < to; pos += seg[i].iov_len, i++) {
+    size_t a = from > pos ? from - pos : 0;
+    size_t b = to - pos < seg[i].iov_len ? to - pos : seg[i].iov_len;
+    if (a >= b) continue;
+    out[n++] = (struct iovec){ .iov_base = (char *)seg[i].iov_base + a, .iov_len = b - a };
+  }
+  if (n == 0) return 0;
+  size_t len = to - from;
+  if (writev_all(st->out_fd, out, n, 0) != (ssize_t)len) {
+    st->failed = 1;
+    return -1;
+  }
+  st->payload += len;
+  return 0;
+}
+
+static char piece_byte(const struct iovec *seg, int nseg, size_t at) {
+  for (int i = 0; i < nseg; i++) {
+    if (at < seg[i].iov_len) return ((const char *)seg[i].iov_base)[at];
+    at -= seg[i].iov_len;
+  }
+  return 0;
+}
+
+static int strip_frame_piece(void *ctx, const struct iovec *seg, int nseg, int last) {
+  struct strip_state *st = ctx;
+  size_t len = 0;
+  for (int i = 0; i < nseg; i++) len += seg[i].iov_len;
+
+  size_t end = len;
+  if (last && len >= UART_COM_END_LEN) {
+    size_t k = 0;
+    while (k < UART_COM_END_LEN && piece_byte(seg, nseg, len - UART_COM_END_LEN + k) == UART_COM_END[k]) k++;
+    if (k == UART_COM_END_LEN) end = len - UART_COM_END_LEN;
+  }
+
+  size_t pos = 0;
+  if (!st->start_done) {
+    while (pos < end && st->start_matched < UART_COM_START_LEN &&
+           piece_byte(seg, nseg, pos) == UART_COM_START[st->start_matched]) {
+      pos++;
+      st->start_matched++;
+    }
+    if (st->start_matched == UART_COM_START_LEN) {
+      st->start_done = 1;
+    } else if (pos < end || last) {
+      /* not a START marker after all: the held bytes are payload */
+      st->start_done = 1;
+      if (st->start_matched > 0) {
+        struct iovec held = { .iov_base = (void *)UART_COM_START, .iov_len = st->start_matched };
+        if (strip_emit(st, &held, 1, 0, st->start_matched) != 0) return -1;
+      }
+    } else {
+      return 0; /* still undecided */
     }
-    fprintf(stdout, "\n");
+  }
+  return strip_emit(st, seg, nseg, pos, end);
+}
 
-    if (conf.debug_mode) {
-        FILE *log_file = fopen("/tmp/error.log", "a");
-        if (log_file) {
-            fprintf(log_file, "[%ld] [%s] %s", (long)now, lvl, message);
-            if (errno != 0) {
-                fprintf(log_file, " (errno=%d: %s)", errno, strerror(errno));
-            }
-            fprintf(log_file, "\n");
-            fclose(log_file);
-        }
+/* send one command and print its framed response; the reply is read while
+   the command is still going out (full duplex, no tcdrain()).
+   Returns the read_until_marker() status (0 found, 1 timeout, -1 error). */
+static int run_command(int dev_handle, const char *command, size_t cmd_len, const struct read_timeouts *to,
+                       struct session_rx *rx) {
+  io_stats_reset();
+  struct tx_queue tx;
+  if (tx_queue_request(&tx, command, cmd_len) != 0 || tx_start(dev_handle, &tx) != 0) {
+    if (stats_json) print_stats_json(-1);
+    return -1;
+  }
+
+  char *resp = NULL;
+  size_t resp_len = 0;
+  struct print_state ps = {0};
+  struct strip_state st = { .out_fd = rx->stream_fd };
+  int r;
+  int which = 0;   /* index into term_patterns */
+  int stream = rx->stream_fd >= 0;
+  rx_frame_fn on_frame = stream ? strip_frame_piece : quiet_responses ? discard_frame_piece : print_frame_piece;
+  void *ctx = stream ? (void *)&st : (void *)&ps;
+  if (stream) fflush(stdout); /* keep earlier stdio output ahead of directly written payload */
+  if (conf.framing == FRAMING_TEXT && nterm_patterns > 1)
+    r = read_until_term_ring(dev_handle, &terms, to, &rx->ring, &tx, stream, on_frame, ctx, &resp_len, &which);
+  else if (conf.framing == FRAMING_TEXT)
+    r = read_until_marker_ring(dev_handle, UART_COM_END, to, &rx->ring, &tx, stream, on_frame, ctx, &resp_len);
+  else
+    r = read_response(dev_handle, to, &rx->carry, &tx, &resp, &resp_len);
+  if (st.failed) log_error("Failed writing streamed response");
+  if (tx_finish(dev_handle, &tx) != 0) r = -1;
+  tx_queue_free(&tx);
+  if (stats_json) print_stats_json(r);
+  if (r == -1) {
+    log_error("Error while reading response");
+    free(resp);
+    return -1;
+  } else if (r == 1) {
+    log_warning("Timeout waiting for end marker; partial data (%zu bytes) received", resp_len);
+  } else if (quiet_responses) {
+    /* counted by the caller */
+  } else if (which > 0) {
+    log_info("Terminator %s seen; total bytes received: %zu", term_patterns[which], resp_len);
+  } else {
+    log_info("End marker seen; total bytes received: %zu", resp_len);
+  }
+
+  if (conf.framing != FRAMING_TEXT && !quiet_responses) print_response(resp, resp_len, NULL);
+  free(resp);
+  return r;
+}
+
+#define RECONNECT_RETRIES 3
+
+/* --reconnect: if the port vanished under a command, get it back (fast
+   path: attributes left in place) and send the command again, so a batch
+   picks up where it stopped. *dev_handle is -1 if the port stayed away. */
+static int run_command_reconnecting(int *dev_handle, const char *command, size_t cmd_len,
+                                    const struct read_timeouts *to, struct session_rx *rx) {
+  int r = run_command(*dev_handle, command, cmd_len, to, rx);
+  for (int tries = 0; r != 0 && conf.reconnect_ms > 0 && tries < RECONNECT_RETRIES && serial_port_lost(*dev_handle);
+       tries++) {
+    close(*dev_handle);
+    *dev_handle = serial_port_reconnect(conf.device_path, conf.baud_rate, conf.reconnect_ms);
+    if (*dev_handle < 0) return -1;
+    if (conf.tuning != RX_TUNING_DEFAULT) serial_port_tune(*dev_handle, conf.device_path, conf.tuning, NULL);
+    /* half-received bytes belonged to the old connection */
+    rx->ring.head = rx->ring.tail;
+    rx->carry.len = 0;
+    r = run_command(*dev_handle, command, cmd_len, to, rx);
+  }
+  return r;
+}
+
+/* -n / --duration: the -c command over and over on the open port, each
+   timed from its send to the end of its reply. With a rate, request i is
+   due at start + i / rate and its latency counts from then, so a slow
+   reply is also charged to the requests it held up. */
+struct repeat_opts {
+  unsigned long count;    /* 0 = until the duration is up */
+  long duration_ms;       /* 0 = until count is reached */
+  double rate;            /* requests per second; 0 = back to back */
+};
+
+static volatile sig_atomic_t repeat_stop = 0;
+
+static void on_repeat_signal(int sig) {
+  (void)sig;
+  repeat_stop = 1;
+}
+
+static void sleep_until(uint64_t when) {
+  uint64_t now = now_us();
+  if (when <= now) return;
+  struct timespec ts = { .tv_sec = (time_t)((when - now) / 1000000u), .tv_nsec = (long)((when - now) % 1000000u) * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+static int run_repeat(int *dev_handle, const char *command, const struct read_timeouts *to,
+                      const struct repeat_opts *ro) {
+  struct session_rx rx;
+  struct lat_hist *hist = malloc(sizeof(*hist));
+  if (!hist || session_rx_init(&rx, -1) != 0) {
+    free(hist);
+    return -1;
+  }
+  lat_hist_init(hist);
+  signal(SIGINT, on_repeat_signal);   /* ^C ends the run early, with the report */
+  quiet_responses = 1;
+
+  unsigned long sent = 0, timeouts = 0, partial = 0, errors = 0;
+  uint64_t bytes_in = 0;
+  size_t cmd_len = strlen(command);
+  uint64_t start = now_us();
+  uint64_t end = ro->duration_ms ? start + (uint64_t)ro->duration_ms * 1000u : UINT64_MAX;
+  while ((ro->count == 0 || sent < ro->count) && !repeat_stop) {
+    uint64_t due = ro->rate > 0 ? start + (uint64_t)((double)sent * 1e6 / ro->rate) : now_us();
+    if (due >= end) break;
+    sleep_until(due);
+    if (repeat_stop) break;
+
+    int r = run_command_reconnecting(dev_handle, command, cmd_len, to, &rx);
+    uint64_t done = now_us();
+    sent++;
+    bytes_in += io_stats.bytes_in;
+    if (r == 0) {
+      lat_hist_record(hist, done - due);
+    } else if (r == 1) {
+      timeouts++;
+      if (io_stats.bytes_in > 0) partial++;
+      /* the same command again: a late reply must not pass for the next one */
+      rx.ring.head = rx.ring.tail;
+      rx.carry.len = 0;
+      if (*dev_handle >= 0) tcflush(*dev_handle, TCIFLUSH);
+    } else {
+      errors++;
     }
+    if (*dev_handle < 0 || done >= end) break;
+  }
+  double secs = (double)(now_us() - start) / 1e6;
+  quiet_responses = 0;
+  signal(SIGINT, SIG_DFL);
+  session_rx_free(&rx);
+
+  printf("Repeat: %lu sent, %llu answered, %lu timed out (%lu partial), %lu failed in %.3f s\n",
+         sent, (unsigned long long)hist->count, timeouts, partial, errors, secs);
+  if (secs > 0)
+    printf("Throughput: %.1f requests/s, %.1f kB/s received\n", (double)hist->count / secs, (double)bytes_in / secs / 1000);
+  if (hist->count) {
+    static const double pct[] = { 50, 90, 99, 99.9 };
+    printf("Latency (us): min %llu", (unsigned long long)hist->min);
+    for (size_t i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+      printf("  p%g %llu", pct[i], (unsigned long long)lat_hist_percentile(hist, pct[i]));
+    printf("  max %llu  mean %.1f\n", (unsigned long long)hist->max, (double)hist->sum / (double)hist->count);
+  }
+  fflush(stdout);
+  free(hist);
+  return (int)(timeouts + errors > INT_MAX ? INT_MAX : timeouts + errors);
 }
-void log_trace(const char *fmt, ...) { va_list args; va_start(args, fmt); logit(fmt, args, TRACE); va_end(args); }
-void log_info(const char *fmt, ...)  { va_list args; va_start(args, fmt); logit(fmt, args, INFO);  va_end(args); }
-void log_warning(const char *fmt, ...) { va_list args; va_start(args, fmt); logit(fmt, args, WARNING); va_end(args); }
-void log_error(const char *fmt, ...) { va_list args; va_start(args, fmt); logit(fmt, args, ERROR); va_end(args); }
 
-/* set blocking or non-blocking on fd */
-static int set_blocking(int fd, int blocking) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags < 0) return -1;
-    if (!blocking)
-        flags |= O_NONBLOCK;
-    else
-        flags &= ~O_NONBLOCK;
-    return fcntl(fd, F_SETFL, flags);
+/* read the next non-empty batch command, stripping its delimiter (and a
+   trailing CR in line mode). Returns its length, or -1 at EOF/error. */
+static ssize_t next_command(FILE *in, int delim, char **line, size_t *line_cap) {
+  ssize_t n;
+  while ((n = getdelim(line, line_cap, delim, in)) != -1) {
+    char *l = *line;
+    if (n > 0 && l[n - 1] == (char)delim) l[--n] = '\0';
+    if (delim == '\n' && n > 0 && l[n - 1] == '\r') l[--n] = '\0';
+    if (n > 0) return n;
+  }
+  return -1;
 }
 
-/* open serial */
-int serial_port_open(const char *path, long baud_rate) {
-    log_trace("serial_port_open: Opening Serial Port {%s} at %ld baud", path, baud_rate);
+/* batch mode: run every command from `in` over the one open fd.
+   Commands are separated by `delim` ('\n' or '\0'); empty entries are skipped.
+   Returns the number of commands that failed with a read error. */
+static int run_batch(int *dev_handle, FILE *in, int delim, const struct read_timeouts *to, int stream_fd) {
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t n;
+  int failures = 0;
+  unsigned long count = 0;
+  struct session_rx rx;
+  if (session_rx_init(&rx, stream_fd) != 0) {
+    log_error("Out of memory for receive buffer");
+    return 1;
+  }
 
-    int fd = open(path, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
-        log_error("Failed to open device serial path: %s", path);
-        perror("open");
-        return -1;
+  while ((n = next_command(in, delim, &line, &line_cap)) != -1) {
+    count++;
+    log_trace("batch: command #%lu (%zd bytes)", count, n);
+    if (run_command_reconnecting(dev_handle, line, (size_t)n, to, &rx) == -1) failures++;
+    if (*dev_handle < 0) break;
+  }
+  if (ferror(in)) {
+    log_error("Error while reading batch commands");
+    failures++;
+  }
+
+  session_rx_free(&rx);
+  free(line);
+  log_info("Batch complete: %lu commands, %d failed", count, failures);
+  return failures;
+}
+
+#define PIPELINE_MAX_WINDOW 256
+
+struct pending_req {
+  int in_use;
+  uint32_t seq;
+  uint64_t sent_us;
+};
+
+/* fd can be read without blocking; a regular file always can */
+static int readable_now(int fd) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  return poll(&pfd, 1, 0) != 0;
+}
+
+/* batch input read with read() into our own buffer, so whether the next
+   command is ready covers lines already read in as well as the fd */
+struct cmd_reader {
+  int fd;
+  char *buf;
+  size_t start, len, cap;
+  int eof, failed;
+};
+
+/* a whole command is buffered, or the fd has more (or EOF) to give */
+static int cmd_ready(const struct cmd_reader *r, int delim) {
+  if (r->eof || memchr(r->buf + r->start, delim, r->len - r->start)) return 1;
+  return readable_now(r->fd);
+}
+
+/* next_command() over a cmd_reader: *cmd points into its buffer and holds
+   until the next call. Returns its length, or -1 at EOF/error. */
+static ssize_t cmd_next(struct cmd_reader *r, int delim, char **cmd) {
+  for (;;) {
+    char *l = r->buf + r->start;
+    char *end = memchr(l, delim, r->len - r->start);
+    if (!end && r->eof) {
+      if (r->start == r->len) return -1;
+      end = r->buf + r->len;                      /* unterminated last line */
+    }
+    if (end) {
+      size_t n = (size_t)(end - l);
+      r->start += end < r->buf + r->len ? n + 1 : n;
+      *end = '\0';
+      if (delim == '\n' && n > 0 && l[n - 1] == '\r') l[--n] = '\0';
+      if (n > 0) {
+        *cmd = l;
+        return (ssize_t)n;
+      }
+      continue;
     }
 
-    if (!isatty(fd)) {
-        close(fd);
-        log_error("The given device path is not a TTY: %s", path);
+    /* keep the partial line, with room for its terminator */
+    memmove(r->buf, l, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+    if (r->cap - r->len < 2) {
+      size_t cap = r->cap * 2;
+      char *nb = realloc(r->buf, cap);
+      if (!nb) {
+        r->eof = r->failed = 1;
         return -1;
+      }
+      r->buf = nb;
+      r->cap = cap;
     }
+    ssize_t got = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) r->failed = 1;
+    if (got <= 0) r->eof = 1;
+    else r->len += (size_t)got;
+  }
+}
 
-    struct termios tty;
-    if (tcgetattr(fd, &tty) != 0) {
-        log_error("tcgetattr failed");
-        perror("tcgetattr");
-        close(fd);
-        return -1;
+/* pipelined batch mode: keep up to `window` sequence-tagged requests in
+   flight and match each response back to its request by the echoed tag,
+   whatever order the device answers in. Requests read back to back are
+   coalesced into one write (--coalesce): replies already received are
+   collected before the window is topped up, so the slots they free are
+   refilled together. A batch never waits on input that is not ready, so
+   a trickling stdin is still served at once.
+   Returns the number of requests that failed or timed out. */
+static int run_pipelined(int dev_handle, FILE *in, int delim, const struct read_timeouts *to, int window) {
+  struct pending_req slots[PIPELINE_MAX_WINDOW];
+  memset(slots, 0, sizeof(slots));
+  struct cmd_reader cr = { .fd = fileno(in), .cap = 4096 };
+  if (!(cr.buf = malloc(cr.cap))) {
+    log_error("Out of memory reading batch commands");
+    return 1;
+  }
+  char *line;
+  int outstanding = 0, failures = 0, input_done = 0, tx_failed = 0;
+  uint32_t next_seq = 0;
+  unsigned long count = 0;
+  struct rx_carry carry = {0};
+  struct tx_batch tx = {0};
+  tx_coalesce_init(&tx.policy, conf.coalesce_bytes, (uint64_t)conf.coalesce_us);
+
+  while (!input_done || outstanding > 0) {
+    /* top up the window; a slot still held by a slow request stalls it */
+    int replies_ready = outstanding > 0 && (carry.len > 0 || readable_now(dev_handle));
+    while (!replies_ready && !input_done && outstanding < window && !slots[next_seq % (uint32_t)window].in_use) {
+      if (tx.len && !cmd_ready(&cr, delim)) break;
+      ssize_t n = cmd_next(&cr, delim, &line);
+      if (n < 0) { input_done = 1; break; }
+
+      char tag[24];
+      int tag_len = snprintf(tag, sizeof(tag), UART_COM_SEQ_PREFIX "%x]", next_seq);
+      count++;
+      struct tx_queue q;
+      tx_queue_text(&q, tag, (size_t)tag_len, line, (size_t)n);
+      int full = tx_batch_add(&tx, &q);
+      if (full < 0) {
+        log_error("Out of memory queueing a request");
+        failures++;
+        continue;
+      }
+      struct pending_req *pr = &slots[next_seq % (uint32_t)window];
+      pr->in_use = 1;
+      pr->seq = next_seq;
+      pr->sent_us = now_us();
+      outstanding++;
+      log_trace("pipeline: seq %x queued (%d in flight)", next_seq, outstanding);
+      next_seq++;
+
+      int due = full || now_us() >= tx_coalesce_deadline(&tx.policy);
+      if (due && tx_batch_flush(dev_handle, &tx, full ? TX_FLUSH_SIZE : TX_FLUSH_TIMER) != 0) {
+        tx_failed = 1;
+        break;
+      }
     }
+    /* window full or no input ready: the rest of the batch goes now */
+    if (!tx_failed && tx_batch_flush(dev_handle, &tx, TX_FLUSH_IDLE) != 0) tx_failed = 1;
+    if (tx_failed) {
+      failures += outstanding;
+      break;
+    }
+    if (outstanding == 0) continue;
 
-    cfmakeraw(&tty); /* raw mode */
-
-    /* set baud */
-    speed_t speed;
-    switch (baud_rate) {
-        case 9600:   speed = B9600; break;
-        case 19200:  speed = B19200; break;
-        case 38400:  speed = B38400; break;
-        case 57600:  speed = B57600; break;
-        case 115200: speed = B115200; break;
-        default:     speed = B115200; break;
-    }
-    cfsetispeed(&tty, speed);
-    cfsetospeed(&tty, speed);
-
-    /* 8N1 */
-    tty.c_cflag &= ~PARENB;
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CSIZE;
-    tty.c_cflag |= CS8;
-    tty.c_cflag |= (CLOCAL | CREAD);
-
-#ifdef CRTSCTS
-    tty.c_cflag &= ~CRTSCTS;
-#endif
-#ifdef IXON
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-#endif
-    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-
-    /* read behaviour */
-    tty.c_cc[VMIN] = 1;
-    tty.c_cc[VTIME] = 10; /* 1.0s */
-
-    tcflush(fd, TCIFLUSH);
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        log_error("tcsetattr failed");
-        perror("tcsetattr");
-        close(fd);
-        return -1;
+    char *resp = NULL;
+    size_t resp_len = 0;
+    int r = read_until_marker(dev_handle, UART_COM_END, to, &carry, NULL, &resp, &resp_len);
+    if (r != 0) {
+      /* nothing more is coming in time: everything in flight is lost */
+      if (r == -1) log_error("Error while reading response");
+      else log_warning("Timeout with %d requests in flight; partial data (%zu bytes) received", outstanding, resp_len);
+      if (resp_len > 0) print_response(resp, resp_len, "partial");
+      free(resp);
+      failures += outstanding;
+      memset(slots, 0, sizeof(slots));
+      outstanding = 0;
+      if (r == -1) break;
+      continue;
     }
 
-    log_info("Serial port %s opened (fd=%d)", path, fd);
-    return fd;
+    uint32_t seq;
+    struct pending_req *pr = NULL;
+    if (frame_seq(resp, resp_len, &seq) == 0) pr = &slots[seq % (uint32_t)window];
+    if (!pr || !pr->in_use || pr->seq != seq) {
+      log_warning("Discarding response with unknown or missing sequence tag (%zu bytes)", resp_len);
+      free(resp);
+      continue;
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "seq %x", seq);
+    log_info("seq %x answered in %llu us", seq, (unsigned long long)(now_us() - pr->sent_us));
+    print_response(resp, resp_len, label);
+    free(resp);
+    pr->in_use = 0;
+    outstanding--;
+  }
+  if (cr.failed) {
+    log_error("Error while reading batch commands");
+    failures++;
+  }
+
+  char desc[192];
+  tx_coalesce_describe(&tx.policy, desc, sizeof(desc));
+  fprintf(stdout, "TX coalescing: %s\n", desc);
+  tx_batch_free(&tx);
+  free(carry.data);
+  free(cr.buf);
+  log_info("Pipelined batch complete: %lu commands, %d failed (window %d)", count, failures, window);
+  return failures;
 }
 
-/* write data util */
-static ssize_t write_all(int fd, const void *buf, size_t count) {
-    const unsigned char *p = buf;
-    size_t remaining = count;
-    while (remaining > 0) {
-        ssize_t n = write(fd, p, remaining);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(1000);
-                continue;
-            }
-            return -1;
-        }
-        remaining -= (size_t)n;
-        p += n;
-    }
-    return (ssize_t)count;
+/* parse a non-negative duration into milliseconds. A bare number is taken in
+   units of unit_ms; "ms" and "s" suffixes override that. */
+static int parse_duration_ms(const char *arg, long unit_ms, long *out_ms) {
+  char *end = NULL;
+  errno = 0;
+  long v = strtol(arg, &end, 10);
+  if (errno || end == arg || v < 0) return -1;
+  if (strcmp(end, "ms") == 0) unit_ms = 1;
+  else if (strcmp(end, "s") == 0) unit_ms = 1000;
+  else if (*end != '\0') return -1;
+  if (v > LONG_MAX / unit_ms) return -1;
+  *out_ms = v * unit_ms;
+  return 0;
 }
 
-void send_data_to_device(int dev_handle, const char *message, int length) {
-    if (dev_handle < 0) {
-        log_error("Invalid device handle in send_data_to_device");
-        return;
+static void print_port_response(const char *path, const char *resp, size_t resp_len, int status) {
+  if (status == 1)
+    log_warning("%s: timeout waiting for end marker; partial data (%zu bytes) received", path, resp_len);
+  print_response(resp, resp_len, path);
+}
+
+/* multi-port mode: the -c command, or every -f command, goes to every port */
+static int run_multiport_cli(const struct port_spec *ports, int nports, const char *command,
+                             FILE *batch_in, int delim, const struct read_timeouts *to) {
+  char **cmds = NULL;
+  size_t *lens = NULL;
+  size_t ncmds = 0, cap = 0;
+  int failed = -1;
+
+  if (command) {
+    char *one = (char *)command;
+    size_t one_len = strlen(command);
+    return run_multiport(ports, nports, &one, &one_len, 1, to, print_port_response);
+  }
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t n;
+  while ((n = next_command(batch_in, delim, &line, &line_cap)) != -1) {
+    if (ncmds == cap) {
+      cap = cap ? cap * 2 : 64;
+      char **nc = realloc(cmds, cap * sizeof(*cmds));
+      size_t *nl = nc ? realloc(lens, cap * sizeof(*lens)) : NULL;
+      if (nc) cmds = nc;
+      if (nl) lens = nl;
+      if (!nc || !nl) goto out;
     }
+    cmds[ncmds] = malloc((size_t)n + 1);
+    if (!cmds[ncmds]) goto out;
+    memcpy(cmds[ncmds], line, (size_t)n + 1);
+    lens[ncmds++] = (size_t)n;
+  }
+  if (ferror(batch_in)) log_error("Error while reading batch commands");
+  failed = ncmds ? run_multiport(ports, nports, cmds, lens, ncmds, to, print_port_response) : 0;
 
-    const char *header_start_message = "[UART_COM][START]";
-    const char *header_end_msg = "[UART_COM][END]";
+out:
+  if (failed < 0) log_error("Out of memory loading batch commands");
+  for (size_t i = 0; i < ncmds; i++) free(cmds[i]);
+  free(cmds);
+  free(lens);
+  free(line);
+  return failed;
+}
 
-    size_t start_len = strlen(header_start_message);
-    size_t end_len = strlen(header_end_msg);
-    size_t msg_len = (length > 0) ? (size_t)length : strlen(message);
+/* client mode: every command goes through the daemon that owns the port.
+   Returns the number of commands that failed. */
+static int run_client(const char *sock_path, const char *command, FILE *batch_in, int delim,
+                      const struct read_timeouts *to) {
+  int fd = daemon_connect(sock_path);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot connect to daemon at %s: %s\n", sock_path, strerror(errno));
+    return 1;
+  }
 
-    size_t total = start_len + msg_len + end_len;
-    char *buf = malloc(total);
-    if (!buf) {
-        log_error("malloc failed in send_data_to_device");
-        return;
+  char *line = NULL;
+  size_t line_cap = 0;
+  int failures = 0;
+  const char *cmd = command;
+  size_t len = command ? strlen(command) : 0;
+  for (;;) {
+    if (batch_in) {
+      ssize_t n = next_command(batch_in, delim, &line, &line_cap);
+      if (n < 0) break;
+      cmd = line;
+      len = (size_t)n;
     }
 
-    memcpy(buf, header_start_message, start_len);
-    memcpy(buf + start_len, message, msg_len);
-    memcpy(buf + start_len + msg_len, header_end_msg, end_len);
+    char *resp = NULL;
+    size_t resp_len = 0;
+    int r = daemon_call(fd, cmd, len, to, &resp, &resp_len);
+    if (r == -2) {
+      if (errno == ETIMEDOUT) log_error("Timed out talking to daemon at %s", sock_path);
+      else log_error("Lost connection to daemon at %s", sock_path);
+      failures++;
+      break;
+    }
+    if (r == -1) {
+      log_error("Daemon reported an error for the command");
+      failures++;
+    } else if (r == 1) {
+      log_warning("Timeout waiting for end marker; partial data (%zu bytes) received", resp_len);
+    }
+    print_response(resp, resp_len, NULL);
+    free(resp);
+    if (!batch_in) break;
+  }
+  if (batch_in && ferror(batch_in)) {
+    log_error("Error while reading batch commands");
+    failures++;
+  }
 
-    if (write_all(dev_handle, buf, total) != (ssize_t)total) {
-        log_error("Failed to write full message to device");
-    } else {
-        if (tcdrain(dev_handle) != 0) {
-            log_warning("tcdrain returned error (errno=%d)", errno);
-        } else {
-            log_info("Message sent and drained successfully (%zu bytes)", total);
-        }
+  free(line);
+  close(fd);
+  return failures;
+}
+
+static void print_transfer(const char *what, const char *path, const struct xfer_report *rep) {
+  uint64_t moved = rep->size - rep->resumed_at;
+  double secs = (double)rep->elapsed_us / 1e6;
+  double rate = secs > 0 ? (double)moved / secs : 0;
+  printf("%s %s: %llu bytes", what, path, (unsigned long long)moved);
+  if (rep->resumed_at) printf(" (resumed at %llu)", (unsigned long long)rep->resumed_at);
+  /* line rate: 10 bits per byte on the wire */
+  printf(" in %.2f s, %.1f kB/s (%.0f%% of line rate)", secs, rate / 1000, rate * 1000 / (double)conf.baud_rate);
+  if (rep->resent) printf(", %lu chunks resent", rep->resent);
+  printf("\n");
+  fflush(stdout);
+}
+
+/* --from: absolute epoch seconds, or "+s" relative to the capture start */
+static int parse_capture_time(const char *arg, int *relative, uint64_t *us) {
+  *relative = arg[0] == '+';
+  if (*relative) arg++;
+  char *end = NULL;
+  errno = 0;
+  double v = strtod(arg, &end);
+  if (errno || end == arg || *end != '\0' || v < 0 || v > 1e12) return -1;
+  *us = (uint64_t)(v * 1e6 + 0.5);
+  return 0;
+}
+
+/* --dump-capture: one line per record, bytes outside printable ASCII escaped */
+static int dump_capture(const char *path, const char *from) {
+  struct capture_reader r;
+  if (capture_reader_open(&r, path) != 0) return EXIT_FAILURE;
+  uint64_t start = capture_reader_start(&r);
+  if (from) {
+    int relative;
+    uint64_t t;
+    if (parse_capture_time(from, &relative, &t) != 0) {
+      fprintf(stderr, "Invalid --from time: %s\n", from);
+      capture_reader_close(&r);
+      return 2;
     }
+    if (capture_reader_seek(&r, relative ? start + t : t) != 0) {
+      log_error("Cannot seek in capture %s", path);
+      capture_reader_close(&r);
+      return EXIT_FAILURE;
+    }
+  }
 
-    free(buf);
-}
-
-/* read until the end_marker is seen or timeout elapsed.
-   Returns 0 on success (found marker), 1 on timeout (partial data in out_buf),
-   -1 on error. out_buf is malloc'd inside and must be free()'d by caller.
-*/
-int read_until_marker(int fd, const char *end_marker, int timeout_seconds, char **out_buf, size_t *out_len) {
-    const size_t CHUNK = 512;
-    size_t cap = CHUNK;
-    char *buf = malloc(cap);
-    if (!buf) return -1;
-    size_t len = 0;
-    int marker_len = (int)strlen(end_marker);
-    time_t start = time(NULL);
-
-    while (1) {
-        /* compute remaining timeout for select */
-        time_t elapsed = time(NULL) - start;
-        int remaining = timeout_seconds - (int)elapsed;
-        if (remaining <= 0) break; /* timeout */
-
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        struct timeval tv;
-        tv.tv_sec = remaining;
-        tv.tv_usec = 0;
-
-        int sel = select(fd + 1, &rfds, NULL, NULL, &tv);
-        if (sel < 0) {
-            if (errno == EINTR) continue;
-            free(buf);
-            return -1;
-        } else if (sel == 0) {
-            break; /* timeout */
-        }
+  struct capture_rec rec;
+  int v;
+  while ((v = capture_reader_next(&r, &rec)) == 1) {
+    printf("%llu.%06llu +%.6f %s[%d] %zu:", (unsigned long long)(rec.t_us / 1000000u),
+           (unsigned long long)(rec.t_us % 1000000u), (double)(rec.t_us - start) / 1e6,
+           rec.dir == CAPTURE_TX ? "TX" : "RX", rec.chan, rec.len);
+    putchar(' ');
+    for (size_t i = 0; i < rec.len; i++) {
+      unsigned char ch = rec.data[i];
+      if (ch == '\n') fputs("\\n", stdout);
+      else if (ch == '\r') fputs("\\r", stdout);
+      else if (ch == '\\') fputs("\\\\", stdout);
+      else if (ch >= 0x20 && ch < 0x7f) putchar(ch);
+      else printf("\\x%02x", ch);
+    }
+    putchar('\n');
+  }
+  capture_reader_close(&r);
+  if (v < 0) {
+    log_error("Capture %s is damaged past this point", path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
 
-        if (FD_ISSET(fd, &rfds)) {
-            /* read available data */
-            if (len + CHUNK > cap) {
-                cap *= 2;
-                char *nb = realloc(buf, cap);
-                if (!nb) { free(buf); return -1; }
-                buf = nb;
-            }
-            ssize_t r = read(fd, buf + len, cap - len);
-            if (r < 0) {
-                if (errno == EINTR) continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(1000);
-                    continue;
-                }
-                free(buf);
-                return -1;
-            } else if (r == 0) {
-                /* EOF? break and return what we have */
-                break;
-            } else {
-                len += (size_t)r;
-                /* check for marker in buffer */
-                if (len >= (size_t)marker_len) {
-                    if (memmem(buf, len, end_marker, marker_len) != NULL) {
-                        *out_buf = buf;
-                        *out_len = len;
-                        return 0; /* found */
-                    }
-                }
-                /* continue reading until timeout or marker */
-            }
-        }
+/* --faults split:20,garbage:5,stall */
+static int parse_faults(const char *arg, struct vdev_faults *f) {
+  char buf[128];
+  if (strlen(arg) >= sizeof(buf)) return -1;
+  strcpy(buf, arg);
+  for (char *save = NULL, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    long pct = 10;
+    char *colon = strchr(tok, ':');
+    if (colon) {
+      char *end = NULL;
+      *colon = '\0';
+      errno = 0;
+      pct = strtol(colon + 1, &end, 10);
+      if (errno || end == colon + 1 || *end != '\0' || pct < 0 || pct > 100) return -1;
     }
+    if (strcmp(tok, "split") == 0) f->split_pct = (int)pct;
+    else if (strcmp(tok, "garbage") == 0) f->garbage_pct = (int)pct;
+    else if (strcmp(tok, "stall") == 0) f->stall_pct = (int)pct;
+    else return -1;
+  }
+  return 0;
+}
 
-    /* timeout: return partial data if any */
-    *out_buf = buf;
-    *out_len = len;
-    return 1;
+/* --rx-thread 2,fifo:80 | any,fifo | 0 */
+static int parse_rx_thread(const char *arg, struct rx_thread_opts *o) {
+  char *end = NULL;
+  o->cpu = -1;
+  o->fifo_prio = 0;
+  if (strncmp(arg, "any", 3) == 0) {
+    end = (char *)arg + 3;
+  } else {
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if (errno || end == arg || v < 0 || v > 1023) return -1;
+    o->cpu = (int)v;
+  }
+  if (*end == '\0') return 0;
+  if (strncmp(end, ",fifo", 5) != 0) return -1;
+  end += 5;
+  if (*end == '\0') {
+    o->fifo_prio = RXT_FIFO_DEFAULT_PRIO;
+    return 0;
+  }
+  if (*end != ':') return -1;
+  const char *p = end + 1;
+  errno = 0;
+  long prio = strtol(p, &end, 10);
+  if (errno || end == p || *end != '\0' || prio < 1 || prio > 99) return -1;
+  o->fifo_prio = (int)prio;
+  return 0;
 }
 
-static void usage(const char *prog) {
-  fprintf(stderr, "Usage: %s -p <device_path> -b <baud_rate> -c <command> [-T timeout_seconds] [-x] [-h]\n", prog);
-  fprintf(stderr, "Example: %s -p /dev/ttyUSB0 -b 115200 -c \"STATUS\\r\\n\" -T 5 -x\n", prog);
-  fprintf(stderr, "  -p <device_path> : Path to Serial Device (e.g., /dev/ttyUSB0)\n");
-  fprintf(stderr, "  -b <baud_rate>   : Baud Rate (e.g., 9600, 115200)\n");
-  fprintf(stderr, "  -c <command>     : Command to send (required)\n");
-  fprintf(stderr, "  -T <seconds>     : Timeout seconds to wait for response (default 5)\n");
-  fprintf(stderr, "  -x               : Enable Debug Mode (optional)\n");
-  fprintf(stderr, "  -h               : Show this help message\n");
+/* -C: the capture is closed (and trimmed) on every exit path */
+static struct capture capture;
+
+static void capture_finish(void) {
+  if (!conf.capture) return;
+  log_info("Capture: %llu records, %llu bytes", (unsigned long long)capture.records,
+           (unsigned long long)capture.bytes);
+  capture_close(&capture);
+  conf.capture = NULL;
+}
+
+/* log level by number (0 = silent .. 4 = trace) or name */
+static int parse_log_level(const char *arg, int *out) {
+  static const char *names[] = {"off", "error", "warning", "info", "trace"};
+  for (int i = 0; i <= TRACE; i++) {
+    if (strcmp(arg, names[i]) == 0) { *out = i; return 0; }
+  }
+  char *end = NULL;
+  errno = 0;
+  long v = strtol(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || v < 0 || v > TRACE) return -1;
+  *out = (int)v;
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
   const char *dev_path = NULL;
   long baud_rate = 0;
+  static struct port_spec ports[MULTIPORT_MAX_PORTS];
+  int nports = 0;
   int debug = 0;
+  int async_log = 0;
   int opt;
   const char *command = NULL;
-  int timeout_seconds = 5;
+  const char *batch_path = NULL;
+  int batch_delim = '\n';
+  int window = 0;
+  int stream = 0;
+  int compress = 0;
+  const char *daemon_sock = NULL;
+  const char *client_sock = NULL;
+  const char *stream_path = NULL;
+  const char *send_path = NULL;
+  const char *recv_path = NULL;
+  const char *capture_path = NULL;
+  const char *dump_path = NULL;
+  const char *dump_from = NULL;
+  struct vdev_opts vdev = {0};
+  struct rx_thread_opts rxt = {0};
+  int use_rxt = 0;
+  enum io_backend io_backend = IO_BACKEND_POLL;
+  int io_set = 0;
+  int keep_input = 0;
+  long reconnect_ms = 0;
+  size_t coalesce_bytes = TX_COALESCE_DEFAULT_BYTES;
+  long coalesce_us = TX_COALESCE_DEFAULT_US;
+  int coalesce_set = 0;
+  struct repeat_opts repeat = {0};
+  int vdev_only = 0;   /* options that need --virtual */
+  enum framing framing = FRAMING_TEXT;
+  enum rx_tuning tuning = RX_TUNING_DEFAULT;
+  struct read_timeouts timeouts = { .total_ms = 5000, .first_byte_ms = 0, .inter_byte_ms = 0 };
+  enum { OPT_STATS = 256, OPT_SEND_FILE, OPT_RECV_FILE, OPT_DUMP_CAPTURE, OPT_FROM,
+         OPT_VIRTUAL, OPT_RESPOND, OPT_TURNAROUND, OPT_FAULTS, OPT_RX_THREAD, OPT_IO, OPT_NO_FLUSH, OPT_RECONNECT,
+         OPT_DURATION, OPT_RATE, OPT_COALESCE };
+  static const struct option long_opts[] = {
+    { "stats", required_argument, NULL, OPT_STATS },
+    { "send-file", required_argument, NULL, OPT_SEND_FILE },
+    { "recv-file", required_argument, NULL, OPT_RECV_FILE },
+    { "dump-capture", required_argument, NULL, OPT_DUMP_CAPTURE },
+    { "from", required_argument, NULL, OPT_FROM },
+    { "virtual", required_argument, NULL, OPT_VIRTUAL },
+    { "respond", required_argument, NULL, OPT_RESPOND },
+    { "turnaround", required_argument, NULL, OPT_TURNAROUND },
+    { "faults", required_argument, NULL, OPT_FAULTS },
+    { "rx-thread", required_argument, NULL, OPT_RX_THREAD },
+    { "io", required_argument, NULL, OPT_IO },
+    { "no-flush", no_argument, NULL, OPT_NO_FLUSH },
+    { "reconnect", optional_argument, NULL, OPT_RECONNECT },
+    { "duration", required_argument, NULL, OPT_DURATION },
+    { "rate", required_argument, NULL, OPT_RATE },
+    { "coalesce", required_argument, NULL, OPT_COALESCE },
+    { NULL, 0, NULL, 0 },
+  };
 
-  while ((opt = getopt(argc, argv, ":p:b:c:T:xh")) != -1) {
+  while ((opt = getopt_long(argc, argv, ":p:b:c:n:f:0w:m:So:zE:T:F:G:L:C:D:U:xAv:h", long_opts, NULL)) != -1) {
     switch (opt) {
-    case 'p':
-      dev_path = optarg;
+    case 'p': {
+      /* -p may repeat; "path@baud" overrides -b for that port */
+      if (nports == MULTIPORT_MAX_PORTS) {
+        fprintf(stderr, "Too many ports (max %d)\n", MULTIPORT_MAX_PORTS);
+        return EXIT_FAILURE;
+      }
+      struct port_spec *ps = &ports[nports++];
+      ps->path = optarg;
+      ps->baud_rate = 0;
+      char *at = strrchr(optarg, '@');
+      if (at) {
+        char *end = NULL;
+        errno = 0;
+        long v = strtol(at + 1, &end, 10);
+        if (errno || end == at + 1 || *end != '\0' || v <= 0) {
+          fprintf(stderr, "Invalid baud rate in %s\n", optarg);
+          usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        *at = '\0';
+        ps->baud_rate = v;
+      }
+      dev_path = ps->path;
       break;
+    }
     case 'b': {
       char *end = NULL;
       errno = 0;
@@ -310,96 +1021,599 @@ int main(int argc, char *argv[]) {
     case 'c':
       command = optarg;
       break;
-    case 'T': {
+    case 'f':
+      batch_path = optarg;
+      break;
+    case '0':
+      batch_delim = '\0';
+      break;
+    case 'm':
+      if (strcmp(optarg, "text") == 0) {
+        framing = FRAMING_TEXT;
+      } else if (strcmp(optarg, "bin") == 0) {
+        framing = FRAMING_BINARY;
+      } else if (strcmp(optarg, "cobs") == 0) {
+        framing = FRAMING_COBS;
+      } else {
+        fprintf(stderr, "Invalid framing (text|bin|cobs): %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'S':
+      stream = 1;
+      break;
+    case 'o':
+      stream = 1;
+      stream_path = optarg;
+      break;
+    case 'w': {
       char *end = NULL;
       errno = 0;
       long v = strtol(optarg, &end, 10);
-      if (errno || end == optarg || *end != '\0' || v < 0) {
-        fprintf(stderr, "Invalid timeout: %s\n", optarg);
+      if (errno || end == optarg || *end != '\0' || v < 1 || v > PIPELINE_MAX_WINDOW) {
+        fprintf(stderr, "Invalid window (1..%d): %s\n", PIPELINE_MAX_WINDOW, optarg);
         usage(argv[0]);
         return EXIT_FAILURE;
       }
-      timeout_seconds = (int)v;
+      window = (int)v;
       break;
     }
+    case 'T':
+      if (parse_duration_ms(optarg, 1000, &timeouts.total_ms) != 0) {
+        fprintf(stderr, "Invalid timeout: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_duration_ms(optarg, 1, &timeouts.first_byte_ms) != 0) {
+        fprintf(stderr, "Invalid first-byte timeout: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'G':
+      if (parse_duration_ms(optarg, 1, &timeouts.inter_byte_ms) != 0) {
+        fprintf(stderr, "Invalid inter-byte timeout: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'L':
+      if (strcmp(optarg, "latency") == 0) {
+        tuning = RX_TUNING_LATENCY;
+      } else if (strcmp(optarg, "wakeups") == 0) {
+        tuning = RX_TUNING_WAKEUPS;
+      } else {
+        fprintf(stderr, "Invalid tuning (latency|wakeups): %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'z':
+      compress = 1;
+      break;
+    case 'E':
+      if (nterm_patterns == TERM_MAX_PATTERNS) {
+        fprintf(stderr, "Too many -E patterns (max %d)\n", TERM_MAX_PATTERNS - 1);
+        return EXIT_FAILURE;
+      }
+      if (optarg[0] == '\0' || strlen(optarg) > MARKER_MAX_LEN) {
+        fprintf(stderr, "-E pattern must be 1..%d bytes\n", MARKER_MAX_LEN);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      term_patterns[nterm_patterns++] = optarg;
+      break;
+    case 'C':
+      capture_path = optarg;
+      break;
+    case 'D':
+      daemon_sock = optarg;
+      break;
+    case 'U':
+      client_sock = optarg;
+      break;
     case 'x':
       debug = 1;
       break;
+    case 'A':
+      async_log = 1;
+      break;
+    case 'v':
+      if (parse_log_level(optarg, &log_level) != 0) {
+        fprintf(stderr, "Invalid log level: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_STATS:
+      if (strcmp(optarg, "json") != 0) {
+        fprintf(stderr, "Invalid stats format (json): %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      stats_json = 1;
+      break;
+    case OPT_SEND_FILE:
+      send_path = optarg;
+      break;
+    case OPT_RECV_FILE:
+      recv_path = optarg;
+      break;
+    case OPT_DUMP_CAPTURE:
+      dump_path = optarg;
+      break;
+    case OPT_FROM:
+      dump_from = optarg;
+      break;
+    case OPT_VIRTUAL: {
+      char *end = NULL;
+      errno = 0;
+      long v = strtol(optarg, &end, 10);
+      if (errno || end == optarg || *end != '\0' || v < 1 || v > VDEV_MAX) {
+        fprintf(stderr, "Invalid virtual device count (1..%d): %s\n", VDEV_MAX, optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      vdev.count = (int)v;
+      break;
+    }
+    case OPT_RESPOND:
+      vdev.respond_path = optarg;
+      vdev_only = 1;
+      break;
+    case OPT_TURNAROUND:
+      if (parse_duration_ms(optarg, 1, &vdev.turnaround_ms) != 0) {
+        fprintf(stderr, "Invalid turnaround: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      vdev_only = 1;
+      break;
+    case OPT_FAULTS:
+      if (parse_faults(optarg, &vdev.faults) != 0) {
+        fprintf(stderr, "Invalid faults (split|garbage|stall[:percent],...): %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      vdev_only = 1;
+      break;
+    case OPT_RX_THREAD:
+      if (parse_rx_thread(optarg, &rxt) != 0) {
+        fprintf(stderr, "Invalid --rx-thread (cpu|any[,fifo[:1-99]]): %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      use_rxt = 1;
+      break;
+    case OPT_IO:
+      if (strcmp(optarg, "poll") == 0) io_backend = IO_BACKEND_POLL;
+      else if (strcmp(optarg, "uring") == 0) io_backend = IO_BACKEND_URING;
+      else {
+        fprintf(stderr, "Invalid I/O backend (poll|uring): %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      io_set = 1;
+      break;
+    case 'n': {
+      char *end = NULL;
+      errno = 0;
+      unsigned long v = strtoul(optarg, &end, 10);
+      if (optarg[0] == '-' || errno != 0 || !end || *end != '\0' || v == 0) {
+        fprintf(stderr, "Invalid count: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      repeat.count = v;
+      break;
+    }
+    case OPT_DURATION:
+      if (parse_duration_ms(optarg, 1000, &repeat.duration_ms) != 0 || repeat.duration_ms == 0) {
+        fprintf(stderr, "Invalid duration: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_RATE: {
+      char *end = NULL;
+      repeat.rate = strtod(optarg, &end);
+      if (!end || *end != '\0' || !(repeat.rate > 0 && repeat.rate <= 1e6)) {
+        fprintf(stderr, "Invalid rate: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case OPT_COALESCE: {
+      coalesce_set = 1;
+      if (strcmp(optarg, "off") == 0) {
+        coalesce_bytes = 0;
+        break;
+      }
+      char *end = NULL;
+      errno = 0;
+      unsigned long b = strtoul(optarg, &end, 10);
+      long us = coalesce_us;
+      if (!errno && end != optarg && *end == ',') {
+        char *us_arg = end + 1;
+        us = strtol(us_arg, &end, 10);
+        if (end == us_arg) end = us_arg - 1;   /* "4096," is malformed */
+      }
+      if (errno || end == optarg || *end != '\0' || b == 0 || b > DAEMON_MAX_REQUEST || us < 0 || us > 1000000) {
+        fprintf(stderr, "Invalid coalescing, want bytes (1-%u)[,us (0-1000000)] or off: %s\n",
+                DAEMON_MAX_REQUEST, optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      coalesce_bytes = b;
+      coalesce_us = us;
+      break;
+    }
+    case OPT_NO_FLUSH:
+      keep_input = 1;
+      break;
+    case OPT_RECONNECT:
+      reconnect_ms = RECONNECT_DEFAULT_MS;
+      if (optarg && (parse_duration_ms(optarg, 1000, &reconnect_ms) != 0 || reconnect_ms == 0)) {
+        fprintf(stderr, "Invalid reconnect window: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
     case ':':
-      fprintf(stderr, "Option -%c requires an argument\n", optopt);
+      if (optopt >= OPT_STATS) fprintf(stderr, "Option %s requires an argument\n", argv[optind - 1]);
+      else fprintf(stderr, "Option -%c requires an argument\n", optopt);
       usage(argv[0]);
       return EXIT_FAILURE;
     case 'h':
       usage(argv[0]);
       return EXIT_SUCCESS;
     case '?':
-      fprintf(stderr, "Unknown option: -%c\n", optopt);
+      if (optopt) fprintf(stderr, "Unknown option: -%c\n", optopt);
+      else fprintf(stderr, "Unknown option: %s\n", argv[optind - 1]);
       usage(argv[0]);
       return EXIT_FAILURE;
     }
   }
 
-  if (!dev_path || baud_rate == 0 || !command) {
-    fprintf(stderr, "Missing required -p and/or -b and/or -c\n");
+  if (dump_from && !dump_path) {
+    fprintf(stderr, "--from requires --dump-capture\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (dump_path) return dump_capture(dump_path, dump_from);
+
+  if (vdev_only && !vdev.count) {
+    fprintf(stderr, "--respond, --turnaround and --faults require --virtual\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (vdev.count) {
+    if (nports || command || batch_path || window || stream || daemon_sock || client_sock ||
+        send_path || recv_path || capture_path || stats_json || nterm_patterns > 1 || use_rxt || io_set ||
+        keep_input || reconnect_ms || coalesce_set || repeat.count || repeat.duration_ms || repeat.rate > 0) {
+      fprintf(stderr, "--virtual serves its own PTYs; only -b, -v, -A and the --virtual options apply\n");
+      usage(argv[0]);
+      return 2;
+    }
+    vdev.baud_rate = baud_rate;
+    if (async_log && log_async_start() == 0) atexit(log_async_stop);
+    return run_virtual(&vdev) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  int missing_baud = 0;
+  for (int i = 0; i < nports; i++) {
+    if (ports[i].baud_rate == 0) ports[i].baud_rate = baud_rate;
+    if (ports[i].baud_rate == 0) missing_baud = 1;
+  }
+  if (nports > 0) baud_rate = ports[0].baud_rate;
+  int multiport = nports > 1;
+  int transfer = send_path || recv_path;
+  /* chunks travel in CRC-checked binary (or, with -m cobs, COBS) frames */
+  if (transfer && framing != FRAMING_COBS) framing = FRAMING_BINARY;
+
+  if (send_path && recv_path) {
+    fprintf(stderr, "--send-file and --recv-file are mutually exclusive\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (transfer && (command || batch_path || stream || stats_json || multiport || daemon_sock || client_sock)) {
+    fprintf(stderr, "File transfer uses one -p port; -c/-f, -S/-o, -D/-U and --stats do not apply\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (recv_path && window) {
+    fprintf(stderr, "-w sets the sender's window; it does not apply to --recv-file\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (capture_path && client_sock) {
+    fprintf(stderr, "-C captures port traffic; with -U, run it on the daemon\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (daemon_sock && client_sock) {
+    fprintf(stderr, "-D and -U are mutually exclusive\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (client_sock) {
+    if (!command && !batch_path) {
+      fprintf(stderr, "Missing required -c/-f\n");
+      usage(argv[0]);
+      return 2;
+    }
+    if (nports || window || stream || stats_json || framing != FRAMING_TEXT) {
+      fprintf(stderr, "-U sends through the daemon; port, -w, -S/-o, -m and --stats are set on the daemon side\n");
+      usage(argv[0]);
+      return 2;
+    }
+  } else if (!dev_path || missing_baud || (!daemon_sock && !transfer && !command && !batch_path)) {
+    fprintf(stderr, "Missing required -p and/or -b and/or -c/-f\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (daemon_sock && (command || batch_path || stream || stats_json || multiport || framing != FRAMING_TEXT)) {
+    fprintf(stderr, "-D serves one -p port with text framing; -c/-f, -S/-o and --stats do not apply\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (command && batch_path) {
+    fprintf(stderr, "-c and -f are mutually exclusive\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (window && !batch_path && !daemon_sock && !send_path) {
+    fprintf(stderr, "-w requires -f\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (compress && (framing != FRAMING_BINARY || multiport || daemon_sock || client_sock)) {
+    fprintf(stderr, "-z requires single-port binary framing (-m bin)\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (window && framing != FRAMING_TEXT && !send_path) {
+    fprintf(stderr, "-w requires text framing\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (stream && (window || multiport || framing != FRAMING_TEXT)) {
+    fprintf(stderr, "-S/-o support single-port text framing without -w only\n");
     usage(argv[0]);
     return 2;
   }
+  if (stats_json && (window || multiport)) {
+    fprintf(stderr, "--stats supports single-port mode without -w only\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (multiport && (window || framing != FRAMING_TEXT)) {
+    fprintf(stderr, "Multiple -p ports support text framing without -w only\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (coalesce_set && (!window || send_path || recv_path) && !daemon_sock) {
+    fprintf(stderr, "--coalesce applies to pipelined batches (-f with -w) and -D\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (reconnect_ms && (multiport || client_sock || transfer || (window && !daemon_sock) || use_rxt)) {
+    fprintf(stderr, "--reconnect supports one -p port with -c, -f (without -w) or -D\n");
+    usage(argv[0]);
+    return 2;
+  }
+  int repeating = repeat.count || repeat.duration_ms;
+  if (repeat.rate > 0 && !repeating) {
+    fprintf(stderr, "--rate paces -n/--duration repeats\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (repeating && (!command || batch_path || multiport || window || stream || daemon_sock || client_sock || transfer)) {
+    fprintf(stderr, "-n/--duration repeat one -c command on one -p port (no -f, -w, -S/-o, -D or -U)\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (io_set && !multiport) {
+    fprintf(stderr, "--io selects the multi-port event loop; give several -p ports\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (use_rxt && (multiport || daemon_sock || client_sock || transfer)) {
+    fprintf(stderr, "--rx-thread supports single-port -c/-f mode only\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (nterm_patterns > 1 && (window || multiport || framing != FRAMING_TEXT || daemon_sock || client_sock || transfer)) {
+    fprintf(stderr, "-E supports single-port text framing without -w, -D or -U only\n");
+    usage(argv[0]);
+    return 2;
+  }
+  if (nterm_patterns > 1 && term_set_build(&terms, term_patterns, nterm_patterns) != 0) {
+    log_error("Out of memory for -E terminators");
+    return EXIT_FAILURE;
+  }
 
-  fprintf(stdout, "Info Used: \n");
-  fprintf(stdout, "Device: %s\n", dev_path);
-  fprintf(stdout, "Baud: %ld bauds\n", baud_rate);
-  fprintf(stdout, "Command: %s\n", command);
-  fprintf(stdout, "Timeout: %d seconds\n", timeout_seconds);
-  fprintf(stdout, "Debug: %s\n", debug ? "on" : "off");
-  _newline; _newline;
+  FILE *batch_in = NULL;
+  if (batch_path) {
+    batch_in = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+    if (!batch_in) {
+      fprintf(stderr, "Failed to open command file %s: %s\n", batch_path, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  int stream_fd = -1;
+  if (stream) {
+    stream_fd = STDOUT_FILENO;
+    if (stream_path && strcmp(stream_path, "-") != 0) {
+      stream_fd = open(stream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (stream_fd < 0) {
+        fprintf(stderr, "Failed to open output %s: %s\n", stream_path, strerror(errno));
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  /* stdout carries nothing but payload when it is the stream */
+  FILE *info = stdout;
+  if (stream_fd == STDOUT_FILENO) {
+    info = stderr;
+    log_set_console(stderr);
+  }
+
+  fprintf(info, "Info Used: \n");
+  for (int i = 0; i < nports; i++) {
+    fprintf(info, "Device: %s\n", ports[i].path);
+    fprintf(info, "Baud: %ld bauds\n", ports[i].baud_rate);
+  }
+  if (daemon_sock)
+    fprintf(info, "Serving on: %s\n", daemon_sock);
+  if (client_sock)
+    fprintf(info, "Daemon: %s\n", client_sock);
+  if (batch_path)
+    fprintf(info, "Commands: %s (%s-separated)\n", batch_path, batch_delim ? "newline" : "NUL");
+  else if (command)
+    fprintf(info, "Command: %s\n", command);
+  if (send_path)
+    fprintf(info, "Send file: %s (window %d)\n", send_path, window ? window : XFER_DEFAULT_WINDOW);
+  if (recv_path)
+    fprintf(info, "Receive file: %s\n", recv_path);
+  if (window && !send_path)
+    fprintf(info, "Pipeline window: %d\n", window);
+  if ((window && !send_path) || daemon_sock) {
+    if (coalesce_bytes) fprintf(info, "TX coalescing: up to %zu bytes, %ld us\n", coalesce_bytes, coalesce_us);
+    else fprintf(info, "TX coalescing: off\n");
+  }
+  if (stream)
+    fprintf(info, "Streaming payloads to: %s\n", stream_path ? stream_path : "stdout");
+  if (capture_path)
+    fprintf(info, "Capture: %s\n", capture_path);
+  if (io_set)
+    fprintf(info, "I/O backend: %s\n", io_backend == IO_BACKEND_URING ? "io_uring" : "poll");
+  if (reconnect_ms)
+    fprintf(info, "Reconnect: within %ld ms\n", reconnect_ms);
+  if (repeating) {
+    fprintf(info, "Repeat:");
+    if (repeat.count) fprintf(info, " %lu times", repeat.count);
+    if (repeat.duration_ms) fprintf(info, " for up to %ld ms", repeat.duration_ms);
+    if (repeat.rate > 0) fprintf(info, " at %g/s", repeat.rate);
+    fprintf(info, "\n");
+  }
+  if (use_rxt) {
+    char cpu[16] = "any";
+    if (rxt.cpu >= 0) snprintf(cpu, sizeof(cpu), "%d", rxt.cpu);
+    if (rxt.fifo_prio) fprintf(info, "RX thread: CPU %s, SCHED_FIFO %d\n", cpu, rxt.fifo_prio);
+    else fprintf(info, "RX thread: CPU %s\n", cpu);
+  }
+  fprintf(info, "Timeout: %ld ms (first byte: %ld ms, inter-byte: %ld ms)\n",
+          timeouts.total_ms, timeouts.first_byte_ms, timeouts.inter_byte_ms);
+  fprintf(info, "Framing: %s\n", framing == FRAMING_BINARY ? "binary" : framing == FRAMING_COBS ? "cobs" : "text");
+  fprintf(info, "Debug: %s\n", debug ? "on" : "off");
+  fprintf(info, "Logging: %s, level %d (built with %d)\n", async_log ? "async" : "sync", log_level, LOG_COMPILE_LEVEL);
+  fprintf(info, "\n\n");
 
   conf.device_path = dev_path;
   conf.baud_rate = baud_rate;
   conf.debug_mode = debug;
+  conf.framing = framing;
+  conf.tuning = tuning;
+  conf.io_backend = io_backend;
+  conf.keep_input = keep_input;
+  conf.reconnect_ms = reconnect_ms;
+  conf.coalesce_bytes = coalesce_bytes;
+  conf.coalesce_us = coalesce_us;
+  log_set_debug(debug);
+  if (async_log && log_async_start() == 0) atexit(log_async_stop);
+  if (capture_path) {
+    if (capture_open(&capture, capture_path) != 0) {
+      fprintf(stderr, "Failed to create capture %s\n", capture_path);
+      return EXIT_FAILURE;
+    }
+    conf.capture = &capture;
+    atexit(capture_finish);
+  }
+
+  if (client_sock) {
+    int failed = run_client(client_sock, command, batch_in, batch_delim, &timeouts);
+    if (batch_in && batch_in != stdin) fclose(batch_in);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  if (daemon_sock)
+    return run_daemon(daemon_sock, dev_path, baud_rate, &timeouts, window) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  if (multiport) {
+    int failed = run_multiport_cli(ports, nports, command, batch_in, batch_delim, &timeouts);
+    if (batch_in && batch_in != stdin) fclose(batch_in);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
   log_info("Opening Serial Port...");
+  uint64_t open_start = now_us();
   int dev_handle = serial_port_open(dev_path, baud_rate);
+  io_stats.open_us = (int64_t)(now_us() - open_start);
   if (dev_handle < 0) {
     fprintf(stderr, "Failed to open serial port %s\n", dev_path);
+    if (batch_in && batch_in != stdin) fclose(batch_in);
     return EXIT_FAILURE;
   }
-
-  /* send command */
-  send_data_to_device(dev_handle, command, (int)strlen(command));
-
-
-  // READING SENT DATA
-const char *end_marker = "[UART_COM][END]";
-  char *resp = NULL;
-  size_t resp_len = 0;
-  int r = read_until_marker(dev_handle, end_marker, timeout_seconds, &resp, &resp_len);
-  if (r == -1) {
-    log_error("Error while reading response");
-    close(dev_handle);
-    return EXIT_FAILURE;
-  } else if (r == 1) {
-    log_warning("Timeout waiting for end marker; partial data (%zu bytes) received", resp_len);
-  } else {
-    log_info("End marker seen; total bytes received: %zu", resp_len);
+  if (tuning != RX_TUNING_DEFAULT) {
+    struct port_tuning pt;
+    char desc[160];
+    serial_port_tune(dev_handle, dev_path, tuning, &pt);
+    port_tuning_describe(&pt, desc, sizeof(desc));
+    fprintf(info, "Tuning: %s\n", desc);
   }
-    
-    
-    // RESPONSE
-  if (resp_len > 0) {
-      char *printbuf = malloc(resp_len + 1);
-      if (printbuf) {
-          memcpy(printbuf, resp, resp_len);
-          printbuf[resp_len] = '\0';
-          printf("---- DEVICE RESPONSE START ----\n%s\n---- DEVICE RESPONSE END ----\n", printbuf);
-          free(printbuf);
-      } else {
-          write_all(STDOUT_FILENO, resp, resp_len);
-      }
+  if (use_rxt) {
+    conf.rx_thread = rx_thread_start(dev_handle, &rxt);
+    if (!conf.rx_thread) {
+      close(dev_handle);
+      if (batch_in && batch_in != stdin) fclose(batch_in);
+      return EXIT_FAILURE;
+    }
+  }
+  if (compress) {
+    conf.caps = negotiate_caps(dev_handle, &timeouts, NULL);
+    fprintf(info, "Compression: %s\n", conf.caps & UART_CAP_LZ4 ? "lz4" : "off (not offered by the device)");
+  }
+
+  int status = EXIT_SUCCESS;
+  if (transfer) {
+    struct xfer_report rep;
+    if (send_path && xfer_send_file(dev_handle, send_path, window ? window : XFER_DEFAULT_WINDOW, &timeouts, &rep) == 0)
+      print_transfer("Sent", send_path, &rep);
+    else if (recv_path && xfer_recv_file(dev_handle, recv_path, &timeouts, &rep) == 0)
+      print_transfer("Received", recv_path, &rep);
+    else
+      status = EXIT_FAILURE;
+  } else if (batch_in) {
+    int failed = window ? run_pipelined(dev_handle, batch_in, batch_delim, &timeouts, window)
+                        : run_batch(&dev_handle, batch_in, batch_delim, &timeouts, stream_fd);
+    if (failed > 0) status = EXIT_FAILURE;
+    if (batch_in != stdin) fclose(batch_in);
+  } else if (repeating) {
+    if (run_repeat(&dev_handle, command, &timeouts, &repeat) != 0) status = EXIT_FAILURE;
   } else {
-      printf("No response received.\n");
+    struct session_rx rx;
+    if (session_rx_init(&rx, stream_fd) != 0 || run_command_reconnecting(&dev_handle, command, strlen(command), &timeouts, &rx) == -1)
+      status = EXIT_FAILURE;
+    session_rx_free(&rx);
   }
 
-  free(resp);
-  close(dev_handle);
-  return EXIT_SUCCESS;
+  if (conf.rx_thread) {
+    struct rx_thread_stats rs;
+    rx_thread_stop(conf.rx_thread, &rs);
+    conf.rx_thread = NULL;
+    char adapter[32] = "unknown";
+    if (rs.adapter_overruns >= 0) snprintf(adapter, sizeof(adapter), "%ld", rs.adapter_overruns);
+    log_info("RX thread: %llu reads, %llu bytes, %llu overruns (%llu bytes dropped), adapter overruns %s",
+             (unsigned long long)rs.reads, (unsigned long long)rs.bytes, (unsigned long long)rs.overruns,
+             (unsigned long long)rs.dropped, adapter);
+  }
+  if (dev_handle >= 0) close(dev_handle);
+  if (stream_fd > STDOUT_FILENO) close(stream_fd);
+  return status;
 }
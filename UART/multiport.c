@@ -0,0 +1,646 @@
+// multiport.c - one event loop (epoll/kqueue, or io_uring) driving many serial ports
+#include "multiport.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/event.h>
+#define MULTIPORT_KQUEUE 1
+#else
+#include <poll.h>
+#endif
+
+#include "capture.h"
+#include "log.h"
+#include "uring.h"
+
+#define RX_CHUNK 512
+#define MAX_EVENTS 64
+#define URING_BUF_SIZE 1024
+#define URING_MAX_BUFS 16384
+
+/* ---- poller: epoll on Linux, kqueue on macOS/BSD, poll() elsewhere ----
+   Every port is always watched for input (replies may start before the
+   request is fully written); output interest is switched on only while a
+   frame is still queued. */
+struct poll_event {
+    int idx;
+    int readable, writable;
+};
+
+struct poller {
+#if defined(__linux__) || defined(MULTIPORT_KQUEUE)
+    int qfd;
+#else
+    struct pollfd *pfds;
+    int n;
+#endif
+};
+
+static int poller_open(struct poller *p, int nports) {
+#if defined(__linux__)
+    (void)nports;
+    p->qfd = epoll_create1(EPOLL_CLOEXEC);
+    return p->qfd < 0 ? -1 : 0;
+#elif defined(MULTIPORT_KQUEUE)
+    (void)nports;
+    p->qfd = kqueue();
+    return p->qfd < 0 ? -1 : 0;
+#else
+    p->pfds = calloc((size_t)nports, sizeof(*p->pfds));
+    p->n = nports;
+    for (int i = 0; i < nports; i++) p->pfds[i].fd = -1;
+    return p->pfds ? 0 : -1;
+#endif
+}
+
+static void poller_close(struct poller *p) {
+#if defined(__linux__) || defined(MULTIPORT_KQUEUE)
+    if (p->qfd >= 0) close(p->qfd);
+#else
+    free(p->pfds);
+#endif
+}
+
+/* add (first call) or update the interest set of fd */
+static int poller_watch(struct poller *p, int fd, int idx, int want_write, int add) {
+#if defined(__linux__)
+    struct epoll_event ev = { .events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.u32 = (uint32_t)idx };
+    return epoll_ctl(p->qfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#elif defined(MULTIPORT_KQUEUE)
+    struct kevent ch[2];
+    int n = 0;
+    if (add) EV_SET(&ch[n++], fd, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)idx);
+    EV_SET(&ch[n++], fd, EVFILT_WRITE, (add ? EV_ADD : 0) | (want_write ? EV_ENABLE : EV_DISABLE),
+           0, 0, (void *)(intptr_t)idx);
+    return kevent(p->qfd, ch, n, NULL, 0, NULL);
+#else
+    (void)add;
+    p->pfds[idx].fd = fd;
+    p->pfds[idx].events = POLLIN | (want_write ? POLLOUT : 0);
+    return 0;
+#endif
+}
+
+static void poller_forget(struct poller *p, int fd, int idx) {
+#if defined(__linux__)
+    (void)idx;
+    epoll_ctl(p->qfd, EPOLL_CTL_DEL, fd, NULL);
+#elif defined(MULTIPORT_KQUEUE)
+    (void)fd; (void)idx;
+    /* kqueue drops the registrations when the fd is closed */
+#else
+    (void)fd;
+    p->pfds[idx].fd = -1;
+#endif
+}
+
+/* wait up to timeout_us (-1 = forever). Returns events filled, -1 on error. */
+static int poller_wait(struct poller *p, struct poll_event *out, int max, int64_t timeout_us) {
+#if defined(__linux__)
+    struct epoll_event evs[MAX_EVENTS];
+    if (max > MAX_EVENTS) max = MAX_EVENTS;
+    /* epoll takes ms; round up so a deadline is never polled early */
+    int ms = timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000);
+    int n = epoll_wait(p->qfd, evs, max, ms);
+    for (int i = 0; i < n; i++) {
+        out[i].idx = (int)evs[i].data.u32;
+        out[i].readable = (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+        out[i].writable = (evs[i].events & EPOLLOUT) != 0;
+    }
+    return n;
+#elif defined(MULTIPORT_KQUEUE)
+    struct kevent evs[MAX_EVENTS];
+    if (max > MAX_EVENTS) max = MAX_EVENTS;
+    struct timespec ts, *tsp = NULL;
+    if (timeout_us >= 0) {
+        ts.tv_sec = (time_t)(timeout_us / 1000000);
+        ts.tv_nsec = (long)(timeout_us % 1000000) * 1000;
+        tsp = &ts;
+    }
+    int n = kevent(p->qfd, NULL, 0, evs, max, tsp);
+    for (int i = 0; i < n; i++) {
+        out[i].idx = (int)(intptr_t)evs[i].udata;
+        out[i].readable = evs[i].filter == EVFILT_READ;
+        out[i].writable = evs[i].filter == EVFILT_WRITE;
+    }
+    return n;
+#else
+    int ms = timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000);
+    int n = poll(p->pfds, (nfds_t)p->n, ms);
+    if (n <= 0) return n;
+    int k = 0;
+    for (int i = 0; i < p->n && k < max; i++) {
+        short re = p->pfds[i].revents;
+        if (p->pfds[i].fd < 0 || !re) continue;
+        out[k].idx = i;
+        out[k].readable = (re & (POLLIN | POLLERR | POLLHUP)) != 0;
+        out[k].writable = (re & POLLOUT) != 0;
+        k++;
+    }
+    return k;
+#endif
+}
+
+/* ---- per-port state machine: SEND -> RECV -> (next command) ... DONE ---- */
+enum port_state { PORT_SEND, PORT_RECV, PORT_DONE };
+
+struct port {
+    const char *path;
+    int fd;
+    int chan;                   /* -p position, tags this port's capture records */
+    enum port_state state;
+    size_t cmd;                 /* index of the command in flight */
+
+    struct iovec iov[3];        /* frame still to be written */
+    struct iovec *iovp;
+    int iovcnt;
+
+    struct marker_scanner sc;
+    char *buf;                  /* response so far, then bytes of the next frame */
+    size_t len, cap;
+    size_t scanned;             /* bytes of buf already fed to the scanner */
+    uint64_t start, last_rx;
+    uint64_t tx_deadline;       /* PORT_SEND: the frame must be out by then */
+    int read_armed, poll_armed;     /* io_uring: requests in flight */
+
+    unsigned long ok, failed;
+};
+
+static void port_load_frame(struct port *pt, const char *msg, size_t len) {
+    pt->iov[0] = (struct iovec){ .iov_base = (void *)UART_COM_START, .iov_len = UART_COM_START_LEN };
+    pt->iov[1] = (struct iovec){ .iov_base = (void *)msg,            .iov_len = len };
+    pt->iov[2] = (struct iovec){ .iov_base = (void *)UART_COM_END,   .iov_len = UART_COM_END_LEN };
+    pt->iovp = pt->iov;
+    pt->iovcnt = 3;
+    pt->state = PORT_SEND;
+    pt->tx_deadline = tx_deadline(now_us(), UART_COM_START_LEN + len + UART_COM_END_LEN);
+}
+
+/* write as much of the queued frame as the kernel takes. Returns 1 when
+   the frame is out, 0 if more is pending, -1 on error. */
+static int port_flush(struct port *pt) {
+    while (pt->iovcnt > 0) {
+        ssize_t n = writev(pt->fd, pt->iovp, pt->iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { errno = 0; return 0; }
+            return -1;
+        }
+        if (conf.capture) capture_record_iov(conf.capture, CAPTURE_TX, pt->chan, pt->iovp, pt->iovcnt, (size_t)n);
+        iov_advance(&pt->iovp, &pt->iovcnt, (size_t)n);
+    }
+    return 1;
+}
+
+/* scan what has not been scanned; returns the frame end offset or -1 */
+static ssize_t port_scan(struct port *pt) {
+    ssize_t hit = marker_scanner_feed(&pt->sc, pt->buf + pt->scanned, pt->len - pt->scanned);
+    if (hit >= 0) {
+        size_t end = pt->scanned + (size_t)hit;
+        pt->scanned = end;
+        return (ssize_t)end;
+    }
+    pt->scanned = pt->len;
+    return -1;
+}
+
+/* buffer room for at least RX_CHUNK more bytes */
+static int port_reserve(struct port *pt, size_t n) {
+    if (pt->len + n <= pt->cap) return 0;
+    size_t ncap = pt->cap ? pt->cap : RX_CHUNK * 2;
+    while (ncap < pt->len + n) ncap *= 2;
+    char *nb = realloc(pt->buf, ncap);
+    if (!nb) return -1;
+    pt->buf = nb;
+    pt->cap = ncap;
+    return 0;
+}
+
+/* drain the fd; returns 0, or -1 on error/EOF */
+static int port_read(struct port *pt) {
+    for (;;) {
+        if (port_reserve(pt, RX_CHUNK) != 0) return -1;
+        ssize_t r = read(pt->fd, pt->buf + pt->len, pt->cap - pt->len);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { errno = 0; return 0; }
+            return -1;
+        }
+        if (r == 0) return -1;
+        if (conf.capture) capture_record(conf.capture, CAPTURE_RX, pt->chan, pt->buf + pt->len, (size_t)r);
+        pt->len += (size_t)r;
+        pt->last_rx = now_us();
+    }
+}
+
+/* one run over all ports, shared by the two event loops */
+struct mp_run {
+    struct port *pts;
+    int nports;
+    char *const *cmds;
+    const size_t *cmd_lens;
+    size_t ncmds;
+    const struct read_timeouts *to;
+    multiport_response_fn on_response;
+    int failures;
+    struct poller *poller;      /* readiness loop only; NULL under io_uring */
+};
+
+static void port_abort(struct mp_run *m, struct port *pt, const char *what) {
+    log_error("multiport: %s: %s", pt->path, what);
+    pt->state = PORT_DONE;
+    m->failures += (int)(m->ncmds - pt->cmd);
+    pt->failed += m->ncmds - pt->cmd;
+    /* a hung-up fd stays readable forever; drop it so the loop can sleep */
+    if (pt->fd >= 0) {
+        if (m->poller) poller_forget(m->poller, pt->fd, (int)(pt - m->pts));
+        close(pt->fd);
+        pt->fd = -1;
+    }
+}
+
+/* nearest send or response deadline across all busy ports, -1 if none */
+static int64_t mp_wait_us(const struct mp_run *m, uint64_t now) {
+    int64_t wait_us = -1;
+    for (int i = 0; i < m->nports; i++) {
+        const struct port *pt = &m->pts[i];
+        if (pt->state == PORT_DONE) continue;
+        uint64_t d = pt->state == PORT_SEND ? pt->tx_deadline
+                                            : rx_deadline(m->to, pt->start, pt->last_rx, pt->len > 0);
+        int64_t w = d > now ? (int64_t)(d - now) : 0;
+        if (wait_us < 0 || w < wait_us) wait_us = w;
+    }
+    return wait_us;
+}
+
+/* complete or expire a waiting port's exchange. Returns 1 when the next
+   command's frame has been loaded and needs writing. */
+static int port_settle(struct mp_run *m, struct port *pt, uint64_t now) {
+    ssize_t end = port_scan(pt);
+    int status = 0;
+    size_t frame_len = (size_t)end;
+    if (end < 0) {
+        uint64_t d = rx_deadline(m->to, pt->start, pt->last_rx, pt->len > 0);
+        if (now < d) return 0;
+        status = 1;
+        frame_len = pt->len;
+    }
+
+    m->on_response(pt->path, pt->buf, frame_len, status);
+    if (status == 0) pt->ok++; else { pt->failed++; m->failures++; }
+
+    /* keep bytes of the next frame at the front of the buffer */
+    memmove(pt->buf, pt->buf + frame_len, pt->len - frame_len);
+    pt->len -= frame_len;
+    pt->scanned = 0;
+    pt->sc.matched = 0;
+
+    if (++pt->cmd == m->ncmds) {
+        pt->state = PORT_DONE;
+        return 0;
+    }
+    port_load_frame(pt, m->cmds[pt->cmd], m->cmd_lens[pt->cmd]);
+    return 1;
+}
+
+/* a port that stopped taking its frame fails its remaining commands */
+static int port_tx_expired(struct mp_run *m, struct port *pt, uint64_t now) {
+    if (pt->state != PORT_SEND || now < pt->tx_deadline) return 0;
+    errno = 0;
+    port_abort(m, pt, "timed out sending");
+    return 1;
+}
+
+static int mp_active(const struct mp_run *m) {
+    int active = 0;
+    for (int i = 0; i < m->nports; i++) {
+        if (m->pts[i].state != PORT_DONE) active++;
+    }
+    return active;
+}
+
+/* readiness loop: epoll/kqueue/poll tells which fds to read and write */
+static void mp_loop_poller(struct mp_run *m) {
+    struct poller poller;
+    if (poller_open(&poller, m->nports) != 0) {
+        log_error("multiport: cannot create event queue");
+        for (int i = 0; i < m->nports; i++)
+            if (m->pts[i].state != PORT_DONE) port_abort(m, &m->pts[i], "no event queue");
+        return;
+    }
+    m->poller = &poller;
+    for (int i = 0; i < m->nports; i++) {
+        struct port *pt = &m->pts[i];
+        if (pt->state != PORT_DONE && poller_watch(&poller, pt->fd, i, 1, 1) != 0) port_abort(m, pt, "cannot watch");
+    }
+
+    struct poll_event evs[MAX_EVENTS];
+    while (mp_active(m) > 0) {
+        int n = poller_wait(&poller, evs, MAX_EVENTS, mp_wait_us(m, now_us()));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("multiport: event wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct port *pt = &m->pts[evs[i].idx];
+            if (pt->state == PORT_DONE) continue;
+            if (evs[i].readable && port_read(pt) != 0) {
+                port_abort(m, pt, "read failed or device closed");
+                continue;
+            }
+            if (pt->state == PORT_SEND && evs[i].writable) {
+                int f = port_flush(pt);
+                if (f < 0) {
+                    port_abort(m, pt, "write failed");
+                    continue;
+                }
+                if (f == 1) {
+                    pt->state = PORT_RECV;
+                    pt->start = pt->last_rx = now_us();
+                    poller_watch(&poller, pt->fd, evs[i].idx, 0, 0);
+                }
+            }
+        }
+
+        uint64_t now = now_us();
+        for (int i = 0; i < m->nports; i++) {
+            struct port *pt = &m->pts[i];
+            if (port_tx_expired(m, pt, now)) continue;
+            if (pt->state == PORT_RECV && port_settle(m, pt, now)) poller_watch(&poller, pt->fd, i, 1, 0);
+        }
+    }
+
+    for (int i = 0; i < m->nports; i++) {
+        if (m->pts[i].fd >= 0) poller_forget(&poller, m->pts[i].fd, i);
+    }
+    poller_close(&poller);
+    m->poller = NULL;
+}
+
+#ifdef __linux__
+#include <poll.h>
+
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT 49     /* Linux 6.7; older headers lack it */
+#endif
+
+/* ---- completion loop: io_uring ----
+   Reads, writes and the wait for all ports go into the kernel in one
+   io_uring_enter() per round instead of a syscall per port per event.
+   Ports are registered fds and reads pick receive buffers from a ring
+   shared with the kernel. Each port gets one multishot read; where the
+   kernel or driver refuses those (-EINVAL, or -EAGAIN with no data), ports
+   get a multishot poll instead and a buffer-selecting read is queued for
+   every readiness event, to go in with the next round. The fds stay
+   non-blocking: a blocking tty read would sleep inside io_uring_enter().
+   Writes that find the tty full wait on a one-shot poll for POLLOUT. */
+enum { URING_READ = 1, URING_WRITE, URING_POLL_IN, URING_POLL_OUT };
+
+#define URING_DATA(op, idx) (((uint64_t)(op) << 32) | (uint32_t)(idx))
+
+static int uring_multishot = 1;     /* cleared once a multishot read is refused */
+
+static struct io_uring_sqe *uring_port_sqe(struct uring *u, int op, int idx) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (!sqe) return NULL;
+    sqe->fd = idx;                      /* index into the registered files */
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = URING_DATA(op, idx);
+    return sqe;
+}
+
+static int uring_arm_read(struct uring *u, struct port *pt, int idx) {
+    struct io_uring_sqe *sqe = uring_port_sqe(u, URING_READ, idx);
+    if (!sqe) return -1;
+    sqe->opcode = uring_multishot ? IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->off = (uint64_t)-1;            /* current position: a tty has none */
+    pt->read_armed = 1;
+    return 0;
+}
+
+static int uring_arm_poll(struct uring *u, int op, int idx) {
+    struct io_uring_sqe *sqe = uring_port_sqe(u, op, idx);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = op == URING_POLL_IN ? POLLIN : POLLOUT;
+    if (op == URING_POLL_IN) sqe->len = IORING_POLL_ADD_MULTI;
+    return 0;
+}
+
+static int uring_arm_write(struct uring *u, struct port *pt, int idx) {
+    struct io_uring_sqe *sqe = uring_port_sqe(u, URING_WRITE, idx);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->addr = (uint64_t)(uintptr_t)pt->iovp;
+    sqe->len = (uint32_t)pt->iovcnt;
+    sqe->off = (uint64_t)-1;
+    return 0;
+}
+
+static void uring_on_read(struct mp_run *m, struct uring *u, struct port *pt, int idx, const struct io_uring_cqe *cqe) {
+    int res = cqe->res;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && pt->state != PORT_DONE) {
+            if (port_reserve(pt, (size_t)res) != 0) {
+                port_abort(m, pt, "out of memory");
+            } else {
+                memcpy(pt->buf + pt->len, uring_buf(u, bid), (size_t)res);
+                if (conf.capture) capture_record(conf.capture, CAPTURE_RX, pt->chan, pt->buf + pt->len, (size_t)res);
+                pt->len += (size_t)res;
+                pt->last_rx = now_us();
+            }
+        }
+        uring_buf_recycle(u, bid);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) return;   /* multishot read still armed */
+    pt->read_armed = 0;
+    if (pt->state == PORT_DONE) return;
+
+    if (uring_multishot && (res == -EAGAIN || res == -EINVAL)) {
+        /* multishot reads not supported for this file: poll-driven reads */
+        log_info("multiport: no multishot reads here; polling and batching single reads");
+        uring_multishot = 0;
+    }
+    if (!uring_multishot && !pt->poll_armed) {
+        if (uring_arm_poll(u, URING_POLL_IN, idx) != 0) {
+            port_abort(m, pt, "submission queue full");
+            return;
+        }
+        pt->poll_armed = 1;
+    }
+    if (res == 0 || (res < 0 && res != -EAGAIN && res != -EINTR && res != -ENOBUFS && res != -EINVAL)) {
+        errno = res < 0 ? -res : 0;
+        port_abort(m, pt, "read failed or device closed");
+        return;
+    }
+    /* a full buffer may have left more behind; out of buffers, try again */
+    if ((res == (int)u->buf_size || res == -ENOBUFS || uring_multishot) && uring_arm_read(u, pt, idx) != 0)
+        port_abort(m, pt, "submission queue full");
+}
+
+static void uring_on_poll_in(struct mp_run *m, struct uring *u, struct port *pt, int idx, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) pt->poll_armed = 0;
+    if (pt->state == PORT_DONE) return;
+    if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        port_abort(m, pt, "poll failed");
+        return;
+    }
+    if (!pt->read_armed && uring_arm_read(u, pt, idx) != 0) port_abort(m, pt, "submission queue full");
+    if (pt->state != PORT_DONE && !pt->poll_armed) {
+        if (uring_arm_poll(u, URING_POLL_IN, idx) != 0) port_abort(m, pt, "submission queue full");
+        else pt->poll_armed = 1;
+    }
+}
+
+static void uring_on_write(struct mp_run *m, struct uring *u, struct port *pt, int idx, int res) {
+    if (pt->state != PORT_SEND) return;
+    if (res == -EAGAIN) {
+        if (uring_arm_poll(u, URING_POLL_OUT, idx) != 0) port_abort(m, pt, "submission queue full");
+        return;
+    }
+    if (res == -EINTR) {
+        res = 0;
+    } else if (res < 0) {
+        errno = -res;
+        port_abort(m, pt, "write failed");
+        return;
+    }
+    if (res > 0) {
+        if (conf.capture) capture_record_iov(conf.capture, CAPTURE_TX, pt->chan, pt->iovp, pt->iovcnt, (size_t)res);
+        iov_advance(&pt->iovp, &pt->iovcnt, (size_t)res);
+    }
+    if (pt->iovcnt > 0) {
+        if (uring_arm_write(u, pt, idx) != 0) port_abort(m, pt, "submission queue full");
+        return;
+    }
+    pt->state = PORT_RECV;
+    pt->start = pt->last_rx = now_us();
+}
+
+/* Returns -1 (nothing done yet) if io_uring cannot be set up here */
+static int mp_loop_uring(struct mp_run *m) {
+    unsigned entries = 64, nbufs = 64;
+    while (entries < 4u * (unsigned)m->nports) entries <<= 1;
+    while (nbufs < 4u * (unsigned)m->nports && nbufs < URING_MAX_BUFS) nbufs <<= 1;
+
+    struct uring u;
+    if (uring_open(&u, entries, nbufs, URING_BUF_SIZE) != 0) {
+        log_warning("multiport: io_uring unavailable, using epoll");
+        return -1;
+    }
+    int *fds = malloc((size_t)m->nports * sizeof(*fds));
+    if (!fds) {
+        uring_close(&u);
+        return -1;
+    }
+    for (int i = 0; i < m->nports; i++) fds[i] = m->pts[i].state == PORT_DONE ? -1 : m->pts[i].fd;
+    int reg = uring_register_files(&u, fds, (unsigned)m->nports);
+    free(fds);
+    if (reg != 0) {
+        log_warning("multiport: cannot register ports with io_uring, using epoll");
+        uring_close(&u);
+        return -1;
+    }
+    log_info("multiport: io_uring backend, %u entries, %u x %u byte receive buffers", u.sq_entries, nbufs, URING_BUF_SIZE);
+
+    for (int i = 0; i < m->nports; i++) {
+        struct port *pt = &m->pts[i];
+        if (pt->state == PORT_DONE) continue;
+        if (uring_arm_read(&u, pt, i) != 0 || uring_arm_write(&u, pt, i) != 0) port_abort(m, pt, "submission queue full");
+    }
+
+    while (mp_active(m) > 0) {
+        if (uring_submit_wait(&u, mp_wait_us(m, now_us())) != 0) {
+            log_error("multiport: io_uring_enter failed");
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&u)) != NULL) {
+            int op = (int)(cqe->user_data >> 32);
+            int idx = (int)(uint32_t)cqe->user_data;
+            struct port *pt = &m->pts[idx];
+            if (op == URING_READ) uring_on_read(m, &u, pt, idx, cqe);
+            else if (op == URING_POLL_IN) uring_on_poll_in(m, &u, pt, idx, cqe);
+            else if (op == URING_POLL_OUT && pt->state == PORT_SEND && uring_arm_write(&u, pt, idx) != 0)
+                port_abort(m, pt, "submission queue full");
+            else if (op == URING_WRITE) uring_on_write(m, &u, pt, idx, cqe->res);
+            uring_cqe_seen(&u);
+        }
+
+        uint64_t now = now_us();
+        for (int i = 0; i < m->nports; i++) {
+            struct port *pt = &m->pts[i];
+            if (port_tx_expired(m, pt, now)) continue;
+            if (pt->state == PORT_RECV && port_settle(m, pt, now) && uring_arm_write(&u, pt, i) != 0)
+                port_abort(m, pt, "submission queue full");
+        }
+    }
+    log_info("multiport: %lu io_uring_enter calls for %lu submissions", u.submit_calls, u.sqes_submitted);
+    uring_close(&u);
+    return 0;
+}
+#endif
+
+int run_multiport(const struct port_spec *ports, int nports,
+                  char *const *cmds, const size_t *cmd_lens, size_t ncmds,
+                  const struct read_timeouts *to, multiport_response_fn on_response) {
+    if (nports <= 0 || nports > MULTIPORT_MAX_PORTS || ncmds == 0) return -1;
+
+    struct port *pts = calloc((size_t)nports, sizeof(*pts));
+    if (!pts) return -1;
+    struct mp_run m = { .pts = pts, .nports = nports, .cmds = cmds, .cmd_lens = cmd_lens, .ncmds = ncmds,
+                        .to = to, .on_response = on_response };
+
+    int active = 0;
+    for (int i = 0; i < nports; i++) {
+        struct port *pt = &pts[i];
+        pt->path = ports[i].path;
+        pt->chan = i;
+        pt->state = PORT_DONE;
+        pt->fd = serial_port_open(ports[i].path, ports[i].baud_rate);
+        if (pt->fd < 0) {
+            m.failures += (int)ncmds;
+            continue;
+        }
+        if (conf.tuning != RX_TUNING_DEFAULT) serial_port_tune(pt->fd, pt->path, conf.tuning, NULL);
+        marker_scanner_init(&pt->sc, UART_COM_END);
+        if (set_blocking(pt->fd, 0) != 0) {
+            log_error("multiport: cannot set up %s", pt->path);
+            close(pt->fd);
+            pt->fd = -1;
+            m.failures += (int)ncmds;
+            continue;
+        }
+        port_load_frame(pt, cmds[0], cmd_lens[0]);
+        active++;
+    }
+    log_info("multiport: %d of %d ports active, %zu commands each", active, nports, ncmds);
+
+#ifdef __linux__
+    if (conf.io_backend != IO_BACKEND_URING || mp_loop_uring(&m) != 0) mp_loop_poller(&m);
+#else
+    if (conf.io_backend == IO_BACKEND_URING) log_warning("multiport: io_uring is Linux-only, using the event queue");
+    mp_loop_poller(&m);
+#endif
+
+    for (int i = 0; i < nports; i++) {
+        struct port *pt = &pts[i];
+        if (pt->ok || pt->failed) log_info("multiport: %s: %lu ok, %lu failed", pt->path, pt->ok, pt->failed);
+        if (pt->fd >= 0) close(pt->fd);
+        free(pt->buf);
+    }
+    free(pts);
+    return m.failures;
+}
@@ -0,0 +1,27 @@
+// multiport.h - one event loop (epoll/kqueue, or io_uring) driving many serial ports
+#ifndef UART_MULTIPORT_H
+#define UART_MULTIPORT_H
+
+#include <stddef.h>
+
+#include "uart.h"
+
+#define MULTIPORT_MAX_PORTS 1024
+
+struct port_spec {
+    const char *path;
+    long baud_rate;
+};
+
+/* called for every finished exchange; status as read_until_marker()
+   (0 marker seen, 1 timeout with partial data, -1 error) */
+typedef void (*multiport_response_fn)(const char *path, const char *resp, size_t resp_len, int status);
+
+/* send every command, in order, to every port, all ports concurrently.
+   Each port is stop-and-wait on its own, with its own scanner and deadlines.
+   Returns the number of exchanges that timed out or failed. */
+int run_multiport(const struct port_spec *ports, int nports,
+                  char *const *cmds, const size_t *cmd_lens, size_t ncmds,
+                  const struct read_timeouts *to, multiport_response_fn on_response);
+
+#endif
@@ -0,0 +1,268 @@
+// rxthread.c - receive loop on its own (optionally pinned, SCHED_FIFO) thread
+#define _GNU_SOURCE
+#include "rxthread.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "log.h"
+
+#define RXT_SCRATCH 4096
+
+struct rx_thread {
+    int fd;
+    int notify[2];              /* thread -> consumer wakeups */
+    int stop[2];                /* consumer -> thread shutdown */
+    pthread_t thread;
+    int pinned, fifo;
+    long icount_base;
+
+    /* ring: tail written by the thread, head by the consumer */
+    unsigned char *buf;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t head;
+    atomic_int waiting;         /* consumer is (about to be) asleep on notify */
+    atomic_int done;            /* thread saw EOF or an error; err holds errno */
+    int err;
+    int armed;                  /* consumer: notify may hold a wakeup byte */
+
+    _Atomic uint64_t reads, bytes, overruns, dropped;
+};
+
+/* overrun count kept by the serial driver, where it keeps one */
+static long adapter_overruns(int fd) {
+#ifdef TIOCGICOUNT
+    struct serial_icounter_struct ic;
+    if (ioctl(fd, TIOCGICOUNT, &ic) == 0) return (long)ic.overrun + ic.buf_overrun;
+#else
+    (void)fd;
+#endif
+    return -1;
+}
+
+static void wake_consumer(struct rx_thread *rt) {
+    if (atomic_exchange(&rt->waiting, 0)) {
+        char c = 1;
+        if (write(rt->notify[1], &c, 1) < 0 && errno != EAGAIN) log_warning("RX thread: cannot wake reader");
+    }
+}
+
+static void *rx_loop(void *arg) {
+    struct rx_thread *rt = arg;
+    unsigned char scratch[RXT_SCRATCH];
+    const uint64_t mask = RXT_RING_SIZE - 1;
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { .fd = rt->fd, .events = POLLIN },
+            { .fd = rt->stop[0], .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            rt->err = errno;
+            break;
+        }
+        if (pfd[1].revents) return NULL;
+        if (!pfd[0].revents) continue;
+
+        uint64_t tail = atomic_load_explicit(&rt->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&rt->head, memory_order_acquire);
+        size_t room = RXT_RING_SIZE - (size_t)(tail - head);
+        ssize_t r;
+        if (room == 0) {
+            /* consumer too far behind: keep the port drained, count the loss */
+            r = read(rt->fd, scratch, sizeof(scratch));
+            if (r > 0) {
+                atomic_fetch_add_explicit(&rt->overruns, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&rt->dropped, (uint64_t)r, memory_order_relaxed);
+                wake_consumer(rt);
+                continue;
+            }
+        } else {
+            size_t off = (size_t)(tail & mask);
+            size_t first = RXT_RING_SIZE - off < room ? RXT_RING_SIZE - off : room;
+            struct iovec seg[2] = {
+                { .iov_base = rt->buf + off, .iov_len = first },
+                { .iov_base = rt->buf, .iov_len = room - first },
+            };
+            r = readv(rt->fd, seg, room > first ? 2 : 1);
+            if (r > 0) {
+                atomic_fetch_add_explicit(&rt->reads, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&rt->bytes, (uint64_t)r, memory_order_relaxed);
+                atomic_store(&rt->tail, tail + (uint64_t)r);   /* publishes the bytes */
+                wake_consumer(rt);
+                continue;
+            }
+        }
+        if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        rt->err = r < 0 ? errno : 0;
+        break;
+    }
+    atomic_store(&rt->done, 1);
+    wake_consumer(rt);
+    return NULL;
+}
+
+static int nonblocking_pipe(int p[2]) {
+    if (pipe(p) != 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(p[i], F_SETFL, fcntl(p[i], F_GETFL) | O_NONBLOCK);
+        fcntl(p[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+/* placement and priority are best effort: a refusal is reported, not fatal */
+static void rx_thread_tune(struct rx_thread *rt, const struct rx_thread_opts *o) {
+    if (o->cpu >= 0) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(o->cpu, &set);
+        int e = pthread_setaffinity_np(rt->thread, sizeof(set), &set);
+        rt->pinned = e == 0 ? 1 : -1;
+        if (e != 0) {
+            errno = e;
+            log_warning("RX thread: cannot pin to CPU %d", o->cpu);
+        }
+#else
+        log_warning("RX thread: CPU pinning is not available on this platform");
+#endif
+    }
+    if (o->fifo_prio > 0) {
+        struct sched_param sp = { .sched_priority = o->fifo_prio };
+        int e = pthread_setschedparam(rt->thread, SCHED_FIFO, &sp);
+        rt->fifo = e == 0 ? 1 : -1;
+        if (e != 0) {
+            errno = e;
+            log_warning("RX thread: SCHED_FIFO priority %d refused", o->fifo_prio);
+        }
+    }
+    errno = 0;
+}
+
+struct rx_thread *rx_thread_start(int fd, const struct rx_thread_opts *o) {
+    struct rx_thread *rt = calloc(1, sizeof(*rt));
+    if (!rt) return NULL;
+    rt->fd = fd;
+    rt->notify[0] = rt->notify[1] = rt->stop[0] = rt->stop[1] = -1;
+    rt->buf = malloc(RXT_RING_SIZE);
+    if (!rt->buf || nonblocking_pipe(rt->notify) != 0 || nonblocking_pipe(rt->stop) != 0) {
+        log_error("RX thread: out of resources");
+        goto fail;
+    }
+    rt->icount_base = adapter_overruns(fd);
+    if (pthread_create(&rt->thread, NULL, rx_loop, rt) != 0) {
+        log_error("RX thread: cannot start");
+        goto fail;
+    }
+    rx_thread_tune(rt, o);
+    return rt;
+
+fail:
+    for (int i = 0; i < 2; i++) {
+        if (rt->notify[i] >= 0) close(rt->notify[i]);
+        if (rt->stop[i] >= 0) close(rt->stop[i]);
+    }
+    free(rt->buf);
+    free(rt);
+    return NULL;
+}
+
+void rx_thread_get_stats(const struct rx_thread *rt, struct rx_thread_stats *st) {
+    st->pinned = rt->pinned;
+    st->fifo = rt->fifo;
+    st->reads = atomic_load(&rt->reads);
+    st->bytes = atomic_load(&rt->bytes);
+    st->overruns = atomic_load(&rt->overruns);
+    st->dropped = atomic_load(&rt->dropped);
+    long now = rt->icount_base >= 0 ? adapter_overruns(rt->fd) : -1;
+    st->adapter_overruns = now >= 0 ? now - rt->icount_base : -1;
+}
+
+void rx_thread_stop(struct rx_thread *rt, struct rx_thread_stats *st) {
+    char c = 1;
+    if (write(rt->stop[1], &c, 1) < 0) log_warning("RX thread: cannot signal stop");
+    pthread_join(rt->thread, NULL);
+    if (st) rx_thread_get_stats(rt, st);
+    for (int i = 0; i < 2; i++) {
+        close(rt->notify[i]);
+        close(rt->stop[i]);
+    }
+    free(rt->buf);
+    free(rt);
+}
+
+int rx_thread_fd(const struct rx_thread *rt) {
+    return rt->notify[0];
+}
+
+static int rx_thread_pending(struct rx_thread *rt) {
+    return atomic_load(&rt->tail) != atomic_load_explicit(&rt->head, memory_order_relaxed) ||
+           atomic_load(&rt->done);
+}
+
+/* the waiting flag is set before the second look, and the thread publishes
+   its tail before testing the flag, so one of the two always sees the other */
+int rx_thread_arm(struct rx_thread *rt) {
+    if (rx_thread_pending(rt)) return 1;
+    atomic_store(&rt->waiting, 1);
+    rt->armed = 1;
+    return rx_thread_pending(rt);
+}
+
+ssize_t rx_thread_readv(struct rx_thread *rt, const struct iovec *iov, int iovcnt) {
+    if (rt->armed) {
+        char drain[64];
+        while (read(rt->notify[0], drain, sizeof(drain)) > 0) {}
+        rt->armed = 0;
+        errno = 0;      /* the drain ends in EAGAIN */
+    }
+    uint64_t head = atomic_load_explicit(&rt->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&rt->tail, memory_order_acquire);
+    if (tail == head) {
+        if (!atomic_load(&rt->done)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (rt->err == 0) return 0;
+        errno = rt->err;
+        return -1;
+    }
+
+    const uint64_t mask = RXT_RING_SIZE - 1;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt && head < tail; i++) {
+        size_t want = iov[i].iov_len;
+        unsigned char *dst = iov[i].iov_base;
+        while (want > 0 && head < tail) {
+            size_t off = (size_t)(head & mask);
+            size_t k = (size_t)(tail - head);
+            if (k > RXT_RING_SIZE - off) k = RXT_RING_SIZE - off;
+            if (k > want) k = want;
+            memcpy(dst, rt->buf + off, k);
+            dst += k;
+            want -= k;
+            head += k;
+            total += k;
+        }
+    }
+    atomic_store_explicit(&rt->head, head, memory_order_release);   /* frees the space */
+    return (ssize_t)total;
+}
+
+ssize_t rx_thread_read(struct rx_thread *rt, void *buf, size_t n) {
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    return rx_thread_readv(rt, &iov, 1);
+}
@@ -0,0 +1,51 @@
+// rxthread.h - receive loop on its own (optionally pinned, SCHED_FIFO) thread
+#ifndef UART_RXTHREAD_H
+#define UART_RXTHREAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RXT_RING_SIZE (1u << 20)   /* bytes buffered between the threads */
+#define RXT_FIFO_DEFAULT_PRIO 50
+
+/* The thread does nothing but poll(), read() the port into a single-
+   producer/single-consumer byte ring and publish the new tail, so the
+   kernel's buffer is emptied within a wakeup of data arriving whatever
+   the consumer is busy with. When the ring is full the bytes read are
+   dropped and counted as an overrun rather than left to overflow the
+   adapter. The consumer sleeps on a pipe that the thread only writes to
+   after the consumer has announced it is about to sleep. */
+struct rx_thread;
+
+struct rx_thread_opts {
+    int cpu;            /* pin to this CPU; -1 leaves placement to the scheduler */
+    int fifo_prio;      /* SCHED_FIFO priority; 0 keeps normal scheduling */
+};
+
+/* Knob states as in struct port_tuning: 1 applied, 0 not requested or not
+   available here, -1 refused (e.g. EPERM without CAP_SYS_NICE). */
+struct rx_thread_stats {
+    int pinned;
+    int fifo;
+    uint64_t reads, bytes;
+    uint64_t overruns, dropped;         /* reads that found the ring full */
+    long adapter_overruns;              /* reported by the driver; -1 if unknown */
+};
+
+struct rx_thread *rx_thread_start(int fd, const struct rx_thread_opts *o);
+/* join the thread and free it; st (may be NULL) gets the final counters */
+void rx_thread_stop(struct rx_thread *rt, struct rx_thread_stats *st);
+void rx_thread_get_stats(const struct rx_thread *rt, struct rx_thread_stats *st);
+
+/* consumer side, one thread only. read/readv return what is queued; -1
+   with EAGAIN when nothing is, 0 at EOF, -1 with the port's errno after a
+   read error. */
+ssize_t rx_thread_read(struct rx_thread *rt, void *buf, size_t n);
+ssize_t rx_thread_readv(struct rx_thread *rt, const struct iovec *iov, int iovcnt);
+/* before sleeping: returns 1 if a read would not block; otherwise 0, and
+   rx_thread_fd() becomes readable as soon as one would not */
+int rx_thread_arm(struct rx_thread *rt);
+int rx_thread_fd(const struct rx_thread *rt);
+
+#endif
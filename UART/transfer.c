@@ -0,0 +1,443 @@
+// transfer.c - bulk file transfer over binary frames with a sliding window
+#include "transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define XFER_FRAME_OVERHEAD 16   /* sync, length, type, index, CRC, with room to spare */
+#define XFER_RETRY_MS 500        /* handshake / end-of-file resend interval */
+#define XFER_RTO_SLACK_MS 250
+#define XFER_MAX_TRIES 8         /* sends of one chunk before giving up */
+#define XFER_FAST_RESEND 3       /* later chunks acked before a missing one is resent early */
+#define XFER_MAX_ERRORS 64       /* bad frames a receiver tolerates in a row */
+#define XFER_LINGER_MS 500       /* receiver stays to answer a repeated 'E' */
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_be64(unsigned char *p, uint64_t v) {
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+/* line time of one data frame at the configured rate, 10 bits a byte */
+static uint64_t chunk_wire_us(size_t chunk) {
+    uint64_t baud = conf.baud_rate > 0 ? (uint64_t)conf.baud_rate : 115200u;
+    return (uint64_t)(chunk + XFER_FRAME_OVERHEAD) * 10u * 1000000u / baud;
+}
+
+/* send req, then wait for a frame of type want, sending req again every
+   XFER_RETRY_MS until budget_ms is used up. A 'G' from the receiver asks
+   for the offer again straight away. Returns 0 with the reply in *reply
+   (malloc'd), -1 if none came. */
+static int xfer_exchange(int fd, struct rx_carry *carry, const unsigned char *req, size_t req_len,
+                         char want, long budget_ms, char **reply, size_t *reply_len) {
+    uint64_t end = now_us() + (uint64_t)budget_ms * 1000u;
+    do {
+        if (send_framed(fd, (const char *)req, req_len, 0) != 0) return -1;
+        uint64_t resend = now_us() + XFER_RETRY_MS * 1000u;
+        if (resend > end) resend = end;
+
+        for (uint64_t now; (now = now_us()) < resend;) {
+            struct read_timeouts to = { .total_ms = (long)((resend - now + 999) / 1000) };
+            char *msg = NULL;
+            size_t len = 0;
+            int r = read_response(fd, &to, carry, NULL, &msg, &len);
+            if (r == 0 && len > 0 && msg[0] == want) {
+                *reply = msg;
+                *reply_len = len;
+                return 0;
+            }
+            int again = r == 0 && len > 0 && msg[0] == 'G' && req[0] == 'S';
+            free(msg);
+            if (r == 1 || again) break;
+        }
+    } while (now_us() < end);
+
+    errno = 0;
+    log_error("No '%c' from the other side within %ld ms", want, budget_ms);
+    return -1;
+}
+
+/* unacknowledged chunk in the sender's window, at slot index % window */
+struct xfer_slot {
+    int acked;
+    unsigned tries;
+    unsigned passed;    /* acks for chunks sent after this one */
+    uint64_t sent_us;
+};
+
+/* 'A': mark what it covers and slide the window base past acked chunks.
+   A chunk that XFER_FAST_RESEND later-sent chunks have overtaken was lost
+   (bad CRC) and is made due at once instead of stalling the window for a
+   whole retransmit timeout. */
+static void xfer_ack(struct xfer_slot *slots, uint32_t window, uint32_t *base, uint32_t next,
+                     const unsigned char *msg, size_t len) {
+    if (len != 9 || msg[0] != 'A') return;
+    uint32_t held = get_be32(msg + 1), idx = get_be32(msg + 5);
+    for (uint32_t i = *base; i < next && i < held; i++) slots[i % window].acked = 1;
+    if (idx >= *base && idx < next && !slots[idx % window].acked) {
+        struct xfer_slot *s = &slots[idx % window];
+        s->acked = 1;
+        for (uint32_t i = *base; i < idx; i++) {
+            struct xfer_slot *c = &slots[i % window];
+            if (!c->acked && c->sent_us < s->sent_us && ++c->passed == XFER_FAST_RESEND) c->sent_us = 0;
+        }
+    }
+    while (*base < next && slots[*base % window].acked) (*base)++;
+}
+
+int xfer_send_file(int fd, const char *path, int window, const struct read_timeouts *to,
+                   struct xfer_report *rep) {
+    memset(rep, 0, sizeof(*rep));
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        log_error("Cannot open %s", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+        log_error("%s is not a regular file", path);
+        close(file);
+        return -1;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    uint64_t nchunks = (size + XFER_CHUNK - 1) / XFER_CHUNK;
+    if (nchunks > UINT32_MAX || size > SIZE_MAX) {
+        log_error("%s is too large to send", path);
+        close(file);
+        return -1;
+    }
+    /* chunks are framed straight out of the page cache */
+    const unsigned char *map = NULL;
+    if (size > 0) {
+        void *m = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, file, 0);
+        if (m == MAP_FAILED) {
+            log_error("Cannot map %s", path);
+            close(file);
+            return -1;
+        }
+        map = m;
+        madvise(m, (size_t)size, MADV_SEQUENTIAL);
+    }
+    close(file);
+    rep->size = size;
+
+    int ret = -1;
+    uint32_t w = (uint32_t)window;
+    struct xfer_slot *slots = calloc(w, sizeof(*slots));
+    unsigned char *frame = malloc(5 + XFER_CHUNK);
+    struct rx_carry carry = {0};
+    struct tx_queue tx = {0};
+    char *msg = NULL;
+    size_t len = 0;
+    if (!slots || !frame) {
+        log_error("Out of memory for transfer window");
+        goto out;
+    }
+
+    uint64_t start = now_us();
+    unsigned char offer[13] = {'S'};
+    put_be64(offer + 1, size);
+    put_be32(offer + 9, XFER_CHUNK);
+    if (xfer_exchange(fd, &carry, offer, sizeof(offer), 'R', to->total_ms, &msg, &len) != 0) goto out;
+    uint64_t offset = len == 9 ? get_be64((unsigned char *)msg + 1) : 0;
+    free(msg);
+    msg = NULL;
+    if (offset > size) offset = size;
+    uint32_t base = (uint32_t)(offset / XFER_CHUNK), next = base;
+    rep->resumed_at = (uint64_t)base * XFER_CHUNK;
+    log_info("Sending %s: %llu bytes in %llu chunks from offset %llu, window %d", path,
+             (unsigned long long)size, (unsigned long long)nchunks, (unsigned long long)rep->resumed_at, window);
+
+    /* a full window may sit queued ahead of any chunk, so its timeout
+       allows for that much line time plus the device's turnaround */
+    uint64_t rto = chunk_wire_us(XFER_CHUNK) * (w + 2) + XFER_RTO_SLACK_MS * 1000u;
+    struct read_timeouts frame_to = { .total_ms = (long)(chunk_wire_us(XFER_CHUNK) / 1000) + 100 };
+
+    while (base < nchunks) {
+        uint64_t now = now_us();
+        if (tx.left == 0) {
+            /* oldest expired chunk first, then new data while the window has room */
+            struct xfer_slot *s = NULL;
+            uint32_t idx;
+            for (idx = base; idx < next; idx++) {
+                struct xfer_slot *c = &slots[idx % w];
+                if (!c->acked && now - c->sent_us >= rto) { s = c; break; }
+            }
+            if (s) {
+                if (s->tries >= XFER_MAX_TRIES) {
+                    errno = 0;
+                    log_error("Chunk %u unacknowledged after %d sends", idx, XFER_MAX_TRIES);
+                    goto out;
+                }
+                rep->resent++;
+                log_trace("xfer: resending chunk %u", idx);
+            } else if (next < nchunks && next - base < w) {
+                idx = next++;
+                s = &slots[idx % w];
+                *s = (struct xfer_slot){0};
+            }
+            if (s) {
+                uint64_t off = (uint64_t)idx * XFER_CHUNK;
+                size_t n = size - off < XFER_CHUNK ? (size_t)(size - off) : XFER_CHUNK;
+                frame[0] = 'D';
+                put_be32(frame + 1, idx);
+                memcpy(frame + 5, map + off, n);
+                tx_queue_free(&tx);
+                if (tx_queue_request(&tx, (const char *)frame, 5 + n) != 0 || tx_start(fd, &tx) != 0) goto out;
+                s->tries++;
+                s->passed = 0;
+                s->sent_us = now;
+                continue;
+            }
+        }
+
+        /* wait for an ack, room to write, or the earliest retransmit */
+        int timeout_ms = (int)to->total_ms;
+        if (tx.left == 0) {
+            uint64_t due = UINT64_MAX;
+            for (uint32_t i = base; i < next; i++)
+                if (!slots[i % w].acked && slots[i % w].sent_us + rto < due) due = slots[i % w].sent_us + rto;
+            timeout_ms = due > now ? (int)((due - now + 999) / 1000) : 0;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN | (tx.left ? POLLOUT : 0) };
+        int pr = carry.len > 0 ? 1 : poll(&pfd, 1, timeout_ms);
+        if (pr < 0) {
+            if (errno == EINTR) continue;
+            log_error("poll() failed during transfer");
+            goto out;
+        }
+        if (pr == 0) {
+            if (tx.left) {
+                errno = 0;
+                log_error("Transmit stalled for %ld ms", to->total_ms);
+                goto out;
+            }
+            continue;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            errno = 0;
+            log_error("Device went away during transfer");
+            goto out;
+        }
+        if ((pfd.revents & POLLOUT) && tx_pump(fd, &tx) != 0) goto out;
+        if ((pfd.revents & POLLIN) || carry.len > 0) {
+            int r = read_response(fd, &frame_to, &carry, &tx, &msg, &len);
+            if (r == 0) xfer_ack(slots, w, &base, next, (unsigned char *)msg, len);
+            free(msg);
+            msg = NULL;
+        }
+    }
+    if (tx_finish(fd, &tx) != 0) goto out;
+    rep->elapsed_us = now_us() - start;
+
+    unsigned char end[5] = {'E'};
+    put_be32(end + 1, size > 0 ? uart_crc32c(0, map, (size_t)size) : 0);
+    if (xfer_exchange(fd, &carry, end, sizeof(end), 'F', to->total_ms, &msg, &len) != 0) goto out;
+    if (len == 2 && msg[1] == 1) ret = 0;
+    else log_error("Receiver reports a CRC mismatch over the whole file");
+
+out:
+    if (tx.left) tx_finish(fd, &tx);
+    tx_queue_free(&tx);
+    free(msg);
+    free(carry.data);
+    free(frame);
+    free(slots);
+    if (map) munmap((void *)map, (size_t)size);
+    return ret;
+}
+
+static void xfer_reply(int fd, const unsigned char *msg, size_t len) {
+    if (send_framed(fd, (const char *)msg, len, 0) != 0) log_warning("Failed to send '%c'", msg[0]);
+}
+
+int xfer_recv_file(int fd, const char *path, const struct read_timeouts *to,
+                   struct xfer_report *rep) {
+    memset(rep, 0, sizeof(*rep));
+    char part[PATH_MAX];
+    if (snprintf(part, sizeof(part), "%s.part", path) >= (int)sizeof(part)) {
+        log_error("Path too long: %s", path);
+        return -1;
+    }
+    int file = open(part, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) != 0) {
+        log_error("Cannot open %s", part);
+        if (file >= 0) close(file);
+        return -1;
+    }
+
+    int ret = -1;
+    unsigned char *map = NULL, *have = NULL;
+    uint64_t size = 0, held = 0, nchunks = 0;
+    uint32_t chunk = XFER_CHUNK;
+    struct rx_carry carry = {0};
+    char *msg = NULL;
+    size_t len = 0;
+
+    /* what an earlier run left in the .part file is offered for resume */
+    unsigned char ask[9] = {'G'};
+    put_be64(ask + 1, (uint64_t)st.st_size);
+    if (xfer_exchange(fd, &carry, ask, sizeof(ask), 'S', to->total_ms, &msg, &len) != 0) goto out;
+    if (len != 13) {
+        log_error("Malformed file offer (%zu bytes)", len);
+        goto out;
+    }
+    size = get_be64((unsigned char *)msg + 1);
+    chunk = get_be32((unsigned char *)msg + 9);
+    free(msg);
+    msg = NULL;
+    nchunks = chunk ? (size + chunk - 1) / chunk : 0;
+    if (chunk == 0 || chunk > XFER_MAX_CHUNK || nchunks > UINT32_MAX || size > SIZE_MAX) {
+        log_error("Unsupported file offer: %llu bytes in %u-byte chunks", (unsigned long long)size, chunk);
+        goto out;
+    }
+    rep->size = size;
+
+    uint64_t resume = (uint64_t)st.st_size < size ? (uint64_t)st.st_size : size;
+    held = resume / chunk;
+    rep->resumed_at = held * chunk;
+    have = calloc((size_t)(nchunks / 8 + 1), 1);
+    if (!have) {
+        log_error("Out of memory for chunk map");
+        goto out;
+    }
+    for (uint64_t i = 0; i < held; i++) have[i / 8] |= (unsigned char)(1u << (i % 8));
+    if (ftruncate(file, (off_t)size) != 0) {
+        log_error("Cannot size %s to %llu bytes", part, (unsigned long long)size);
+        goto out;
+    }
+    /* chunks land in the page cache directly, in whatever order they arrive */
+    if (size > 0) {
+        void *m = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (m == MAP_FAILED) {
+            log_error("Cannot map %s", part);
+            goto out;
+        }
+        map = m;
+    }
+    log_info("Receiving %s: %llu bytes in %llu chunks from offset %llu", path,
+             (unsigned long long)size, (unsigned long long)nchunks, (unsigned long long)rep->resumed_at);
+
+    unsigned char resume_at[9] = {'R'};
+    put_be64(resume_at + 1, rep->resumed_at);
+    xfer_reply(fd, resume_at, sizeof(resume_at));
+
+    /* reads are cut at a few chunk times so a corrupted length cannot swallow
+       the stream for long; idleness is judged across reads */
+    struct read_timeouts frame_to = { .total_ms = (long)(chunk_wire_us(chunk) * 4 / 1000) + 100 };
+    uint64_t start = now_us(), last_frame = start;
+    int errors = 0;
+    for (;;) {
+        int r = read_response(fd, &frame_to, &carry, NULL, &msg, &len);
+        const unsigned char *m = (const unsigned char *)msg;
+        if (r == 1 || (r == 0 && len == 0)) {
+            free(msg);
+            msg = NULL;
+            if (now_us() - last_frame >= (uint64_t)to->total_ms * 1000u) {
+                errno = 0;
+                log_error("Sender silent for %ld ms", to->total_ms);
+                goto out;
+            }
+            continue;
+        }
+        if (r < 0) {
+            if (++errors > XFER_MAX_ERRORS) {
+                log_error("Too many bad frames in a row");
+                goto out;
+            }
+            continue;
+        }
+        errors = 0;
+        last_frame = now_us();
+
+        if (m[0] == 'S') {
+            xfer_reply(fd, resume_at, sizeof(resume_at));   /* our 'R' was lost */
+        } else if (m[0] == 'D' && len >= 5) {
+            uint32_t idx = get_be32(m + 1);
+            uint64_t off = (uint64_t)idx * chunk;
+            size_t n = idx < nchunks ? (size_t)(size - off < chunk ? size - off : chunk) : 0;
+            if (idx >= nchunks || len - 5 != n) {
+                log_warning("Ignoring malformed chunk %u (%zu bytes)", idx, len - 5);
+            } else {
+                memcpy(map + off, m + 5, n);
+                have[idx / 8] |= (unsigned char)(1u << (idx % 8));
+                while (held < nchunks && (have[held / 8] >> (held % 8) & 1)) held++;
+                unsigned char ack[9] = {'A'};
+                put_be32(ack + 1, (uint32_t)held);
+                put_be32(ack + 5, idx);
+                xfer_reply(fd, ack, sizeof(ack));
+            }
+        } else if (m[0] == 'E' && len == 5) {
+            uint32_t crc = size > 0 ? uart_crc32c(0, map, (size_t)size) : 0;
+            unsigned char verdict[2] = {'F', held == nchunks && crc == get_be32(m + 1)};
+            xfer_reply(fd, verdict, sizeof(verdict));
+            if (!verdict[1]) {
+                errno = 0;
+                log_error("File CRC mismatch (%08x): discarding %s", crc, part);
+                unlink(part);
+                held = 0;
+                goto out;
+            }
+            rep->elapsed_us = now_us() - start;
+            break;
+        }
+        free(msg);
+        msg = NULL;
+    }
+
+    /* the sender repeats 'E' if our verdict got lost */
+    for (uint64_t until = now_us() + XFER_LINGER_MS * 1000u; now_us() < until;) {
+        struct read_timeouts linger = { .total_ms = XFER_LINGER_MS };
+        free(msg);
+        msg = NULL;
+        if (read_response(fd, &linger, &carry, NULL, &msg, &len) == 1) break;
+        if (len > 0 && msg[0] == 'E') {
+            unsigned char verdict[2] = {'F', 1};
+            xfer_reply(fd, verdict, sizeof(verdict));
+        }
+    }
+    if (rename(part, path) != 0) {
+        log_error("Cannot rename %s to %s", part, path);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (map) munmap(map, (size_t)size);
+    if (ret != 0 && held < nchunks) {
+        /* keep only the contiguous prefix so the next run can resume */
+        uint64_t keep = held * chunk < size ? held * chunk : size;
+        if (ftruncate(file, (off_t)keep) == 0 && keep > 0)
+            log_info("Kept %llu bytes in %s; run again to resume", (unsigned long long)keep, part);
+    }
+    close(file);
+    free(msg);
+    free(have);
+    free(carry.data);
+    return ret;
+}
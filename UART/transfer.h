@@ -0,0 +1,45 @@
+// transfer.h - bulk file transfer over binary frames with a sliding window
+#ifndef UART_TRANSFER_H
+#define UART_TRANSFER_H
+
+#include <stdint.h>
+
+#include "uart.h"
+
+#define XFER_CHUNK 1024          /* payload bytes per data frame */
+#define XFER_MAX_CHUNK 65536     /* largest chunk a receiver accepts */
+#define XFER_DEFAULT_WINDOW 8
+#define XFER_MAX_WINDOW 256
+
+/* one message per binary (or COBS) frame, integers big endian:
+     'S' u64 size, u32 chunk    sender offers the file
+     'R' u64 offset             receiver: send from offset (answers S)
+     'G' u64 offset             receiver: offer me the file (prompts an S)
+     'D' u32 index, data        chunk index, chunk bytes
+     'A' u32 next, u32 index    receiver: every chunk below next is held, and index too
+     'E' u32 crc                sender: all chunks acknowledged, CRC-32C of the file
+     'F' u8 ok                  receiver: whole-file CRC matched
+   A chunk whose frame fails its CRC is never acknowledged and only that
+   chunk is sent again once its retransmit timeout expires. The receiver
+   writes into <path>.part and leaves it cut to what it holds contiguously,
+   so an interrupted transfer picks up from there on the next run. */
+
+struct xfer_report {
+    uint64_t size;          /* file size */
+    uint64_t resumed_at;    /* offset this run started from */
+    uint64_t elapsed_us;    /* handshake to last acknowledgement */
+    unsigned long resent;   /* chunks sent more than once */
+};
+
+/* stream path to the device, keeping up to window chunks unacknowledged.
+   Handshake and end-of-file exchanges are retried for to->total_ms.
+   Returns 0 once the receiver confirmed the file, -1 otherwise. */
+int xfer_send_file(int fd, const char *path, int window, const struct read_timeouts *to,
+                   struct xfer_report *rep);
+
+/* receive a file from the device into path; gives up after to->total_ms
+   without a frame. Returns 0 with path in place, -1 otherwise. */
+int xfer_recv_file(int fd, const char *path, const struct read_timeouts *to,
+                   struct xfer_report *rep);
+
+#endif
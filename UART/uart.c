@@ -0,0 +1,1474 @@
+// uart.c - serial port setup, framing and response readers
+#define _GNU_SOURCE   /* ppoll() on glibc */
+#include "uart.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/termios.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "capture.h"
+#include "cobs.h"
+#include "compress.h"
+#include "log.h"
+#include "rxthread.h"
+
+struct Config conf;
+struct io_stats io_stats;
+
+/* set blocking or non-blocking on fd */
+int set_blocking(int fd, int blocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    if (!blocking)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* monotonic clock in microseconds; immune to wall-clock jumps */
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+void io_stats_reset(void) {
+    int64_t open_us = io_stats.open_us;
+    memset(&io_stats, 0, sizeof(io_stats));
+    io_stats.open_us = open_us;
+    io_stats.write_us = io_stats.drain_us = -1;
+    io_stats.first_byte_us = io_stats.marker_us = -1;
+}
+
+/* a read is starting; carried-over bytes count as arriving at once */
+static void stats_rx_begin(uint64_t start, size_t pending) {
+    io_stats.rx_start = start;
+    if (pending > 0 && io_stats.first_byte_us < 0) io_stats.first_byte_us = 0;
+}
+
+/* -C: a copy of every byte actually written or read goes to the capture */
+static void tap(int dir, const struct iovec *iov, int iovcnt, ssize_t n) {
+    if (conf.capture && n > 0) capture_record_iov(conf.capture, dir, 0, iov, iovcnt, (size_t)n);
+}
+
+static void tap_buf(int dir, const void *buf, ssize_t n) {
+    if (conf.capture && n > 0) capture_record(conf.capture, dir, 0, buf, (size_t)n);
+}
+
+/* account for one read syscall returning r */
+static void stats_rx_read(ssize_t r) {
+    io_stats.read_calls++;
+    if (r <= 0) return;
+    io_stats.bytes_in += (size_t)r;
+    if (io_stats.first_byte_us < 0) io_stats.first_byte_us = (int64_t)(now_us() - io_stats.rx_start);
+}
+
+static void stats_rx_done(void) {
+    io_stats.marker_us = (int64_t)(now_us() - io_stats.rx_start);
+}
+
+/* poll() until deadline (now_us() clock, 0 = none). ppoll() keeps
+   microsecond timers exact on Linux; elsewhere the wait is rounded up to
+   whole milliseconds, never waking early. Returns as poll(), EINTR included. */
+int poll_deadline(struct pollfd *pfds, nfds_t n, uint64_t deadline) {
+    if (!deadline) return poll(pfds, n, -1);
+    uint64_t now = now_us();
+    uint64_t left = deadline > now ? deadline - now : 0;
+#ifdef __linux__
+    struct timespec ts = { .tv_sec = (time_t)(left / 1000000u), .tv_nsec = (long)(left % 1000000u) * 1000 };
+    return ppoll(pfds, n, &ts, NULL);
+#else
+    uint64_t ms = (left + 999) / 1000;
+    return poll(pfds, n, ms > INT_MAX ? INT_MAX : (int)ms);
+#endif
+}
+
+/* wait until fd is ready for events or the deadline (now_us() clock, 0 = none)
+   passes. Returns 1 when ready, 0 on timeout, -1 on error; EINTR is retried. */
+int wait_ready(int fd, short events, uint64_t deadline) {
+    for (;;) {
+        if (deadline && now_us() >= deadline) return 0;
+        struct pollfd pfd = { .fd = fd, .events = events };
+        int n = poll_deadline(&pfd, 1, deadline);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            if (deadline && now_us() < deadline) continue;
+            return 0;
+        }
+        /* POLLHUP/POLLERR also count: the next read/write reports them */
+        return 1;
+    }
+}
+
+static int port_open(const char *path, long baud_rate, int quiet) {
+    log_trace("serial_port_open: Opening Serial Port {%s} at %ld baud", path, baud_rate);
+
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        if (quiet) return -1;
+        log_error("Failed to open device serial path: %s", path);
+        perror("open");
+        return -1;
+    }
+
+    /* raw 8N1; unchanged attributes are not rewritten, which matters on reopen */
+    int r = uart_configure(fd, baud_rate, conf.keep_input);
+    if (r < 0) {
+        if (errno == ENOTTY) log_error("The given device path is not a TTY: %s", path);
+        else if (errno == EINVAL) log_error("Unsupported baud rate %ld on this platform", baud_rate);
+        else {
+            log_error("Failed to configure %s at %ld baud", path, baud_rate);
+            perror("uart_configure");
+        }
+        close(fd);
+        return -1;
+    }
+    if (r == 1) log_trace("serial_port_open: attributes already in place, tcsetattr skipped");
+
+    log_info("Serial port %s opened (fd=%d)", path, fd);
+    return fd;
+}
+
+int serial_port_open(const char *path, long baud_rate) {
+    return port_open(path, baud_rate, 0);
+}
+
+/* the tty was hung up (adapter unplugged, driver gone) */
+int serial_port_lost(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = 0 };
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) return 1;
+    struct termios t;
+    return tcgetattr(fd, &t) != 0 && (errno == EIO || errno == ENXIO || errno == ENODEV || errno == EBADF);
+}
+
+/* retry the open until the device node is back or window_ms runs out */
+int serial_port_reconnect(const char *path, long baud_rate, long window_ms) {
+    uint64_t start = now_us();
+    uint64_t deadline = start + (uint64_t)window_ms * 1000u;
+    log_warning("Lost %s; reconnecting for up to %ld ms", path, window_ms);
+    for (;;) {
+        int fd = port_open(path, baud_rate, 1);
+        if (fd >= 0) {
+            errno = 0;
+            log_info("Reconnected to %s after %llu ms", path, (unsigned long long)((now_us() - start) / 1000u));
+            return fd;
+        }
+        if (now_us() >= deadline) break;
+        usleep(RECONNECT_POLL_MS * 1000);
+    }
+    log_error("Gave up reconnecting to %s", path);
+    return -1;
+}
+
+/* -L wakeups: a read returns once this many bytes are in, or after a
+   VTIME (tenths of a second) gap */
+#define TUNE_WAKEUP_VMIN 64
+#define TUNE_WAKEUP_VTIME 1
+/* ms; the FTDI driver default, restored in wakeups mode since the sysfs
+   value outlives this process */
+#define FTDI_LATENCY_DEFAULT_MS 16
+
+/* driver low-latency flag: skip the tty layer's deferred flip-buffer push */
+static int tune_low_latency(int fd, int on) {
+#if defined(__linux__) && defined(TIOCSSERIAL)
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) != 0) return 0;   /* not a UART driver (pty, cdc-acm...) */
+    if (on) ss.flags |= ASYNC_LOW_LATENCY;
+    else ss.flags &= ~ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &ss) == 0 ? 1 : -1;
+#elif defined(__APPLE__) && defined(IOSSDATALAT)
+    if (!on) return 0;
+    unsigned long us = 1;   /* receive latency in microseconds */
+    return ioctl(fd, IOSSDATALAT, &us) == 0 ? 1 : -1;
+#else
+    (void)fd; (void)on;
+    return 0;
+#endif
+}
+
+/* FTDI adapters hold partial USB packets for latency_timer ms (16 by default) */
+static int tune_latency_timer(const char *path, int ms, int *now_ms) {
+    *now_ms = -1;
+#ifdef __linux__
+    char real[PATH_MAX], attr[PATH_MAX + 64];
+    if (!realpath(path, real)) return 0;
+    const char *name = strrchr(real, '/');
+    snprintf(attr, sizeof(attr), "/sys/class/tty/%s/device/latency_timer", name ? name + 1 : real);
+
+    FILE *f = fopen(attr, "r");
+    if (!f) return 0;   /* not an FTDI port */
+    if (fscanf(f, "%d", now_ms) != 1) *now_ms = -1;
+    fclose(f);
+    if (*now_ms == ms) return 1;
+
+    f = fopen(attr, "w");
+    if (!f) return -1;   /* usually needs root or a udev rule */
+    int ok = fprintf(f, "%d\n", ms) > 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) return -1;
+    *now_ms = ms;
+    return 1;
+#else
+    (void)path; (void)ms;
+    return 0;
+#endif
+}
+
+/* apply the -L mode to an open port; every knob is best effort and the
+   outcome of each is reported in rep (may be NULL). Returns 0 unless the
+   termios settings could not be applied. */
+int serial_port_tune(int fd, const char *path, enum rx_tuning mode, struct port_tuning *rep) {
+    struct port_tuning r = { .latency_timer_ms = -1 };
+    int latency = mode == RX_TUNING_LATENCY;
+    if (mode == RX_TUNING_DEFAULT) {
+        if (rep) *rep = r;
+        return 0;
+    }
+
+    r.low_latency = tune_low_latency(fd, latency);
+    r.latency_timer = tune_latency_timer(path, latency ? 1 : FTDI_LATENCY_DEFAULT_MS, &r.latency_timer_ms);
+
+    r.vmin = latency ? 1 : TUNE_WAKEUP_VMIN;
+    r.vtime = latency ? 0 : TUNE_WAKEUP_VTIME;
+    struct termios tty;
+    r.termios = -1;
+    if (tcgetattr(fd, &tty) == 0) {
+        tty.c_cc[VMIN] = (cc_t)r.vmin;
+        tty.c_cc[VTIME] = (cc_t)r.vtime;
+        if (tcsetattr(fd, TCSANOW, &tty) == 0) r.termios = 1;
+    }
+
+    char desc[160];
+    port_tuning_describe(&r, desc, sizeof(desc));
+    errno = 0;   /* missing knobs are expected; keep their ENOENT/ENOTTY out of the log */
+    log_info("%s tuned for %s: %s", path, latency ? "latency" : "wakeups", desc);
+    if (r.termios < 0) log_error("Failed to set VMIN/VTIME on %s", path);
+    if (rep) *rep = r;
+    return r.termios < 0 ? -1 : 0;
+}
+
+void port_tuning_describe(const struct port_tuning *rep, char *buf, size_t n) {
+    static const char *state[] = {"refused", "n/a", "applied"};
+    char timer[32] = "";
+    if (rep->latency_timer_ms >= 0) snprintf(timer, sizeof(timer), " (%d ms)", rep->latency_timer_ms);
+    snprintf(buf, n, "low-latency flag %s, FTDI latency_timer %s%s, VMIN=%d VTIME=%d %s",
+             state[rep->low_latency + 1], state[rep->latency_timer + 1], timer,
+             rep->vmin, rep->vtime, state[rep->termios + 1]);
+}
+
+/* account for n written bytes: drop the iovecs that went out whole and
+   trim the one cut short */
+void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/* gather-write util: writes every iovec fully, resuming after partial writes,
+   until deadline (now_us() clock, 0 = none). A blocking fd is switched to
+   non-blocking meanwhile so the deadline holds. The iov array is consumed
+   (advanced in place). Returns the total, or -1 with errno ETIMEDOUT once
+   the deadline passes. */
+ssize_t writev_all(int fd, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    int flags = deadline ? fcntl(fd, F_GETFL, 0) : -1;
+    if (flags >= 0 && !(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) flags = -1;
+    ssize_t ret = (ssize_t)total;
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* full output buffer: resume as soon as it drains */
+                io_stats.eagain_retries++;
+                int ready = wait_ready(fd, POLLOUT, deadline);
+                if (ready > 0) continue;
+                if (ready == 0) errno = ETIMEDOUT;
+            }
+            ret = -1;
+            break;
+        }
+        tap(CAPTURE_TX, iov, iovcnt, n);
+        iov_advance(&iov, &iovcnt, (size_t)n);
+    }
+    if (flags >= 0 && !(flags & O_NONBLOCK)) {
+        int saved = errno;
+        fcntl(fd, F_SETFL, flags);
+        errno = saved;
+    }
+    return ret;
+}
+
+/* write data util */
+ssize_t write_all(int fd, const void *buf, size_t count, uint64_t deadline) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+    return writev_all(fd, &iov, 1, deadline);
+}
+
+/* write a prepared frame and optionally wait for it to leave the UART */
+int transmit(int dev_handle, struct iovec *iov, int iovcnt, size_t total, int drain) {
+    uint64_t t0 = now_us();
+    if (writev_all(dev_handle, iov, iovcnt, tx_deadline(t0, total)) != (ssize_t)total) {
+        if (errno == ETIMEDOUT) {
+            errno = 0;
+            log_error("Timed out sending to device, %zu bytes", total);
+        } else {
+            log_error("Failed to write full message to device");
+        }
+        return -1;
+    }
+    uint64_t t1 = now_us();
+    io_stats.write_us = (int64_t)(t1 - t0);
+    io_stats.bytes_out += total;
+    if (!drain) {
+        log_trace("Message queued (%zu bytes)", total);
+        return 0;
+    }
+    int drained = tcdrain(dev_handle);
+    io_stats.drain_us = (int64_t)(now_us() - t1);
+    if (drained != 0) {
+        log_warning("tcdrain returned error (errno=%d)", errno);
+    } else {
+        log_info("Message sent and drained successfully (%zu bytes)", total);
+    }
+    return 0;
+}
+
+/* write one frame: START marker, optional tag (e.g. a sequence header),
+   payload, END marker. drain=1 waits in tcdrain() until it is on the wire.
+   Returns 0 once the whole frame is written, -1 on failure. */
+int send_frame(int dev_handle, const char *tag, size_t tag_len,
+               const char *message, size_t msg_len, int drain) {
+    struct tx_queue q;
+    tx_queue_text(&q, tag, tag_len, message, msg_len);
+    return transmit(dev_handle, q.iov, q.count, q.left, drain);
+}
+
+/* lay out a text frame in q: header, payload and trailer go out in one
+   writev, no staging copy. q points into itself; do not copy it. */
+void tx_queue_text(struct tx_queue *q, const char *tag, size_t tag_len, const char *message, size_t msg_len) {
+    int n = 0;
+    q->iov[n++] = (struct iovec){ .iov_base = (void *)UART_COM_START, .iov_len = UART_COM_START_LEN };
+    if (tag_len > 0)
+        q->iov[n++] = (struct iovec){ .iov_base = (void *)tag, .iov_len = tag_len };
+    q->iov[n++] = (struct iovec){ .iov_base = (void *)message, .iov_len = msg_len };
+    q->iov[n++] = (struct iovec){ .iov_base = (void *)UART_COM_END, .iov_len = UART_COM_END_LEN };
+    q->owned = NULL;
+    q->first = 0;
+    q->count = n;
+    q->left = UART_COM_START_LEN + tag_len + msg_len + UART_COM_END_LEN;
+}
+
+/* one request frame in the configured framing */
+int tx_queue_request(struct tx_queue *q, const char *message, size_t msg_len) {
+    if (conf.framing == FRAMING_BINARY) return tx_queue_binary(q, message, msg_len);
+    if (conf.framing == FRAMING_COBS) return tx_queue_cobs(q, message, msg_len);
+    tx_queue_text(q, NULL, 0, message, msg_len);
+    return 0;
+}
+
+/* write as much of q as the fd takes right now. Returns 0 (q->left says
+   what remains), -1 on error. The fd must be non-blocking. */
+int tx_pump(int fd, struct tx_queue *q) {
+    while (q->left > 0) {
+        ssize_t n = writev(fd, q->iov + q->first, q->count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                io_stats.eagain_retries++;
+                errno = 0;
+                return 0;
+            }
+            log_error("Failed to write full message to device");
+            return -1;
+        }
+        struct iovec *iov = q->iov + q->first;
+        int cnt = q->count;
+        tap(CAPTURE_TX, iov, cnt, n);
+        iov_advance(&iov, &cnt, (size_t)n);
+        q->first = (int)(iov - q->iov);
+        q->count = cnt;
+        q->left -= (size_t)n;
+        io_stats.bytes_out += (size_t)n;
+    }
+    io_stats.write_us = (int64_t)(now_us() - q->start);
+    set_blocking(fd, 1);
+    return 0;
+}
+
+/* when a send of len bytes begun at start must be done: its wire time at
+   conf.baud_rate (10 bits per byte) plus TX_SLACK_MS for flow control */
+uint64_t tx_deadline(uint64_t start, size_t len) {
+    uint64_t wire = conf.baud_rate > 0 ? (uint64_t)len * 10u * 1000000u / (uint64_t)conf.baud_rate : 0;
+    return start + wire + (uint64_t)TX_SLACK_MS * 1000u;
+}
+
+/* the port stopped taking the frame; reported once per frame */
+static void tx_timed_out(struct tx_queue *q) {
+    if (!q->expired) {
+        errno = 0;
+        log_error("Timed out sending to device, %zu bytes not written", q->left);
+    }
+    q->expired = 1;
+}
+
+/* begin a full-duplex send: the fd goes non-blocking while q is pending
+   and the readers below keep writing it whenever the fd has room, so the
+   reply is read while the frame is still going out and no tcdrain() is
+   needed. The fd is blocking again once q is empty. */
+int tx_start(int fd, struct tx_queue *q) {
+    q->start = now_us();
+    q->deadline = tx_deadline(q->start, q->left);
+    q->expired = 0;
+    if (set_blocking(fd, 0) != 0) return -1;
+    return tx_pump(fd, q);
+}
+
+/* push out whatever the reader left unsent (e.g. the reply came early) */
+int tx_finish(int fd, struct tx_queue *q) {
+    while (q->left > 0) {
+        int ready = wait_ready(fd, POLLOUT, q->deadline);
+        if (ready == 0) tx_timed_out(q);
+        if (ready <= 0 || tx_pump(fd, q) != 0) {
+            set_blocking(fd, 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void tx_coalesce_init(struct tx_coalesce *c, size_t limit, uint64_t delay_us) {
+    memset(c, 0, sizeof(*c));
+    c->limit = limit;
+    c->delay_us = delay_us;
+}
+
+int tx_coalesce_add(struct tx_coalesce *c, size_t n, uint64_t now) {
+    if (c->frames++ == 0) c->oldest_us = now;
+    c->bytes += n;
+    return c->bytes >= c->limit;
+}
+
+uint64_t tx_coalesce_deadline(const struct tx_coalesce *c) {
+    if (c->frames == 0) return 0;
+    return c->limit ? c->oldest_us + c->delay_us : c->oldest_us;
+}
+
+void tx_coalesce_release(struct tx_coalesce *c, enum tx_flush_reason why) {
+    if (c->frames == 0) return;
+    c->total_bytes += c->bytes;
+    c->total_frames += c->frames;
+    c->batches++;
+    if (c->frames > c->max_frames) c->max_frames = c->frames;
+    c->released[why]++;
+    c->bytes = 0;
+    c->frames = 0;
+}
+
+void tx_coalesce_describe(const struct tx_coalesce *c, char *buf, size_t n) {
+    snprintf(buf, n, "%lu frames (%llu bytes) in %lu writes, %.1f per write (max %lu); "
+             "released %lu full, %lu by timer, %lu idle",
+             c->total_frames, (unsigned long long)c->total_bytes, c->batches,
+             c->batches ? (double)c->total_frames / (double)c->batches : 0.0, c->max_frames,
+             c->released[TX_FLUSH_SIZE], c->released[TX_FLUSH_TIMER], c->released[TX_FLUSH_IDLE]);
+}
+
+int tx_batch_add(struct tx_batch *b, const struct tx_queue *q) {
+    if (b->len + q->left > b->cap) {
+        size_t ncap = b->cap ? b->cap : TX_COALESCE_DEFAULT_BYTES;
+        while (ncap < b->len + q->left) ncap *= 2;
+        char *nb = realloc(b->buf, ncap);
+        if (!nb) return -1;
+        b->buf = nb;
+        b->cap = ncap;
+    }
+    for (int i = q->first; i < q->first + q->count; i++) {
+        memcpy(b->buf + b->len, q->iov[i].iov_base, q->iov[i].iov_len);
+        b->len += q->iov[i].iov_len;
+    }
+    return tx_coalesce_add(&b->policy, q->left, now_us());
+}
+
+int tx_batch_flush(int fd, struct tx_batch *b, enum tx_flush_reason why) {
+    if (b->len == 0) return 0;
+    log_trace("tx batch: %lu frames, %zu bytes in one write", b->policy.frames, b->len);
+    struct iovec iov = { .iov_base = b->buf, .iov_len = b->len };
+    int r = transmit(fd, &iov, 1, b->len, 0);
+    tx_coalesce_release(&b->policy, why);
+    b->len = 0;
+    return r;
+}
+
+void tx_batch_free(struct tx_batch *b) {
+    free(b->buf);
+    b->buf = NULL;
+    b->len = b->cap = 0;
+}
+
+/* wait for reply data, servicing a pending tx meanwhile. The response
+   deadlines only run once the frame is fully written, as they did after
+   tcdrain(): sending restarts *start and *last_rx when it completes, and
+   a send still unfinished at tx->deadline is a timeout.
+   Returns 1 when readable, 0 on timeout, -1 on error. */
+static int rx_wait(int fd, struct tx_queue *tx, const struct read_timeouts *to,
+                   uint64_t *start, uint64_t *last_rx, int have_data) {
+    /* with a reader thread, received data is announced on its pipe */
+    struct rx_thread *rt = conf.rx_thread;
+    while (tx && tx->left > 0) {
+        if (rt && rx_thread_arm(rt)) return 1;
+        struct pollfd pfd[2] = {
+            { .fd = fd, .events = rt ? POLLOUT : POLLIN | POLLOUT },
+            { .fd = rt ? rx_thread_fd(rt) : -1, .events = POLLIN },
+        };
+        int n = poll_deadline(pfd, 2, tx->deadline);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            if (now_us() < tx->deadline) continue;
+            tx_timed_out(tx);
+            return 0;
+        }
+        if (pfd[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+            if (tx_pump(fd, tx) != 0) return -1;
+            if (tx->left == 0) *start = *last_rx = now_us();
+        }
+        if ((pfd[0].revents | pfd[1].revents) & POLLIN) return 1;
+    }
+    if (rt && rx_thread_arm(rt)) return 1;
+    return wait_ready(rt ? rx_thread_fd(rt) : fd, POLLIN, rx_deadline(to, *start, *last_rx, have_data));
+}
+
+/* the port's receive side, from the reader thread's ring when there is one */
+static ssize_t rx_read(int fd, void *buf, size_t n) {
+    return conf.rx_thread ? rx_thread_read(conf.rx_thread, buf, n) : read(fd, buf, n);
+}
+
+static ssize_t rx_readv(int fd, const struct iovec *iov, int iovcnt) {
+    return conf.rx_thread ? rx_thread_readv(conf.rx_thread, iov, iovcnt) : readv(fd, iov, iovcnt);
+}
+
+void send_data_to_device(int dev_handle, const char *message, int length) {
+    if (dev_handle < 0) {
+        log_error("Invalid device handle in send_data_to_device");
+        return;
+    }
+
+    size_t msg_len = (length > 0) ? (size_t)length : strlen(message);
+    send_framed(dev_handle, message, msg_len, 1);
+}
+
+int marker_scanner_init(struct marker_scanner *sc, const char *marker) {
+    size_t len = strlen(marker);
+    if (len == 0 || len > MARKER_MAX_LEN) return -1;
+
+    sc->marker = marker;
+    sc->len = len;
+    sc->matched = 0;
+    sc->fail[0] = 0;
+    for (size_t i = 1, k = 0; i < len; i++) {
+        while (k > 0 && marker[i] != marker[k]) k = sc->fail[k - 1];
+        if (marker[i] == marker[k]) k++;
+        sc->fail[i] = k;
+    }
+    return 0;
+}
+
+/* feed n new bytes. Returns the offset within data just past the end of the
+   marker, or -1 if the marker has not completed yet. */
+ssize_t marker_scanner_feed(struct marker_scanner *sc, const char *data, size_t n) {
+    const char *m = sc->marker;
+    size_t k = sc->matched;
+    size_t i = 0;
+
+    while (i < n) {
+        if (k == 0) {
+            /* nothing pending: jump straight to the next candidate first byte */
+            const char *hit = memchr(data + i, m[0], n - i);
+            if (!hit) break;
+            i = (size_t)(hit - data);
+        }
+        while (k > 0 && data[i] != m[k]) k = sc->fail[k - 1];
+        if (data[i] == m[k]) k++;
+        i++;
+        if (k == sc->len) {
+            sc->matched = 0;
+            return (ssize_t)i;
+        }
+    }
+    sc->matched = k;
+    return -1;
+}
+
+/* Build the DFA: a trie of the patterns, then failure links in BFS order,
+   folding each missing edge into the failure state's edge so a scan never
+   follows a failure link. Bytes no pattern uses share class 0, which keeps
+   the table at states x (distinct pattern bytes + 1). */
+int term_set_build(struct term_set *ts, const char *const *patterns, int n) {
+    memset(ts, 0, sizeof(*ts));
+    if (n < 1 || n > TERM_MAX_PATTERNS) return -1;
+
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(patterns[i]);
+        if (len == 0 || len > MARKER_MAX_LEN) return -1;
+        ts->pattern[i] = patterns[i];
+        ts->len[i] = len;
+        total += len;
+        for (size_t j = 0; j < len; j++) {
+            unsigned char b = (unsigned char)patterns[i][j];
+            if (!ts->cls[b]) ts->cls[b] = (unsigned char)++ts->nclasses;
+        }
+    }
+    ts->n = n;
+    ts->nclasses++;
+
+    size_t max_states = total + 1;
+    size_t w = ts->nclasses;
+    ts->next = calloc(max_states * w, sizeof(*ts->next));
+    ts->out = malloc(max_states * sizeof(*ts->out));
+    ts->depth = calloc(max_states, sizeof(*ts->depth));
+    uint16_t *fail = calloc(max_states, sizeof(*fail));
+    uint16_t *queue = malloc(max_states * sizeof(*queue));
+    if (!ts->next || !ts->out || !ts->depth || !fail || !queue) {
+        free(fail);
+        free(queue);
+        term_set_free(ts);
+        return -1;
+    }
+    memset(ts->out, -1, max_states * sizeof(*ts->out));
+
+    /* trie; 0 doubles as "no edge" since nothing leads back to the root */
+    ts->nstates = 1;
+    for (int i = 0; i < n; i++) {
+        unsigned st = 0;
+        for (size_t j = 0; j < ts->len[i]; j++) {
+            uint16_t *e = &ts->next[st * w + ts->cls[(unsigned char)patterns[i][j]]];
+            if (!*e) {
+                ts->depth[ts->nstates] = (uint8_t)(j + 1);
+                *e = (uint16_t)ts->nstates++;
+            }
+            st = *e;
+        }
+        if (ts->out[st] < 0) ts->out[st] = (int8_t)i;   /* a duplicate reports the first */
+    }
+
+    size_t qh = 0, qt = 0;
+    for (unsigned c = 0; c < w; c++)
+        if (ts->next[c]) queue[qt++] = ts->next[c];   /* depth 1 fails to the root */
+    while (qh < qt) {
+        unsigned st = queue[qh++];
+        /* a shorter pattern ending inside a longer one still ends the frame */
+        if (ts->out[st] < 0) ts->out[st] = ts->out[fail[st]];
+        for (unsigned c = 0; c < w; c++) {
+            uint16_t *e = &ts->next[st * w + c];
+            uint16_t f = ts->next[fail[st] * w + c];
+            if (*e) {
+                fail[*e] = f;
+                queue[qt++] = *e;
+            } else {
+                *e = f;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+void term_set_free(struct term_set *ts) {
+    free(ts->next);
+    free(ts->out);
+    free(ts->depth);
+    ts->next = NULL;
+    ts->out = NULL;
+    ts->depth = NULL;
+}
+
+void term_scanner_init(struct term_scanner *sc, const struct term_set *ts) {
+    sc->set = ts;
+    sc->state = 0;
+}
+
+/* feed n new bytes. Returns the offset within data just past the first
+   pattern to complete (its index in *which), or -1 if none has yet. */
+ssize_t term_scanner_feed(struct term_scanner *sc, const char *data, size_t n, int *which) {
+    const struct term_set *ts = sc->set;
+    const unsigned char *p = (const unsigned char *)data;
+    size_t w = ts->nclasses;
+    unsigned st = sc->state;
+
+    for (size_t i = 0; i < n; i++) {
+        st = ts->next[st * w + ts->cls[p[i]]];
+        if (ts->out[st] >= 0) {
+            *which = ts->out[st];
+            sc->state = 0;
+            return (ssize_t)(i + 1);
+        }
+    }
+    sc->state = st;
+    return -1;
+}
+
+/* the readers' end-of-frame test: one marker (KMP), or a terminator set */
+struct rx_matcher {
+    struct marker_scanner kmp;
+    struct term_scanner ac;
+    int which;
+};
+
+static int rx_matcher_init(struct rx_matcher *m, const char *end_marker, const struct term_set *terms) {
+    m->which = 0;
+    term_scanner_init(&m->ac, terms);
+    return terms ? 0 : marker_scanner_init(&m->kmp, end_marker);
+}
+
+static ssize_t rx_matcher_feed(struct rx_matcher *m, const char *data, size_t n) {
+    if (m->ac.set) return term_scanner_feed(&m->ac, data, n, &m->which);
+    return marker_scanner_feed(&m->kmp, data, n);
+}
+
+/* trailing bytes that may still be the start of a terminator */
+static size_t rx_matcher_pending(const struct rx_matcher *m) {
+    return m->ac.set ? m->ac.set->depth[m->ac.state] : m->kmp.matched;
+}
+
+/* pull the sequence id out of a response's "[SEQ:<hex>]" tag */
+int frame_seq(const char *frame, size_t len, uint32_t *seq) {
+    struct marker_scanner sc;
+    marker_scanner_init(&sc, UART_COM_SEQ_PREFIX);
+    ssize_t at = marker_scanner_feed(&sc, frame, len);
+    if (at < 0) return -1;
+
+    uint32_t v = 0;
+    size_t i = (size_t)at, digits = 0;
+    for (; i < len && frame[i] != ']'; i++, digits++) {
+        char c = frame[i];
+        int d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+        else return -1;
+        if (digits >= 8) return -1;
+        v = (v << 4) | (uint32_t)d;
+    }
+    if (i == len || digits == 0) return -1;
+    *seq = v;
+    return 0;
+}
+
+/* nearest of the total, first-byte and inter-byte deadlines */
+uint64_t rx_deadline(const struct read_timeouts *to, uint64_t start, uint64_t last_rx, int have_data) {
+    uint64_t deadline = start + (uint64_t)to->total_ms * 1000u;
+    if (!have_data && to->first_byte_ms > 0) {
+        uint64_t d = start + (uint64_t)to->first_byte_ms * 1000u;
+        if (d < deadline) deadline = d;
+    }
+    if (have_data && to->inter_byte_ms > 0) {
+        uint64_t d = last_rx + (uint64_t)to->inter_byte_ms * 1000u;
+        if (d < deadline) deadline = d;
+    }
+    return deadline;
+}
+
+/* read until the end_marker is seen or a deadline in `to` expires.
+   Returns 0 on success (found marker), 1 on timeout (partial data in out_buf),
+   -1 on error. out_buf is malloc'd inside and must be free()'d by caller.
+   On success *out_len ends just past the marker, so the marker itself starts at
+   *out_len - strlen(end_marker). Bytes that arrived after the marker belong to
+   the next frame: they are moved into carry (dropped if carry is NULL), and
+   carry's contents are consumed first on the next call. A non-NULL tx is a
+   request still being sent (tx_start()); it is written as the fd drains.
+*/
+static int read_until_match(int fd, struct rx_matcher *sc, const struct read_timeouts *to,
+                            struct rx_carry *carry, struct tx_queue *tx, char **out_buf, size_t *out_len) {
+    const size_t CHUNK = 512;
+
+    size_t cap = CHUNK;
+    size_t len = 0;
+    if (carry && carry->len > 0) {
+        while (cap < carry->len + CHUNK) cap *= 2;
+    }
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+
+    ssize_t end = -1;
+    uint64_t start = now_us();
+    uint64_t last_rx = start;
+    stats_rx_begin(start, carry ? carry->len : 0);
+    if (carry && carry->len > 0) {
+        memcpy(buf, carry->data, carry->len);
+        len = carry->len;
+        carry->len = 0;
+        end = rx_matcher_feed(sc, buf, len);
+    }
+
+    while (end < 0) {
+        int ready = rx_wait(fd, tx, to, &start, &last_rx, len > 0);
+        if (ready < 0) {
+            free(buf);
+            return -1;
+        } else if (ready == 0) {
+            break; /* timeout */
+        }
+
+        /* read available data */
+        if (len + CHUNK > cap) {
+            cap *= 2;
+            char *nb = realloc(buf, cap);
+            if (!nb) { free(buf); return -1; }
+            buf = nb;
+        }
+        ssize_t r = rx_read(fd, buf + len, cap - len);
+        stats_rx_read(r);
+        tap_buf(CAPTURE_RX, buf + len, r);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* spurious wakeup: go back to waiting for readiness */
+                io_stats.eagain_retries++;
+                errno = 0;
+                continue;
+            }
+            free(buf);
+            return -1;
+        } else if (r == 0) {
+            /* EOF? break and return what we have */
+            break;
+        } else {
+            /* only the new bytes are scanned; partial matches carry over */
+            ssize_t hit = rx_matcher_feed(sc, buf + len, (size_t)r);
+            if (hit >= 0) end = (ssize_t)len + hit;
+            len += (size_t)r;
+            last_rx = now_us();
+            /* continue reading until timeout or marker */
+        }
+    }
+
+    if (end < 0) {
+        /* timeout: return partial data if any */
+        *out_buf = buf;
+        *out_len = len;
+        return 1;
+    }
+
+    stats_rx_done();
+    size_t extra = len - (size_t)end;
+    if (extra > 0 && carry) {
+        char *nd = realloc(carry->data, extra);
+        if (!nd) { free(buf); return -1; }
+        memcpy(nd, buf + end, extra);
+        carry->data = nd;
+        carry->len = extra;
+    } else if (extra > 0) {
+        log_warning("Dropping %zu bytes received after end marker", extra);
+    }
+
+    *out_buf = buf;
+    *out_len = (size_t)end;
+    return 0; /* found */
+}
+
+int read_until_marker(int fd, const char *end_marker, const struct read_timeouts *to,
+                      struct rx_carry *carry, struct tx_queue *tx, char **out_buf, size_t *out_len) {
+    struct rx_matcher m;
+    if (rx_matcher_init(&m, end_marker, NULL) != 0) {
+        log_error("read_until_marker: end marker must be 1..%d bytes", MARKER_MAX_LEN);
+        return -1;
+    }
+    return read_until_match(fd, &m, to, carry, tx, out_buf, out_len);
+}
+
+/* read_until_marker() ending at whichever pattern of terms completes first;
+   on success *which is its index and the frame ends just past it. */
+int read_until_term(int fd, const struct term_set *terms, const struct read_timeouts *to,
+                    struct rx_carry *carry, struct tx_queue *tx, char **out_buf, size_t *out_len, int *which) {
+    struct rx_matcher m;
+    rx_matcher_init(&m, NULL, terms);
+    int rc = read_until_match(fd, &m, to, carry, tx, out_buf, out_len);
+    *which = m.which;
+    return rc;
+}
+
+/* ---- ring-buffer receive path ---- */
+int rx_ring_init(struct rx_ring *ring, size_t cap) {
+    size_t c = 1024;
+    while (c < cap) c <<= 1;
+    ring->buf = malloc(c);
+    if (!ring->buf) return -1;
+    ring->cap = c;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+void rx_ring_free(struct rx_ring *ring) {
+    free(ring->buf);
+    ring->buf = NULL;
+    ring->cap = 0;
+    ring->head = ring->tail = 0;
+}
+
+/* split the ring range [from, to) into at most two contiguous segments */
+static int rx_ring_segments(const struct rx_ring *ring, uint64_t from, uint64_t to, struct iovec seg[2]) {
+    size_t mask = ring->cap - 1;
+    size_t len = (size_t)(to - from);
+    size_t off = (size_t)from & mask;
+    if (len == 0) return 0;
+    size_t first = ring->cap - off < len ? ring->cap - off : len;
+    seg[0] = (struct iovec){ .iov_base = ring->buf + off, .iov_len = first };
+    if (first == len) return 1;
+    seg[1] = (struct iovec){ .iov_base = ring->buf, .iov_len = len - first };
+    return 2;
+}
+
+/* hand [head, upto) to the consumer and release it */
+static int rx_ring_deliver(struct rx_ring *ring, uint64_t upto, rx_frame_fn on_frame, void *ctx,
+                           int last, size_t *frame_len) {
+    struct iovec seg[2];
+    int nseg = rx_ring_segments(ring, ring->head, upto, seg);
+    *frame_len += (size_t)(upto - ring->head);
+    ring->head = upto;
+    return on_frame(ctx, seg, nseg, last);
+}
+
+/* read_until_marker() over a bounded ring. The frame is handed to on_frame
+   as views into the ring (no copy); whatever follows the marker stays in
+   the ring for the next call. If the ring fills before the marker shows,
+   the bytes so far are handed over as a non-final piece, so memory stays
+   at the ring size. With stream set, every read is handed over as soon as
+   it is scanned, except the trailing bytes that may still turn out to be
+   the start of the marker; the marker itself therefore always arrives whole
+   at the end of the last piece. Returns 0 (marker seen), 1 (timeout/EOF, the partial
+   frame was delivered as last), -1 (error or consumer abort).
+   *frame_len is the total handed over. */
+static int read_until_match_ring(int fd, struct rx_matcher *sc, const struct read_timeouts *to,
+                                 struct rx_ring *ring, struct tx_queue *tx, int stream,
+                                 rx_frame_fn on_frame, void *ctx, size_t *frame_len) {
+    size_t mask = ring->cap - 1;
+    uint64_t scanned = ring->head;   /* leftover from the previous frame is scanned first */
+    uint64_t start = now_us();
+    uint64_t last_rx = start;
+    size_t got = (size_t)(ring->tail - ring->head);
+    *frame_len = 0;
+    stats_rx_begin(start, got);
+
+    for (;;) {
+        /* scan the unscanned part, one contiguous segment at a time */
+        while (scanned < ring->tail) {
+            size_t off = (size_t)scanned & mask;
+            size_t n = (size_t)(ring->tail - scanned);
+            if (n > ring->cap - off) n = ring->cap - off;
+            ssize_t hit = rx_matcher_feed(sc, ring->buf + off, n);
+            if (hit >= 0) {
+                stats_rx_done();
+                if (rx_ring_deliver(ring, scanned + (uint64_t)hit, on_frame, ctx, 1, frame_len) != 0) return -1;
+                return 0;
+            }
+            scanned += n;
+        }
+
+        size_t pending = rx_matcher_pending(sc);
+        if (stream && ring->tail - pending > ring->head) {
+            /* hold back only a possible marker prefix */
+            if (rx_ring_deliver(ring, ring->tail - pending, on_frame, ctx, 0, frame_len) != 0) return -1;
+        } else if (ring->tail - ring->head == ring->cap) {
+            /* full without a marker: pass the piece on; scanner state keeps any partial match */
+            if (rx_ring_deliver(ring, ring->tail, on_frame, ctx, 0, frame_len) != 0) return -1;
+        }
+
+        int ready = rx_wait(fd, tx, to, &start, &last_rx, got > 0);
+        if (ready < 0) {
+            return -1;
+        } else if (ready == 0) {
+            break; /* timeout */
+        }
+
+        /* fill all free space (both wrap segments) in one readv */
+        struct iovec seg[2];
+        int nseg = rx_ring_segments(ring, ring->tail, ring->head + ring->cap, seg);
+        ssize_t r = rx_readv(fd, seg, nseg);
+        stats_rx_read(r);
+        tap(CAPTURE_RX, seg, nseg, r);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                io_stats.eagain_retries++;
+                errno = 0;
+                continue;
+            }
+            return -1;
+        } else if (r == 0) {
+            /* EOF? break and return what we have */
+            break;
+        }
+        ring->tail += (uint64_t)r;
+        got += (size_t)r;
+        last_rx = now_us();
+    }
+
+    /* timeout: hand over the partial frame */
+    if (rx_ring_deliver(ring, ring->tail, on_frame, ctx, 1, frame_len) != 0) return -1;
+    return 1;
+}
+
+int read_until_marker_ring(int fd, const char *end_marker, const struct read_timeouts *to,
+                           struct rx_ring *ring, struct tx_queue *tx, int stream,
+                           rx_frame_fn on_frame, void *ctx, size_t *frame_len) {
+    struct rx_matcher m;
+    if (rx_matcher_init(&m, end_marker, NULL) != 0) {
+        log_error("read_until_marker_ring: end marker must be 1..%d bytes", MARKER_MAX_LEN);
+        return -1;
+    }
+    return read_until_match_ring(fd, &m, to, ring, tx, stream, on_frame, ctx, frame_len);
+}
+
+int read_until_term_ring(int fd, const struct term_set *terms, const struct read_timeouts *to,
+                         struct rx_ring *ring, struct tx_queue *tx, int stream,
+                         rx_frame_fn on_frame, void *ctx, size_t *frame_len, int *which) {
+    struct rx_matcher m;
+    rx_matcher_init(&m, NULL, terms);
+    int rc = read_until_match_ring(fd, &m, to, ring, tx, stream, on_frame, ctx, frame_len);
+    *which = m.which;
+    return rc;
+}
+
+/* ---- binary framing ----
+   SYNC | varint length (LEB128) | payload | CRC-32C (little endian)
+   The CRC covers the length bytes and the payload. Known lengths let the
+   reader allocate once and read exactly what the frame holds, and payloads
+   may contain anything, including the text markers.
+   A compressed frame has its own sync byte and the same layout; its
+   payload is varint raw length | LZ4 block.
+   The layout primitives are libuart's; what is here is the I/O around them. */
+#define BIN_SYNC_LZ4 0xA6
+#define BIN_FRAME_MIN (1 + 1 + UART_CRC_LEN)   /* sync, 1-byte length, empty payload, CRC */
+
+_Static_assert(sizeof(((struct tx_queue *)0)->hdr) >= 1 + UART_VARINT_MAX, "tx_queue hdr too small");
+_Static_assert(sizeof(((struct tx_queue *)0)->crc) == UART_CRC_LEN, "tx_queue crc size");
+
+/* LZ4 copy of message into q->owned when compression was negotiated and
+   pays off; returns its length, 0 to send the payload as is */
+static size_t tx_compress(struct tx_queue *q, const char *message, size_t msg_len) {
+    if (!(conf.caps & UART_CAP_LZ4) || msg_len < COMPRESS_MIN_LEN) return 0;
+    unsigned char *packed = malloc(UART_VARINT_MAX + LZ4_BOUND(msg_len));
+    if (!packed) return 0;
+    size_t n = uart_varint_put(msg_len, packed);
+    size_t block = lz4_compress(message, msg_len, packed + n, LZ4_BOUND(msg_len));
+    if (block == 0 || n + block >= msg_len) {
+        free(packed);
+        return 0;
+    }
+    q->owned = (char *)packed;
+    return n + block;
+}
+
+/* lay out a binary frame in q; same no-copy rule as tx_queue_text().
+   A compressed frame owns a buffer: release it with tx_queue_free(). */
+int tx_queue_binary(struct tx_queue *q, const char *message, size_t msg_len) {
+    q->owned = NULL;
+    if (msg_len > UART_FRAME_MAX_LEN) {
+        log_error("Binary frame payload too large (%zu bytes)", msg_len);
+        return -1;
+    }
+
+    size_t raw_len = msg_len;
+    size_t packed_len = tx_compress(q, message, msg_len);
+    unsigned char sync = UART_BIN_SYNC;
+    if (packed_len) {
+        sync = BIN_SYNC_LZ4;
+        message = q->owned;
+        msg_len = packed_len;
+    }
+    io_stats.tx_raw += raw_len;
+    io_stats.tx_coded += msg_len;
+
+    uint32_t crc;
+    size_t hdr_len = uart_bin_header(sync, msg_len, q->hdr, &crc);
+    uart_crc_put(q->crc, uart_crc32c(crc, message, msg_len));   /* continues the running CRC */
+
+    q->iov[0] = (struct iovec){ .iov_base = q->hdr,          .iov_len = hdr_len };
+    q->iov[1] = (struct iovec){ .iov_base = (void *)message, .iov_len = msg_len };
+    q->iov[2] = (struct iovec){ .iov_base = q->crc,          .iov_len = UART_CRC_LEN };
+    q->first = 0;
+    q->count = 3;
+    q->left = hdr_len + msg_len + UART_CRC_LEN;
+    return 0;
+}
+
+void tx_queue_free(struct tx_queue *q) {
+    free(q->owned);
+    q->owned = NULL;
+}
+
+int send_binary_frame(int dev_handle, const char *message, size_t msg_len, int drain) {
+    struct tx_queue q;
+    if (tx_queue_binary(&q, message, msg_len) != 0) return -1;
+    int r = transmit(dev_handle, q.iov, q.count, q.left, drain);
+    tx_queue_free(&q);
+    return r;
+}
+
+/* byte source for exact-length readers: drains the carry first, then the fd,
+   under the same deadlines as read_until_marker() */
+struct rx_source {
+    int fd;
+    struct rx_carry *carry;
+    struct tx_queue *tx;
+    const struct read_timeouts *to;
+    uint64_t start, last_rx;
+    size_t got;   /* bytes delivered so far; selects first-byte vs inter-byte deadline */
+};
+
+/* read between 1 and n bytes. Returns the count, 0 on timeout/EOF, -1 on error. */
+static ssize_t rx_source_read(struct rx_source *src, void *dst, size_t n) {
+    struct rx_carry *carry = src->carry;
+    if (carry && carry->len > 0) {
+        size_t k = carry->len < n ? carry->len : n;
+        memcpy(dst, carry->data, k);
+        memmove(carry->data, carry->data + k, carry->len - k);
+        carry->len -= k;
+        src->got += k;
+        return (ssize_t)k;
+    }
+
+    while (1) {
+        int ready = rx_wait(src->fd, src->tx, src->to, &src->start, &src->last_rx, src->got > 0);
+        if (ready <= 0) return ready;
+
+        ssize_t r = rx_read(src->fd, dst, n);
+        stats_rx_read(r);
+        tap_buf(CAPTURE_RX, dst, r);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                io_stats.eagain_retries++;
+                errno = 0;
+                continue;
+            }
+            return -1;
+        }
+        if (r > 0) {
+            src->got += (size_t)r;
+            src->last_rx = now_us();
+        }
+        return r;
+    }
+}
+
+/* fill exactly n bytes. Returns 0 when full, 1 on timeout/EOF (*filled says how far), -1 on error. */
+static int rx_source_read_exact(struct rx_source *src, void *dst, size_t n, size_t *filled) {
+    size_t have = 0;
+    while (have < n) {
+        ssize_t r = rx_source_read(src, (char *)dst + have, n - have);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        have += (size_t)r;
+    }
+    if (filled) *filled = have;
+    return have == n ? 0 : 1;
+}
+
+/* read one binary frame. Same contract as read_until_marker(): 0 with the
+   payload in *out_buf, 1 on timeout (partial payload, if any), -1 on error
+   or CRC mismatch. Bytes ahead of the sync byte are skipped. The reader
+   never asks for more than the frame can hold, so nothing of the next frame
+   is consumed. */
+int read_binary_frame(int fd, const struct read_timeouts *to, struct rx_carry *carry,
+                      struct tx_queue *tx, char **out_buf, size_t *out_len) {
+    struct rx_source src = { .fd = fd, .carry = carry, .tx = tx, .to = to };
+    src.start = src.last_rx = now_us();
+    stats_rx_begin(src.start, carry ? carry->len : 0);
+    *out_buf = NULL;
+    *out_len = 0;
+
+    /* header: sync + varint. Holds at most one header plus a few bytes that
+       can only belong to this frame's payload/CRC. */
+    unsigned char hdr[1 + UART_VARINT_MAX + UART_CRC_LEN + 1];
+    size_t have = 0, skipped = 0, hdr_len = 0;
+    uint64_t length = 0;
+
+    while (hdr_len == 0) {
+        size_t drop = 0;
+        while (drop < have && hdr[drop] != UART_BIN_SYNC && hdr[drop] != BIN_SYNC_LZ4) drop++;
+        if (drop) {
+            memmove(hdr, hdr + drop, have - drop);
+            have -= drop;
+            skipped += drop;
+        }
+
+        if (have >= 2) {
+            size_t used;
+            int v = uart_varint_get(hdr + 1, have - 1, &length, &used);
+            if (v == 1 && length <= UART_FRAME_MAX_LEN) {
+                hdr_len = 1 + used;
+                break;
+            }
+            if (v != 0) {
+                /* oversized or overlong: not a real sync byte, resync past it */
+                memmove(hdr, hdr + 1, have - 1);
+                have--;
+                skipped++;
+                continue;
+            }
+        }
+
+        /* the shortest frame consistent with what we hold bounds how far we
+           may read: at least one more length byte, then the CRC */
+        size_t want = have == 0 ? BIN_FRAME_MIN : 1 + UART_CRC_LEN;
+        if (have + want > sizeof(hdr)) want = sizeof(hdr) - have;
+        ssize_t r = rx_source_read(&src, hdr + have, want);
+        if (r < 0) return -1;
+        if (r == 0) return 1;
+        have += (size_t)r;
+    }
+    if (skipped) log_warning("Skipped %zu bytes before binary frame sync", skipped);
+    int packed = hdr[0] == BIN_SYNC_LZ4;
+
+    /* one allocation for payload + CRC (+1 so text payloads can be NUL-terminated) */
+    size_t body_len = (size_t)length + UART_CRC_LEN;
+    char *body = malloc(body_len + 1);
+    if (!body) return -1;
+    size_t pre = have - hdr_len;
+    memcpy(body, hdr + hdr_len, pre);
+
+    size_t filled = pre;
+    int r = pre < body_len ? rx_source_read_exact(&src, body + pre, body_len - pre, &filled) : 0;
+    if (r == 0) filled = body_len;
+    if (r != 0) {
+        if (r < 0) { free(body); return -1; }
+        if (packed) {
+            /* half an LZ4 block decodes to nothing useful */
+            log_warning("Compressed frame cut short after %zu of %zu bytes", filled, body_len);
+            free(body);
+            return 1;
+        }
+        *out_buf = body;
+        *out_len = filled < (size_t)length ? filled : (size_t)length;
+        return 1;
+    }
+
+    uint32_t crc = uart_crc32c(0, hdr + 1, hdr_len - 1);
+    crc = uart_crc32c(crc, body, (size_t)length);
+    uint32_t wire = uart_crc_get((unsigned char *)body + length);
+    if (crc != wire) {
+        log_error("Binary frame CRC mismatch (got %08x, expected %08x)", wire, crc);
+        free(body);
+        return -1;
+    }
+
+    io_stats.rx_coded += (size_t)length;
+    if (packed) {
+        uint64_t raw_len;
+        size_t used;
+        char *raw = NULL;
+        if (uart_varint_get((unsigned char *)body, (size_t)length, &raw_len, &used) != 1 ||
+            raw_len > UART_FRAME_MAX_LEN || !(raw = malloc((size_t)raw_len + 1)) ||
+            lz4_decompress(body + used, (size_t)length - used, raw, (size_t)raw_len) != 0) {
+            log_error("Malformed compressed frame (%llu bytes)", (unsigned long long)length);
+            free(raw);
+            free(body);
+            return -1;
+        }
+        free(body);
+        body = raw;
+        length = raw_len;
+    }
+    io_stats.rx_raw += (size_t)length;
+
+    stats_rx_done();
+    *out_buf = body;
+    *out_len = (size_t)length;
+    return 0;
+}
+
+/* -m cobs wire format: 0x00, COBS(payload, CRC-32C LE), 0x00. The leading
+   delimiter cuts off any line noise ahead of the frame as a frame of its
+   own, which then fails to check. */
+#define COBS_RX_CHUNK 4096
+
+/* a COBS frame is always encoded into q->owned: release it with tx_queue_free() */
+int tx_queue_cobs(struct tx_queue *q, const char *message, size_t msg_len) {
+    q->owned = NULL;
+    if (msg_len > UART_FRAME_MAX_LEN) {
+        log_error("COBS frame payload too large (%zu bytes)", msg_len);
+        return -1;
+    }
+    unsigned char *wire = malloc(uart_frame_bound(UART_FRAMING_COBS, msg_len));
+    if (!wire) return -1;
+    size_t n = uart_cobs_frame(message, msg_len, wire);
+
+    q->owned = (char *)wire;
+    q->iov[0] = (struct iovec){ .iov_base = wire, .iov_len = n };
+    q->first = 0;
+    q->count = 1;
+    q->left = n;
+    return 0;
+}
+
+/* read one COBS frame. Same contract as read_binary_frame(), except that
+   a timeout returns no partial payload (a cut-off block does not decode).
+   Everything up to a delimiter is one candidate: empty ones are skipped,
+   and one that does not decode or fails its CRC is dropped with a warning,
+   so resynchronising costs one delimiter scan. Bytes after the frame's
+   delimiter go to carry. */
+int read_cobs_frame(int fd, const struct read_timeouts *to, struct rx_carry *carry,
+                    struct tx_queue *tx, char **out_buf, size_t *out_len) {
+    const size_t max_wire = COBS_BOUND((size_t)UART_FRAME_MAX_LEN + UART_CRC_LEN);
+    struct rx_source src = { .fd = fd, .tx = tx, .to = to };   /* carry is taken over below */
+    src.start = src.last_rx = now_us();
+    stats_rx_begin(src.start, carry ? carry->len : 0);
+    *out_buf = NULL;
+    *out_len = 0;
+
+    size_t cap = COBS_RX_CHUNK, len = 0;
+    if (carry) {
+        while (cap < carry->len + COBS_RX_CHUNK) cap *= 2;
+    }
+    char *buf = malloc(cap);
+    if (!buf) return -1;
+    if (carry && carry->len > 0) {
+        memcpy(buf, carry->data, carry->len);
+        len = carry->len;
+        carry->len = 0;
+    }
+
+    /* candidate frame: [begin, delimiter); scanned bytes hold no delimiter */
+    size_t begin = 0, scanned = 0, payload = 0;
+    int skipping = 0;   /* inside an overlong run: discard up to the next delimiter */
+    for (;;) {
+        size_t z = scanned + cobs_zero(buf + scanned, len - scanned);
+        if (z < len) {
+            size_t flen = z - begin;
+            int v = skipping || flen == 0 ? 0 : uart_cobs_check((unsigned char *)buf + begin, flen, &payload);
+            if (v == 1) {
+                scanned = z + 1;
+                break;
+            }
+            if (skipping || flen == 0) skipping = 0;
+            else if (v < 0) log_warning("Dropped COBS frame with bad CRC (%zu bytes)", flen);
+            else log_warning("Dropped malformed COBS frame (%zu bytes)", flen);
+            begin = scanned = z + 1;
+            continue;
+        }
+
+        scanned = len;
+        if (len - begin > max_wire) {
+            log_warning("Dropped %zu bytes without a COBS delimiter", len - begin);
+            skipping = 1;
+            begin = len;
+        }
+        if (begin > 0) {   /* keep only the open candidate */
+            memmove(buf, buf + begin, len - begin);
+            len -= begin;
+            scanned = len;
+            begin = 0;
+        }
+        if (cap - len < COBS_RX_CHUNK) {
+            char *nb = realloc(buf, cap * 2);
+            if (!nb) { free(buf); return -1; }
+            buf = nb;
+            cap *= 2;
+        }
+        ssize_t r = rx_source_read(&src, buf + len, cap - len);
+        if (r < 0) { free(buf); return -1; }
+        if (r == 0) {
+            if (len > 0 && !skipping) log_warning("COBS frame cut short after %zu bytes", len);
+            free(buf);
+            return 1;
+        }
+        len += (size_t)r;
+    }
+
+    stats_rx_done();
+    size_t extra = len - scanned;
+    if (extra > 0 && carry) {
+        char *nd = realloc(carry->data, extra);
+        if (!nd) { free(buf); return -1; }
+        memcpy(nd, buf + scanned, extra);
+        carry->data = nd;
+        carry->len = extra;
+    } else if (extra > 0) {
+        log_warning("Dropping %zu bytes received after COBS frame", extra);
+    }
+    memmove(buf, buf + begin, payload);
+    *out_buf = buf;
+    *out_len = payload;
+    return 0;
+}
+
+/* send one frame in the configured framing */
+int send_framed(int dev_handle, const char *message, size_t msg_len, int drain) {
+    struct tx_queue q;
+    if (tx_queue_request(&q, message, msg_len) != 0) return -1;
+    int r = transmit(dev_handle, q.iov, q.count, q.left, drain);
+    tx_queue_free(&q);
+    return r;
+}
+
+/* read one response in the configured framing */
+int read_response(int fd, const struct read_timeouts *to, struct rx_carry *carry,
+                  struct tx_queue *tx, char **out_buf, size_t *out_len) {
+    if (conf.framing == FRAMING_BINARY)
+        return read_binary_frame(fd, to, carry, tx, out_buf, out_len);
+    if (conf.framing == FRAMING_COBS)
+        return read_cobs_frame(fd, to, carry, tx, out_buf, out_len);
+    return read_until_marker(fd, UART_COM_END, to, carry, tx, out_buf, out_len);
+}
+
+/* capability handshake: the query goes out as a plain binary frame and a
+   device that knows it answers UART_CAPS_REPLY followed by a comma or space
+   separated list ("lz4"). Silence or any other answer means no extras, so
+   the wait for the first byte is capped at CAPS_TIMEOUT_MS. */
+#define CAPS_TIMEOUT_MS 500
+
+unsigned negotiate_caps(int fd, const struct read_timeouts *to, struct rx_carry *carry) {
+    struct read_timeouts hto = *to;
+    if (hto.first_byte_ms == 0 || hto.first_byte_ms > CAPS_TIMEOUT_MS) hto.first_byte_ms = CAPS_TIMEOUT_MS;
+
+    unsigned caps = 0;
+    conf.caps = 0;   /* the query itself is never compressed */
+    if (send_binary_frame(fd, UART_CAPS_QUERY, sizeof(UART_CAPS_QUERY) - 1, 1) != 0) return 0;
+
+    char *resp = NULL;
+    size_t len = 0;
+    const size_t pre = sizeof(UART_CAPS_REPLY) - 1;
+    if (read_binary_frame(fd, &hto, carry, NULL, &resp, &len) == 0 && len >= pre &&
+        memcmp(resp, UART_CAPS_REPLY, pre) == 0) {
+        for (size_t i = pre; i < len;) {
+            size_t j = i;
+            while (j < len && resp[j] != ',' && resp[j] != ' ') j++;
+            if (j - i == 3 && memcmp(resp + i, "lz4", 3) == 0) caps |= UART_CAP_LZ4;
+            i = j + 1;
+        }
+    }
+    free(resp);
+    log_info("Device capabilities: %#x", caps);
+    return caps;
+}
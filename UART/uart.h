@@ -0,0 +1,286 @@
+// uart.h - serial port setup, framing and response readers shared by the UART tool
+#ifndef UART_UART_H
+#define UART_UART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "libuart.h"
+
+enum framing {
+    FRAMING_TEXT = UART_FRAMING_TEXT,       /* [UART_COM][START]...[UART_COM][END] markers */
+    FRAMING_BINARY = UART_FRAMING_BINARY,   /* sync byte, varint length, payload, CRC-32C */
+    FRAMING_COBS = UART_FRAMING_COBS,       /* COBS-stuffed payload and CRC-32C between 0x00 delimiters */
+};
+
+/* driver/termios tuning on open (-L) */
+enum rx_tuning {
+    RX_TUNING_DEFAULT = 0,  /* VMIN=1 VTIME=10, driver left alone */
+    RX_TUNING_LATENCY,      /* lowest latency: low-latency flag, 1 ms FTDI timer, VMIN=1 VTIME=0 */
+    RX_TUNING_WAKEUPS,      /* fewest wakeups: batch up to VMIN bytes, driver at its defaults */
+};
+
+/* I/O backend of the multi-port event loop (--io) */
+enum io_backend {
+    IO_BACKEND_POLL = 0,    /* epoll / kqueue / poll() readiness loop */
+    IO_BACKEND_URING,       /* io_uring completions (Linux); falls back to POLL */
+};
+
+/* optional features agreed with the device by negotiate_caps() */
+#define UART_CAP_LZ4 0x1u   /* compressed binary frames */
+
+struct capture;
+struct rx_thread;
+
+struct Config {
+    int debug_mode;
+    const char *device_path;
+    long baud_rate;
+    enum framing framing;
+    enum rx_tuning tuning;
+    unsigned caps;
+    struct capture *capture;    /* -C: traffic capture, or NULL */
+    struct rx_thread *rx_thread;    /* --rx-thread: reads go through it, or NULL */
+    enum io_backend io_backend;
+    int keep_input;             /* --no-flush: keep bytes received before the open */
+    long reconnect_ms;          /* --reconnect: window to get a lost port back; 0 = off */
+    size_t coalesce_bytes;      /* --coalesce: TX batch size limit; 0 = one write per frame */
+    long coalesce_us;           /* --coalesce: longest a queued frame waits for company */
+};
+extern struct Config conf;
+
+/* what serial_port_tune() managed to apply. Knob states: 1 applied,
+   0 not available for this port/platform, -1 available but refused. */
+struct port_tuning {
+    int low_latency;          /* ASYNC_LOW_LATENCY (Linux) / IOSSDATALAT (macOS) */
+    int latency_timer;        /* FTDI latency_timer via sysfs */
+    int latency_timer_ms;     /* value in effect afterwards, -1 if unknown */
+    int termios;              /* VMIN/VTIME */
+    int vmin, vtime;
+};
+
+/* frame markers (libuart.h); lengths are compile-time constants */
+#define UART_COM_START_LEN (sizeof(UART_COM_START) - 1)
+#define UART_COM_END_LEN (sizeof(UART_COM_END) - 1)
+/* sequence tag sent right after the START marker when requests are pipelined */
+#define UART_COM_SEQ_PREFIX "[SEQ:"
+/* capability handshake payloads (binary framing) */
+#define UART_CAPS_QUERY "[UART_COM][CAPS?]"
+#define UART_CAPS_REPLY "[UART_COM][CAPS]"
+
+/* incremental end-marker matcher (KMP).
+   State survives between feeds, so each received byte is examined once and a
+   marker split across reads is still found. */
+#define MARKER_MAX_LEN 64
+
+struct marker_scanner {
+    const char *marker;
+    size_t len;
+    size_t matched;                  /* marker bytes matched so far */
+    size_t fail[MARKER_MAX_LEN];     /* KMP failure function */
+};
+
+/* several terminators at once (the END marker plus e.g. "ERROR:", "BUSY",
+   a bootloader prompt): an Aho-Corasick automaton compiled into a dense
+   DFA over the byte classes the patterns use. Built once and shared;
+   scanning costs one table lookup per byte however many patterns there
+   are. Patterns are not copied and must outlive the set. */
+#define TERM_MAX_PATTERNS 32
+
+struct term_set {
+    int n;
+    const char *pattern[TERM_MAX_PATTERNS];
+    size_t len[TERM_MAX_PATTERNS];
+    unsigned nstates, nclasses;
+    unsigned char cls[256];     /* byte -> class, 0 for bytes in no pattern */
+    uint16_t *next;             /* [state * nclasses + class] */
+    int8_t *out;                /* pattern completed on entering state, or -1 */
+    uint8_t *depth;             /* bytes of a possible match held in state */
+};
+
+struct term_scanner {
+    const struct term_set *set;
+    unsigned state;
+};
+
+/* bytes received after a frame's end marker, held for the next read */
+struct rx_carry {
+    char *data;
+    size_t len;
+};
+
+/* response deadlines, all in milliseconds. A zero first_byte_ms / inter_byte_ms
+   disables that deadline; total_ms always applies. */
+struct read_timeouts {
+    long total_ms;       /* whole response, from the start of the read */
+    long first_byte_ms;  /* silence before the first byte arrives */
+    long inter_byte_ms;  /* gap between two reads once data is flowing */
+};
+
+/* phase timings and I/O counters of the current command, in microseconds,
+   filled in as the core runs. -1 marks a phase that never happened (no
+   first byte, no end of frame). open_us is set by whoever opens the port
+   and is not touched by io_stats_reset(). */
+struct io_stats {
+    int64_t open_us;
+    int64_t write_us;
+    int64_t drain_us;
+    int64_t first_byte_us;   /* from the start of the read */
+    int64_t marker_us;       /* end of frame, from the start of the read */
+    size_t bytes_out, bytes_in;
+    unsigned long read_calls;
+    unsigned long eagain_retries;   /* reads and writes that hit EAGAIN */
+    size_t tx_raw, tx_coded;        /* binary payload bytes before / after compression */
+    size_t rx_raw, rx_coded;
+    uint64_t rx_start;
+};
+extern struct io_stats io_stats;
+
+/* bounded receive ring that lives across commands. head/tail are running
+   byte counts (consumed / filled); cap is a power of two, so positions map
+   into buf with a mask and the ring never grows, whatever the frame size. */
+#define RX_RING_DEFAULT_CAP (64u * 1024u)
+
+struct rx_ring {
+    char *buf;
+    size_t cap;
+    uint64_t head, tail;
+};
+
+/* a frame being written without blocking, interleaved with reading the
+   reply (full duplex). iov[first..first+count) is what is still unsent. */
+struct tx_queue {
+    struct iovec iov[4];
+    int first, count;
+    size_t left;
+    unsigned char hdr[8];   /* binary framing: sync + varint length */
+    unsigned char crc[4];
+    char *owned;            /* compressed or COBS-encoded frame, see tx_queue_free() */
+    uint64_t start;
+    uint64_t deadline;      /* now_us() by which the frame must be out, see tx_deadline() */
+    int expired;            /* the deadline passed and was reported */
+};
+
+/* receives a frame as views into the ring: up to two segments (the data may
+   wrap). Frames longer than the ring arrive in several pieces; last is set
+   on the piece that ends the frame. Return non-zero to abort the read. */
+typedef int (*rx_frame_fn)(void *ctx, const struct iovec *seg, int nseg, int last);
+
+uint64_t now_us(void);
+void io_stats_reset(void);
+int set_blocking(int fd, int blocking);
+int poll_deadline(struct pollfd *pfds, nfds_t n, uint64_t deadline);
+int wait_ready(int fd, short events, uint64_t deadline);
+/* open and configure; attributes already in effect are not set again */
+int serial_port_open(const char *path, long baud_rate);
+int serial_port_lost(int fd);
+#define RECONNECT_POLL_MS 100
+#define RECONNECT_DEFAULT_MS 30000
+int serial_port_reconnect(const char *path, long baud_rate, long window_ms);
+int serial_port_tune(int fd, const char *path, enum rx_tuning mode, struct port_tuning *rep);
+void port_tuning_describe(const struct port_tuning *rep, char *buf, size_t n);
+
+void iov_advance(struct iovec **iov, int *iovcnt, size_t n);
+ssize_t writev_all(int fd, struct iovec *iov, int iovcnt, uint64_t deadline);
+ssize_t write_all(int fd, const void *buf, size_t count, uint64_t deadline);
+int transmit(int dev_handle, struct iovec *iov, int iovcnt, size_t total, int drain);
+int send_frame(int dev_handle, const char *tag, size_t tag_len,
+               const char *message, size_t msg_len, int drain);
+int send_binary_frame(int dev_handle, const char *message, size_t msg_len, int drain);
+int send_framed(int dev_handle, const char *message, size_t msg_len, int drain);
+void send_data_to_device(int dev_handle, const char *message, int length);
+void tx_queue_text(struct tx_queue *q, const char *tag, size_t tag_len, const char *message, size_t msg_len);
+int tx_queue_binary(struct tx_queue *q, const char *message, size_t msg_len);
+int tx_queue_cobs(struct tx_queue *q, const char *message, size_t msg_len);
+void tx_queue_free(struct tx_queue *q);
+int tx_queue_request(struct tx_queue *q, const char *message, size_t msg_len);
+/* a send fails once it runs this long past the frame's own wire time */
+#define TX_SLACK_MS 2000
+uint64_t tx_deadline(uint64_t start, size_t len);
+int tx_start(int fd, struct tx_queue *q);
+int tx_pump(int fd, struct tx_queue *q);
+int tx_finish(int fd, struct tx_queue *q);
+
+/* transmit coalescing (--coalesce): frames queued back to back are written
+   together, one write and no drain per batch instead of per frame. A batch
+   goes once it holds limit bytes, once its oldest frame has waited
+   delay_us, or when the sender has nothing more to add (window full, no
+   input ready). The policy only decides and counts; buffers are the
+   caller's. With limit 0 nothing is held: every frame is due at once. */
+#define TX_COALESCE_DEFAULT_BYTES 4096
+#define TX_COALESCE_DEFAULT_US 100
+
+enum tx_flush_reason {
+    TX_FLUSH_IDLE = 0,      /* nothing more to add right now */
+    TX_FLUSH_SIZE,
+    TX_FLUSH_TIMER,
+    TX_FLUSH_REASONS,
+};
+
+struct tx_coalesce {
+    size_t limit;
+    uint64_t delay_us;
+    size_t bytes;               /* pending batch */
+    unsigned long frames;
+    uint64_t oldest_us;
+    uint64_t total_bytes;       /* totals over every released batch */
+    unsigned long total_frames, batches, max_frames;
+    unsigned long released[TX_FLUSH_REASONS];
+};
+
+void tx_coalesce_init(struct tx_coalesce *c, size_t limit, uint64_t delay_us);
+/* a frame of n bytes joined the batch; returns 1 if that filled it */
+int tx_coalesce_add(struct tx_coalesce *c, size_t n, uint64_t now);
+/* when the batch is due by its timer (now_us() clock), 0 if nothing is pending */
+uint64_t tx_coalesce_deadline(const struct tx_coalesce *c);
+/* the pending batch was handed to the writer */
+void tx_coalesce_release(struct tx_coalesce *c, enum tx_flush_reason why);
+void tx_coalesce_describe(const struct tx_coalesce *c, char *buf, size_t n);
+
+/* a coalescing batch with its own buffer, written with blocking writes */
+struct tx_batch {
+    char *buf;
+    size_t len, cap;
+    struct tx_coalesce policy;
+};
+
+/* copy q's frame into the batch; 1 if the batch is now full, -1 out of memory */
+int tx_batch_add(struct tx_batch *b, const struct tx_queue *q);
+/* write the batch out (no-op when empty); 0, or -1 on a write error */
+int tx_batch_flush(int fd, struct tx_batch *b, enum tx_flush_reason why);
+void tx_batch_free(struct tx_batch *b);
+
+int marker_scanner_init(struct marker_scanner *sc, const char *marker);
+ssize_t marker_scanner_feed(struct marker_scanner *sc, const char *data, size_t n);
+
+int term_set_build(struct term_set *ts, const char *const *patterns, int n);
+void term_set_free(struct term_set *ts);
+void term_scanner_init(struct term_scanner *sc, const struct term_set *ts);
+ssize_t term_scanner_feed(struct term_scanner *sc, const char *data, size_t n, int *which);
+
+int frame_seq(const char *frame, size_t len, uint32_t *seq);
+uint64_t rx_deadline(const struct read_timeouts *to, uint64_t start, uint64_t last_rx, int have_data);
+int read_until_marker(int fd, const char *end_marker, const struct read_timeouts *to,
+                      struct rx_carry *carry, struct tx_queue *tx, char **out_buf, size_t *out_len);
+int read_until_term(int fd, const struct term_set *terms, const struct read_timeouts *to,
+                    struct rx_carry *carry, struct tx_queue *tx, char **out_buf, size_t *out_len, int *which);
+int read_binary_frame(int fd, const struct read_timeouts *to, struct rx_carry *carry,
+                      struct tx_queue *tx, char **out_buf, size_t *out_len);
+int read_cobs_frame(int fd, const struct read_timeouts *to, struct rx_carry *carry,
+                    struct tx_queue *tx, char **out_buf, size_t *out_len);
+int rx_ring_init(struct rx_ring *ring, size_t cap);
+void rx_ring_free(struct rx_ring *ring);
+int read_until_marker_ring(int fd, const char *end_marker, const struct read_timeouts *to,
+                           struct rx_ring *ring, struct tx_queue *tx, int stream,
+                           rx_frame_fn on_frame, void *ctx, size_t *frame_len);
+int read_until_term_ring(int fd, const struct term_set *terms, const struct read_timeouts *to,
+                         struct rx_ring *ring, struct tx_queue *tx, int stream,
+                         rx_frame_fn on_frame, void *ctx, size_t *frame_len, int *which);
+int read_response(int fd, const struct read_timeouts *to, struct rx_carry *carry,
+                  struct tx_queue *tx, char **out_buf, size_t *out_len);
+unsigned negotiate_caps(int fd, const struct read_timeouts *to, struct rx_carry *carry);
+
+#endif
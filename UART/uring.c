@@ -0,0 +1,227 @@
+// uring.c - minimal io_uring wrapper (raw syscalls, no liburing) for the multi-port loop
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void uring_unmap(struct uring *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map && u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_map_len);
+    if (u->br) munmap(u->br, u->br_len);
+    free(u->bufs);
+}
+
+static int uring_setup_bufs(struct uring *u, unsigned nbufs, unsigned buf_size) {
+    u->nbufs = nbufs;
+    u->buf_size = buf_size;
+    u->br_len = nbufs * sizeof(struct io_uring_buf);
+    void *m = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    u->bufs = malloc((size_t)nbufs * buf_size);
+    if (m == MAP_FAILED || !u->bufs) {
+        if (m != MAP_FAILED) munmap(m, u->br_len);
+        return -1;
+    }
+    u->br = m;
+
+    struct io_uring_buf_reg reg = { .ring_addr = (uint64_t)(uintptr_t)u->br, .ring_entries = nbufs, .bgid = URING_BGID };
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return -1;
+    for (unsigned i = 0; i < nbufs; i++) {
+        struct io_uring_buf *b = &u->br->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)i * buf_size);
+        b->len = buf_size;
+        b->bid = (uint16_t)i;
+    }
+    __atomic_store_n(&u->br->tail, (uint16_t)nbufs, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int uring_open(struct uring *u, unsigned entries, unsigned nbufs, unsigned buf_size) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    /* multishot reads complete often: give completions room to spare */
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = entries * 4;
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));   /* older kernel: plain ring */
+        u->fd = sys_setup(entries, &p);
+    }
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_map_len > u->sq_map_len) u->sq_map_len = u->cq_map_len;
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) goto fail;
+    u->cq_map = u->sq_map;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_local = *u->sq_tail;
+    /* identity map: SQE i always sits in array slot i */
+    for (unsigned i = 0; i < p.sq_entries; i++) u->sq_array[i] = i;
+
+    if (uring_setup_bufs(u, nbufs, buf_size) != 0) goto fail;
+    return 0;
+
+fail: {
+        int e = errno;
+        uring_unmap(u);
+        close(u->fd);
+        u->fd = -1;
+        errno = e;
+        return -1;
+    }
+}
+
+void uring_close(struct uring *u) {
+    if (u->fd < 0) return;
+    uring_unmap(u);
+    close(u->fd);   /* cancels whatever is still in flight */
+    u->fd = -1;
+}
+
+int uring_register_files(struct uring *u, const int *fds, unsigned n) {
+    return sys_register(u->fd, IORING_REGISTER_FILES, (void *)fds, n);
+}
+
+static unsigned uring_queued(const struct uring *u) {
+    return u->sq_local - *u->sq_tail;
+}
+
+static int uring_enter(struct uring *u, int wait, int64_t timeout_us) {
+    unsigned n = uring_queued(u);
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { .sigmask_sz = _NSIG / 8 };
+    unsigned flags = 0;
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_us >= 0) {
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = (timeout_us % 1000000) * 1000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    for (;;) {
+        int r = sys_enter(u->fd, n, wait ? 1 : 0, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+        u->submit_calls++;
+        if (r >= 0) {
+            u->sqes_submitted += (unsigned)r;
+            return 0;
+        }
+        if (errno == ETIME || errno == EINTR) {
+            errno = 0;
+            return 0;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            /* completions backed up: the caller reaps them first */
+            errno = 0;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local - head >= u->sq_entries) {
+        if (uring_enter(u, 0, 0) != 0) return NULL;
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local - head >= u->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local++;
+    return sqe;
+}
+
+int uring_submit_wait(struct uring *u, int64_t timeout_us) {
+    /* completions already waiting: just submit */
+    int ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != *u->cq_head;
+    if (ready && uring_queued(u) == 0) return 0;
+    return uring_enter(u, !ready, timeout_us);
+}
+
+struct io_uring_cqe *uring_peek(struct uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+const unsigned char *uring_buf(const struct uring *u, unsigned bid) {
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+/* hand buffer bid back to the kernel at the ring's tail */
+void uring_buf_recycle(struct uring *u, unsigned bid) {
+    uint16_t tail = u->br->tail;
+    struct io_uring_buf *b = &u->br->bufs[tail & (u->nbufs - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * u->buf_size);
+    b->len = u->buf_size;
+    b->bid = (uint16_t)bid;
+    __atomic_store_n(&u->br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#else
+
+int uring_open(struct uring *u, unsigned entries, unsigned nbufs, unsigned buf_size) {
+    (void)entries; (void)nbufs; (void)buf_size;
+    u->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_close(struct uring *u) {
+    (void)u;
+}
+
+int uring_register_files(struct uring *u, const int *fds, unsigned n) {
+    (void)u; (void)fds; (void)n;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,59 @@
+// uring.h - minimal io_uring wrapper (raw syscalls, no liburing) for the multi-port loop
+#ifndef UART_URING_H
+#define UART_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Provided-buffer group the multishot reads pick their buffers from */
+#define URING_BGID 0
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned sq_entries, sq_mask, cq_mask;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned *cq_head, *cq_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local;          /* tail of queued but unsubmitted SQEs */
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+
+    /* receive buffers registered with the kernel as a ring */
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    unsigned nbufs, buf_size;
+    unsigned char *bufs;
+
+    unsigned long submit_calls, sqes_submitted;
+};
+#else
+struct uring { int fd; };
+#endif
+
+/* Set up a ring of at least `entries` SQEs with nbufs (a power of two)
+   receive buffers of buf_size bytes each. Returns -1 if io_uring is not
+   available (not Linux, too old a kernel, or blocked by a sandbox). */
+int uring_open(struct uring *u, unsigned entries, unsigned nbufs, unsigned buf_size);
+void uring_close(struct uring *u);
+/* register fds for IOSQE_FIXED_FILE; -1 entries stay empty */
+int uring_register_files(struct uring *u, const int *fds, unsigned n);
+
+#ifdef __linux__
+/* next free SQE, zeroed; submits queued ones first if the ring is full */
+struct io_uring_sqe *uring_sqe(struct uring *u);
+/* submit what is queued and wait for a completion or timeout_us (-1 =
+   forever) in one io_uring_enter(). Returns 0, or -1 on error. */
+int uring_submit_wait(struct uring *u, int64_t timeout_us);
+/* next completion or NULL; uring_cqe_seen() when done with it */
+struct io_uring_cqe *uring_peek(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+const unsigned char *uring_buf(const struct uring *u, unsigned bid);
+void uring_buf_recycle(struct uring *u, unsigned bid);
+#endif
+
+#endif
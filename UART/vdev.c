@@ -0,0 +1,591 @@
+// vdev.c - virtual devices: PTYs that answer [UART_COM] frames like a board would
+#define _GNU_SOURCE   /* posix_openpt(), ptsname() and memmem() on glibc */
+#include "vdev.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log.h"
+#include "uart.h"
+
+#define RX_CHUNK 4096
+#define PACE_SLACK_NS 10000000u
+
+static volatile sig_atomic_t vdev_stop;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    vdev_stop = 1;
+}
+
+/* ---- responder ---- */
+
+struct rule {
+    char *req, *reply;
+    size_t req_len, reply_len;
+    int any;
+    int used;           /* replay: this pair has answered its request */
+};
+
+struct responder {
+    struct rule *rules;
+    size_t n, cap;
+    int replay;         /* rules come from a capture */
+    size_t next;        /* replay: next recorded reply for unknown requests */
+};
+
+static int responder_add(struct responder *rs, const char *req, size_t req_len,
+                         const char *reply, size_t reply_len, int any) {
+    if (rs->n == rs->cap) {
+        size_t ncap = rs->cap ? rs->cap * 2 : 64;
+        struct rule *nr = realloc(rs->rules, ncap * sizeof(*nr));
+        if (!nr) return -1;
+        rs->rules = nr;
+        rs->cap = ncap;
+    }
+    struct rule *r = &rs->rules[rs->n];
+    r->req = malloc(req_len + 1);
+    r->reply = malloc(reply_len + 1);
+    if (!r->req || !r->reply) {
+        free(r->req);
+        free(r->reply);
+        return -1;
+    }
+    memcpy(r->req, req, req_len);
+    memcpy(r->reply, reply, reply_len);
+    r->req_len = req_len;
+    r->reply_len = reply_len;
+    r->any = any;
+    r->used = 0;
+    rs->n++;
+    return 0;
+}
+
+static void responder_free(struct responder *rs) {
+    for (size_t i = 0; i < rs->n; i++) {
+        free(rs->rules[i].req);
+        free(rs->rules[i].reply);
+    }
+    free(rs->rules);
+}
+
+/* undo \r \n \t \\ \xNN in place; returns the new length */
+static size_t unescape(char *s, size_t n) {
+    size_t o = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] != '\\' || i + 1 == n) { s[o++] = s[i]; continue; }
+        char c = s[++i];
+        if (c == 'r') s[o++] = '\r';
+        else if (c == 'n') s[o++] = '\n';
+        else if (c == 't') s[o++] = '\t';
+        else if (c == 'x' && i + 2 < n) {
+            char hex[3] = { s[i + 1], s[i + 2], 0 };
+            char *end;
+            long v = strtol(hex, &end, 16);
+            if (*end) { s[o++] = '\\'; s[o++] = c; continue; }
+            s[o++] = (char)v;
+            i += 2;
+        } else s[o++] = c;
+    }
+    return o;
+}
+
+static int load_script(struct responder *rs, FILE *in, const char *path) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    unsigned long lineno = 0;
+    int ret = 0;
+    while ((n = getline(&line, &cap, in)) != -1) {
+        lineno++;
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        char *tab = memchr(line, '\t', (size_t)n);
+        if (!tab) {
+            errno = 0;
+            log_warning("%s:%lu: no TAB between request and reply, line ignored", path, lineno);
+            continue;
+        }
+        size_t req_len = unescape(line, (size_t)(tab - line));
+        size_t reply_len = unescape(tab + 1, (size_t)(line + n - tab - 1));
+        int any = req_len == 1 && line[0] == '*';
+        if (responder_add(rs, line, req_len, tab + 1, reply_len, any) != 0) { ret = -1; break; }
+    }
+    free(line);
+    return ret;
+}
+
+/* frame payloads of a stream: the bytes between START (and any SEQ tag)
+   and END, appended to the fifo as rules with only one half filled */
+struct frame_split {
+    char *buf;
+    size_t len, cap;
+    struct marker_scanner sc;
+    size_t scanned;
+};
+
+static const char *strip_frame(const char *f, size_t len, size_t *out_len);
+
+static int frame_split_feed(struct frame_split *fs, const unsigned char *data, size_t n,
+                            int (*emit)(void *, const char *, size_t), void *ctx) {
+    if (fs->len + n > fs->cap) {
+        size_t ncap = fs->cap ? fs->cap : RX_CHUNK;
+        while (ncap < fs->len + n) ncap *= 2;
+        char *nb = realloc(fs->buf, ncap);
+        if (!nb) return -1;
+        fs->buf = nb;
+        fs->cap = ncap;
+    }
+    memcpy(fs->buf + fs->len, data, n);
+    fs->len += n;
+
+    ssize_t hit;
+    while (fs->scanned < fs->len &&
+           (hit = marker_scanner_feed(&fs->sc, fs->buf + fs->scanned, fs->len - fs->scanned)) >= 0) {
+        size_t end = fs->scanned + (size_t)hit, plen;
+        const char *p = strip_frame(fs->buf, end, &plen);
+        if (p && emit(ctx, p, plen) != 0) return -1;
+        memmove(fs->buf, fs->buf + end, fs->len - end);
+        fs->len -= end;
+        fs->scanned = 0;
+    }
+    fs->scanned = fs->len;
+    return 0;
+}
+
+/* replay: requests and replies are collected apart, then paired in order */
+static int collect_request(void *ctx, const char *p, size_t n) {
+    return responder_add(ctx, p, n, "", 0, 0);
+}
+
+static int collect_reply(void *ctx, const char *p, size_t n) {
+    return responder_add(ctx, "", 0, p, n, 0);
+}
+
+static int load_capture(struct responder *rs, const char *path) {
+    struct capture_reader cr;
+    if (capture_reader_open(&cr, path) != 0) return -1;
+    struct frame_split tx = {0}, rx = {0};
+    struct responder reqs = {0}, replies = {0};
+    marker_scanner_init(&tx.sc, UART_COM_END);
+    marker_scanner_init(&rx.sc, UART_COM_END);
+    struct capture_rec rec;
+    int v, ret = 0;
+    while ((v = capture_reader_next(&cr, &rec)) == 1) {
+        if (rec.chan != 0) continue;
+        int r = rec.dir == CAPTURE_TX ? frame_split_feed(&tx, rec.data, rec.len, collect_request, &reqs)
+                                      : frame_split_feed(&rx, rec.data, rec.len, collect_reply, &replies);
+        if (r != 0) { ret = -1; break; }
+    }
+    if (v < 0) log_warning("Capture %s is damaged; replaying what came before", path);
+    for (size_t i = 0; ret == 0 && i < reqs.n && i < replies.n; i++)
+        ret = responder_add(rs, reqs.rules[i].req, reqs.rules[i].req_len,
+                            replies.rules[i].reply, replies.rules[i].reply_len, 0);
+    rs->replay = 1;
+    if (ret == 0) log_info("Replaying %zu request/reply pairs from %s", rs->n, path);
+
+    responder_free(&reqs);
+    responder_free(&replies);
+    free(tx.buf);
+    free(rx.buf);
+    capture_reader_close(&cr);
+    return ret;
+}
+
+static int responder_load(struct responder *rs, const char *path) {
+    memset(rs, 0, sizeof(*rs));
+    if (!path) return 0;
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        log_error("Cannot open responder file %s", path);
+        return -1;
+    }
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    int is_capture = fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+                     memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+    rewind(in);
+    int r = is_capture ? load_capture(rs, path) : load_script(rs, in, path);
+    fclose(in);
+    if (r != 0) log_error("Out of memory loading %s", path);
+    return r;
+}
+
+static int rule_matches(const struct rule *r, const char *req, size_t len) {
+    return !r->any && r->req_len == len && memcmp(r->req, req, len) == 0;
+}
+
+/* replay: the k-th time a request comes, its k-th recorded pair answers;
+   once all of them have, the cycle starts over. NULL if it was never seen. */
+static struct rule *replay_next(struct responder *rs, const char *req, size_t len) {
+    struct rule *first = NULL;
+    for (size_t i = 0; i < rs->n; i++) {
+        struct rule *r = &rs->rules[i];
+        if (!rule_matches(r, req, len)) continue;
+        if (!r->used) {
+            r->used = 1;
+            return r;
+        }
+        if (!first) first = r;
+    }
+    if (!first) return NULL;
+    for (size_t i = 0; i < rs->n; i++)
+        if (rule_matches(&rs->rules[i], req, len)) rs->rules[i].used = 0;
+    first->used = 1;
+    return first;
+}
+
+/* reply body for one request payload; *own is set when it must be freed */
+static const char *responder_answer(struct responder *rs, const char *req, size_t len,
+                                    size_t *out_len, char **own) {
+    *own = NULL;
+    if (rs->replay) {
+        const struct rule *r = replay_next(rs, req, len);
+        if (r) {
+            *out_len = r->reply_len;
+            return r->reply;
+        }
+    }
+    const struct rule *wild = NULL;
+    for (size_t i = 0; !rs->replay && i < rs->n; i++) {
+        const struct rule *r = &rs->rules[i];
+        if (r->any) {
+            if (!wild) wild = r;
+        } else if (rule_matches(r, req, len)) {
+            *out_len = r->reply_len;
+            return r->reply;
+        }
+    }
+    if (wild) {
+        *out_len = wild->reply_len;
+        return wild->reply;
+    }
+    if (rs->replay && rs->n > 0) {
+        const struct rule *r = &rs->rules[rs->next++ % rs->n];
+        *out_len = r->reply_len;
+        return r->reply;
+    }
+    if (rs->n > 0) {
+        *out_len = sizeof("ERROR:UNKNOWN") - 1;
+        return "ERROR:UNKNOWN";
+    }
+    /* no file: echo, like the loopback peers in Bench/ */
+    char *echo = malloc(len + 5);
+    if (!echo) return NULL;
+    memcpy(echo, "ECHO:", 5);
+    memcpy(echo + 5, req, len);
+    *own = echo;
+    *out_len = len + 5;
+    return echo;
+}
+
+/* ---- devices ---- */
+
+struct reply {
+    char *data;
+    size_t len, sent;
+    size_t pause_at;        /* fault: hold the rest back from here */
+    uint64_t pause_us;
+    uint64_t ready_us;      /* not before (turnaround, pause) */
+    struct reply *next;
+};
+
+struct vdev {
+    int master, slave;
+    char path[128];
+    struct frame_split rx;
+    struct reply *head, *tail;
+    uint64_t next_ns;       /* pacing: when the next byte may go */
+    unsigned long served;
+};
+
+struct vdev_loop {
+    const struct vdev_opts *o;
+    struct responder rs;
+    struct vdev *devs;
+    struct pollfd *pfds;
+    uint64_t byte_ns;       /* line time of one byte, 0 unpaced */
+    unsigned seed;
+    unsigned long served, faults;
+    struct vdev *cur;       /* device the frame being handled came from */
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int vdev_open(struct vdev *v) {
+    memset(v, 0, sizeof(*v));
+    v->slave = -1;
+    v->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (v->master < 0 || grantpt(v->master) != 0 || unlockpt(v->master) != 0) goto fail;
+    const char *name = ptsname(v->master);
+    if (!name || strlen(name) >= sizeof(v->path)) goto fail;
+    strcpy(v->path, name);
+
+    /* holding the slave open keeps the master readable between clients
+       (no EIO/POLLHUP) and lets us put the line in raw mode up front */
+    v->slave = open(v->path, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (v->slave < 0 || tcgetattr(v->slave, &tio) != 0) goto fail;
+    cfmakeraw(&tio);
+    if (tcsetattr(v->slave, TCSANOW, &tio) != 0 || set_blocking(v->master, 0) != 0) goto fail;
+    marker_scanner_init(&v->rx.sc, UART_COM_END);
+    return 0;
+
+fail:
+    log_error("Cannot create a PTY");
+    if (v->slave >= 0) close(v->slave);
+    if (v->master >= 0) close(v->master);
+    v->master = v->slave = -1;
+    return -1;
+}
+
+static void vdev_close(struct vdev *v) {
+    while (v->head) {
+        struct reply *r = v->head;
+        v->head = r->next;
+        free(r->data);
+        free(r);
+    }
+    free(v->rx.buf);
+    if (v->slave >= 0) close(v->slave);
+    if (v->master >= 0) close(v->master);
+}
+
+static int dice(struct vdev_loop *l, int pct) {
+    return pct > 0 && (int)(rand_r(&l->seed) % 100) < pct;
+}
+
+/* payload of a frame ending at len (END marker included): past the START
+   marker and any SEQ tag. Returns NULL for an END without a START. */
+static const char *strip_frame(const char *f, size_t len, size_t *out_len) {
+    const char *s = memmem(f, len, UART_COM_START, UART_COM_START_LEN);
+    if (!s || (size_t)(s - f) + UART_COM_START_LEN > len - UART_COM_END_LEN) return NULL;
+    const char *p = s + UART_COM_START_LEN, *end = f + len - UART_COM_END_LEN;
+    if ((size_t)(end - p) > sizeof(UART_COM_SEQ_PREFIX) - 1 &&
+        memcmp(p, UART_COM_SEQ_PREFIX, sizeof(UART_COM_SEQ_PREFIX) - 1) == 0) {
+        const char *close = memchr(p, ']', (size_t)(end - p));
+        if (close) p = close + 1;
+    }
+    *out_len = (size_t)(end - p);
+    return p;
+}
+
+/* the SEQ tag of a request, to be echoed in its reply */
+static size_t frame_tag(const char *f, size_t len, const char **tag) {
+    const char *s = memmem(f, len, UART_COM_START, UART_COM_START_LEN);
+    if (!s) return 0;
+    const char *p = s + UART_COM_START_LEN, *end = f + len;
+    size_t k = sizeof(UART_COM_SEQ_PREFIX) - 1;
+    if ((size_t)(end - p) <= k || memcmp(p, UART_COM_SEQ_PREFIX, k) != 0) return 0;
+    const char *close = memchr(p, ']', (size_t)(end - p));
+    if (!close) return 0;
+    *tag = p;
+    return (size_t)(close + 1 - p);
+}
+
+/* frame_split callback for a device: answer the request */
+static int vdev_request(void *ctx, const char *req, size_t len) {
+    struct vdev_loop *l = ctx;
+    struct vdev *v = l->cur;
+    const char *tag = NULL;
+    /* req points into v->rx.buf, after the START marker of this frame */
+    size_t tag_len = frame_tag(v->rx.buf, (size_t)(req - v->rx.buf), &tag);
+
+    char *own;
+    size_t body_len;
+    const char *body = responder_answer(&l->rs, req, len, &body_len, &own);
+    if (!body) return -1;
+
+    size_t garbage = dice(l, l->o->faults.garbage_pct) ? 1 + (size_t)(rand_r(&l->seed) % VDEV_GARBAGE_MAX) : 0;
+    size_t total = garbage + UART_COM_START_LEN + tag_len + body_len + UART_COM_END_LEN;
+    struct reply *r = calloc(1, sizeof(*r));
+    char *d = r ? malloc(total) : NULL;
+    if (!d) {
+        free(r);
+        free(own);
+        return -1;
+    }
+    char *p = d;
+    for (size_t i = 0; i < garbage; i++) {
+        char c = (char)(rand_r(&l->seed) & 0xff);
+        *p++ = c == '[' ? '#' : c;   /* noise, never the start of a marker */
+    }
+    memcpy(p, UART_COM_START, UART_COM_START_LEN);
+    p += UART_COM_START_LEN;
+    if (tag_len) memcpy(p, tag, tag_len);
+    p += tag_len;
+    memcpy(p, body, body_len);
+    p += body_len;
+    memcpy(p, UART_COM_END, UART_COM_END_LEN);
+    free(own);
+
+    r->data = d;
+    r->len = total;
+    r->ready_us = now_us() + (uint64_t)l->o->turnaround_ms * 1000u;
+    if (dice(l, l->o->faults.stall_pct)) {
+        r->pause_at = total / 2;
+        r->pause_us = VDEV_STALL_MS * 1000u;
+    } else if (dice(l, l->o->faults.split_pct)) {
+        r->pause_at = total - UART_COM_END_LEN / 2;
+        r->pause_us = VDEV_SPLIT_GAP_MS * 1000u;
+    }
+    if (garbage || r->pause_us) l->faults++;
+
+    if (v->tail) v->tail->next = r;
+    else v->head = r;
+    v->tail = r;
+    return 0;
+}
+
+static int vdev_read(struct vdev_loop *l, struct vdev *v) {
+    unsigned char chunk[RX_CHUNK];
+    for (;;) {
+        ssize_t n = read(v->master, chunk, sizeof(chunk));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EIO) { errno = 0; return 0; }
+            return -1;
+        }
+        if (n == 0) return 0;
+        l->cur = v;
+        if (frame_split_feed(&v->rx, chunk, (size_t)n, vdev_request, l) != 0) return -1;
+        if (v->rx.len > VDEV_MAX_FRAME) {
+            log_warning("%s: %zu bytes without an END marker, dropped", v->path, v->rx.len);
+            v->rx.len = v->rx.scanned = 0;
+            marker_scanner_init(&v->rx.sc, UART_COM_END);
+        }
+    }
+}
+
+/* write what turnaround, pauses and pacing allow now. Returns 1 if the PTY
+   is full (wait for POLLOUT), 0 otherwise; *wake_ns is lowered to when
+   there is more to do. */
+static int vdev_write(struct vdev_loop *l, struct vdev *v, uint64_t now, uint64_t *wake_ns) {
+    struct reply *r;
+    while ((r = v->head)) {
+        if (now < r->ready_us * 1000u) {
+            if (r->ready_us * 1000u < *wake_ns) *wake_ns = r->ready_us * 1000u;
+            return 0;
+        }
+        if (r->pause_us && r->sent == r->pause_at) {
+            r->ready_us = now / 1000u + r->pause_us;
+            r->pause_us = 0;
+            continue;
+        }
+        size_t want = (r->pause_us ? r->pause_at : r->len) - r->sent;
+        if (l->byte_ns) {
+            /* poll() sleeps in whole milliseconds, so pacing is kept on
+               average; credit from an idle line is capped at PACE_SLACK_NS */
+            if (v->next_ns + PACE_SLACK_NS < now) v->next_ns = now;
+            if (v->next_ns > now) {
+                if (v->next_ns < *wake_ns) *wake_ns = v->next_ns;
+                return 0;
+            }
+            uint64_t allowed = 1 + (now - v->next_ns) / l->byte_ns;
+            if (want > allowed) want = (size_t)allowed;
+        }
+        ssize_t n = write(v->master, r->data + r->sent, want);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { errno = 0; return 1; }
+            log_warning("%s: write failed, reply dropped", v->path);
+            n = (ssize_t)(r->len - r->sent);
+        }
+        r->sent += (size_t)n;
+        v->next_ns += (uint64_t)n * l->byte_ns;
+        if (r->sent < r->len) continue;
+
+        v->head = r->next;
+        if (!v->head) v->tail = NULL;
+        free(r->data);
+        free(r);
+        v->served++;
+        l->served++;
+    }
+    return 0;
+}
+
+/* enough descriptors for every master and slave plus the usual few */
+static void raise_fd_limit(int count) {
+    struct rlimit rl;
+    rlim_t want = (rlim_t)count * 2 + 32;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= want) return;
+    rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int run_virtual(const struct vdev_opts *o) {
+    struct vdev_loop l = { .o = o };
+    l.seed = o->seed ? o->seed : (unsigned)now_ns();
+    l.byte_ns = o->baud_rate > 0 ? 10000000000u / (uint64_t)o->baud_rate : 0;
+    raise_fd_limit(o->count);
+    l.devs = calloc((size_t)o->count, sizeof(*l.devs));
+    l.pfds = calloc((size_t)o->count, sizeof(*l.pfds));
+    int ret = -1, opened = 0;
+    if (!l.devs || !l.pfds) {
+        log_error("Out of memory for %d virtual devices", o->count);
+        goto out;
+    }
+    for (; opened < o->count; opened++) {
+        if (vdev_open(&l.devs[opened]) != 0) goto out;
+        l.pfds[opened].fd = l.devs[opened].master;
+        printf("%s\n", l.devs[opened].path);
+    }
+    fflush(stdout);
+    if (responder_load(&l.rs, o->respond_path) != 0) goto out;
+    log_info("Serving %d virtual devices (%s, turnaround %ld ms, faults split %d%% garbage %d%% stall %d%%)",
+             o->count, o->respond_path ? o->respond_path : "echo", o->turnaround_ms,
+             o->faults.split_pct, o->faults.garbage_pct, o->faults.stall_pct);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!vdev_stop) {
+        uint64_t now = now_ns(), wake = UINT64_MAX;
+        for (int i = 0; i < o->count; i++) {
+            struct vdev *v = &l.devs[i];
+            int full = v->head ? vdev_write(&l, v, now, &wake) : 0;
+            l.pfds[i].events = (short)(POLLIN | (full ? POLLOUT : 0));
+        }
+        int timeout = wake == UINT64_MAX ? -1 : (int)((wake - now + 999999u) / 1000000u);
+        if (poll(l.pfds, (nfds_t)o->count, timeout) < 0) {
+            if (errno == EINTR) continue;
+            log_error("poll() failed");
+            goto out;
+        }
+        for (int i = 0; i < o->count; i++) {
+            if ((l.pfds[i].revents & POLLIN) && vdev_read(&l, &l.devs[i]) != 0) {
+                log_error("%s: read failed", l.devs[i].path);
+                goto out;
+            }
+        }
+    }
+    errno = 0;
+    log_info("Virtual devices stopped: %lu replies, %lu with faults", l.served, l.faults);
+    ret = 0;
+
+out:
+    for (int i = 0; i < opened; i++) vdev_close(&l.devs[i]);
+    free(l.devs);
+    free(l.pfds);
+    responder_free(&l.rs);
+    return ret;
+}
@@ -0,0 +1,40 @@
+// vdev.h - virtual devices: PTYs that answer [UART_COM] frames like a board would
+#ifndef UART_VDEV_H
+#define UART_VDEV_H
+
+#define VDEV_MAX 2048
+#define VDEV_MAX_FRAME (1024u * 1024u)   /* request bytes held while waiting for END */
+#define VDEV_STALL_MS 1000               /* pause in the middle of a stalled reply */
+#define VDEV_SPLIT_GAP_MS 5              /* pause inside the END marker of a split reply */
+#define VDEV_GARBAGE_MAX 16              /* noise bytes ahead of a reply */
+
+/* injected faults, each the percentage of replies it hits */
+struct vdev_faults {
+    int split_pct;      /* END marker arrives in two reads */
+    int garbage_pct;    /* random bytes before the START marker */
+    int stall_pct;      /* reply stops halfway for VDEV_STALL_MS */
+};
+
+struct vdev_opts {
+    int count;                  /* PTYs to create */
+    long baud_rate;             /* pace replies at this line rate; 0 = unpaced */
+    long turnaround_ms;         /* delay between request END and the first reply byte */
+    const char *respond_path;   /* script or capture file; NULL echoes requests */
+    struct vdev_faults faults;
+    unsigned seed;              /* fault dice; 0 picks one from the clock */
+};
+
+/* A script has one rule per line, "request<TAB>reply", with \r \n \t \\
+   and \xNN escapes in both halves; a request of "*" matches anything and
+   '#' starts a comment. A capture (-C file) is replayed instead: the n-th
+   frame sent on channel 0 is paired with the n-th frame received, the k-th
+   repeat of a request gets the reply to its k-th recorded occurrence (then
+   round again), and requests it never saw get its replies in recorded order. Replies keep
+   a request's [SEQ:x] tag, so pipelined clients work too. */
+
+/* create the PTYs, print their paths as the first count lines of stdout
+   (logging follows), load the responder and serve them all from one
+   poll() loop until SIGINT/SIGTERM. Returns 0 on a clean shutdown. */
+int run_virtual(const struct vdev_opts *o);
+
+#endif